@@ -1,4 +1,6 @@
 #include "audio.h"
+#include "audio_clip_cache.h"
+#include "audio_mixer.h"
 #include "ff.h"
 #include "hardware/gpio.h"
 #include "hardware/dma.h"
@@ -6,135 +8,300 @@
 #include "hardware/irq.h"
 #include "pico/printf.h"
 #include "pico/mutex.h"
+#include "spsc_queue.h"
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
 #define AUDIO_PIN 18
 
+// Samples are written to the PWM by DMA, one per tick of a DMA pacing timer, so the buffers only
+// hold each sample once. Their length only sets the latency (16.8 ms at 512 samples) and how much
+// is read from the SD card at a time:
 #define SAMPLES_IN_BUFFER 512
+
+// Number of buffers read ahead for each voice, which is how long the SD card can keep
+// audio_update() waiting before a voice runs dry (67 ms). Must be a power of 2:
+#define AUDIO_STREAM_BUFFER_COUNT 4
+
+#if SAMPLES_IN_BUFFER != AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER
+#error "Cached clips must be split into buffers of the same size as the audio buffers"
+#endif
 #define BITS_PER_SAMPLE 10 // PWM frequency = 125 MHz / 2^10 = 122.070 kHz
 #define PWM_CYCLES_PER_SAMPLE 4 // Audio sample rate = 122070 / 4 = 30.518 kHz
 
-#define SAMPLE_RATE (125000000 / POWER_OF_2(BITS_PER_SAMPLE) / PWM_CYCLES_PER_SAMPLE)
-#define AUDIO_BUFFER_SIZE (SAMPLES_IN_BUFFER * PWM_CYCLES_PER_SAMPLE)
+// The DMA timer ticks once every this many system clock cycles. A whole number of PWM periods per
+// sample means every sample is output for the same number of PWM periods:
+#define CLOCK_CYCLES_PER_SAMPLE (POWER_OF_2(BITS_PER_SAMPLE) * PWM_CYCLES_PER_SAMPLE)
+#define SAMPLE_RATE (125000000 / CLOCK_CYCLES_PER_SAMPLE)
 
 // Convert a sample from signed 16-bit format to internal format.
 #define CONVERT_SAMPLE_FROM_S16(s) (((s + POWER_OF_2(15)) >> (16 - BITS_PER_SAMPLE)) & POWER_OF_2(BITS_PER_SAMPLE) - 1)
 
 #define POWER_OF_2(x) (1 << x)
 
-static dma_channel_config pwm_dma_channel_config;
-static uint pwm_dma_channel;
+static uint pwm_dma_channels[2];
+static int pwm_dma_timer;
 static uint audio_pin_slice;
 
 static uint fill_write_buffer_irq;
 
 static bool audio_initialised = false;
 
-// Use two audio buffers. Audio plays from one while the program fills the other.
-// When audio gets to the end of the playback buffer, the buffers are swaped over.
-static uint16_t audio_buffer_a[AUDIO_BUFFER_SIZE];
-static uint16_t audio_buffer_b[AUDIO_BUFFER_SIZE];
-static uint16_t *playback_buffer = audio_buffer_a;
-static uint16_t *write_buffer = audio_buffer_b;
+// Use two audio buffers, each played by its own DMA channel. Audio plays from one while the program
+// fills the other. The channels are chained to each other, so when audio gets to the end of one
+// buffer, the hardware starts on the other straight away. The finished buffer becomes the write
+// buffer, and it must be refilled before the other buffer finishes playing.
+static uint16_t audio_buffers[2][SAMPLES_IN_BUFFER];
+static uint16_t *write_buffer = audio_buffers[1];
 
 static FATFS fat_fs;
+static bool is_sd_card_mounted = false;
+
+// FatFs and the SD card can only be used by one thing at a time, so file_mutex also covers any
+// other files read through audio_claim_sd_card():
 static mutex_t file_mutex;
 
-// These variables must be accessed through the protection of file_mutex:
-static FIL audio_file;
-static size_t samples_remaining_in_file;
-static bool is_file_open = false;
-// **********************************************************************
+// A buffer's worth of samples read from a voice's file, and the sound they belong to:
+typedef struct
+{
+    uint32_t generation;
+    size_t sample_count;
+    int16_t samples[SAMPLES_IN_BUFFER];
+} stream_buffer_t;
+
+// Each voice streams one sound from the SD card, or plays one from the clip cache. Sounds on
+// different voices are mixed together, so they can overlap. Files are read ahead by audio_update()
+// into the voice's stream, and fill_write_buffer_irh() only takes buffers that are already there, so
+// it never waits for the SD card.
+typedef struct
+{
+    // These variables must be accessed through the protection of file_mutex:
+    FIL file;
+    size_t samples_remaining_in_file;
+    volatile bool is_file_open; // also read by fill_write_buffer_irh(), to spot underruns
+
+    // A clip being filled in as the file is read, so that the sound is cached for next time:
+    audio_clip_t *filling_clip;
+    size_t filling_position;
+    // **********************************************************************
+
+    // A cached clip being played instead of a file, and the next buffer of it to play. Set while
+    // holding file_mutex, and cleared by fill_write_buffer_irh() at the end of the clip:
+    audio_clip_t *volatile clip;
+    volatile size_t clip_position;
+
+    // Added to while holding file_mutex, and removed from by fill_write_buffer_irh():
+    spsc_queue_t stream;
+    stream_buffer_t stream_buffers[AUDIO_STREAM_BUFFER_COUNT];
+
+    // The first buffer of a sound, if the stream was still full of buffers from the sound before.
+    // Set while holding file_mutex, and cleared by fill_write_buffer_irh() once it's played ahead
+    // of the stream. Nothing more is streamed until then, so the order is kept:
+    stream_buffer_t pending_buffer;
+    atomic_bool has_pending_buffer;
+
+    // Counts the sounds started on this voice. Buffers left over from an earlier sound are skipped:
+    atomic_uint_least32_t generation;
+    volatile uint16_t gain;
+} voice_t;
+
+static voice_t voices[AUDIO_VOICE_COUNT];
+
+// Must be accessed through the protection of file_mutex, apart from the samples of clips that
+// voices are playing, which fill_write_buffer_irh() reads:
+static audio_clip_cache_t clip_cache;
+
+// Voices are mixed in here before being written to write_buffer:
+static int32_t mix[SAMPLES_IN_BUFFER];
+
+// Buffers being read from the SD card (holding file_mutex), and being mixed by
+// fill_write_buffer_irh():
+static stream_buffer_t read_buffer;
+static stream_buffer_t mix_buffer;
+
+static volatile uint32_t underrun_count = 0;
+
+// The voice that audio_update() tries to read ahead for first on its next call:
+static size_t next_stream_voice = 0;
 
 static void playback_buffer_finished_irh()
 {
     // This interrupt is potentially shared by other DMA channels.
-    // Check that our DMA channel triggered the interrupt.
-    if (dma_channel_get_irq1_status(pwm_dma_channel))
+    // Check which of our DMA channels triggered the interrupt, if any.
+    for (size_t i = 0; i < 2; i++)
     {
-        // Swap playback and write buffers:
-        uint16_t *temp_ptr = playback_buffer;
-        playback_buffer = write_buffer;
-        write_buffer = temp_ptr;
-
-        // Start next buffer playback:
-        dma_channel_set_read_addr(pwm_dma_channel, playback_buffer, true);
+        if (dma_channel_get_irq1_status(pwm_dma_channels[i]))
+        {
+            // The other channel is already playing its buffer. Rewind this one, ready for the
+            // other to start it again once it's finished:
+            dma_channel_set_read_addr(pwm_dma_channels[i], audio_buffers[i], false);
+            write_buffer = audio_buffers[i];
 
-        // Trigger interrupt handler for filling the next buffer:
-        irq_set_pending(fill_write_buffer_irq);
+            // Trigger interrupt handler for filling the next buffer:
+            irq_set_pending(fill_write_buffer_irq);
 
-        // Clear interrupt request:
-        dma_channel_acknowledge_irq1(pwm_dma_channel);
+            // Clear interrupt request:
+            dma_channel_acknowledge_irq1(pwm_dma_channels[i]);
+        }
     }
 }
 
-static void fill_write_buffer_irh()
+// Adds the next buffer of a voice's samples to the mix:
+static void mix_voice(voice_t *voice)
 {
-    // Fill the write buffer with samples. Start by trying to read samples from the audio file.
-    // "Stretch out" these samples by duplicating them by PWM_CYCLES_PER_SAMPLE. For example if
-    // PWM_CYCLES_PER_SAMPLE is 2, and the buffer had samples written like
-    // [ 0, 1, 2, 3, x, x, x, x, x, x, x, x ]
-    // convert the buffer to
-    // [ 0, 0, 1, 1, 2, 2, 3, 3, x, x, x, x ].
-    // Then if there are any remaining samples to be written (because there is no file playing
-    // or the file just ended), fill them with zeros:
-    // [ 0, 0, 1, 1, 2, 2, 3, 3, 0, 0, 0, 0 ].
-
-    size_t sample_count = 0;
-
-    // If file_mutex is already claimed, the program must be changing audio file. Don't bother waiting
-    // to claim the mutex, since that will deadlock the program. Since a new file is about to be
-    // played anyway, just fill the buffer with zeros.
-    if (mutex_try_enter(&file_mutex, NULL))
-    {
-        if (is_file_open)
+    audio_clip_t *clip = voice->clip;
+    if (clip != NULL)
+    {
+        size_t position = voice->clip_position;
+        audio_mixer_add_voice(mix, audio_clip_cache_get_samples(&clip_cache, clip, position),
+            audio_clip_cache_get_sample_count(clip, position), voice->gain);
+
+        if (++position < clip->buffer_count)
+        {
+            voice->clip_position = position;
+        }
+        else
+        {
+            voice->clip = NULL;
+        }
+
+        // Anything in the stream is left over from a file the voice was playing before:
+        while (spsc_queue_try_remove(&voice->stream, NULL))
+        {
+        }
+        atomic_store_explicit(&voice->has_pending_buffer, false, memory_order_release);
+        return;
+    }
+
+    uint32_t generation = atomic_load_explicit(&voice->generation, memory_order_acquire);
+    if (atomic_load_explicit(&voice->has_pending_buffer, memory_order_acquire))
+    {
+        // Whatever is in the stream is older still, so skip it all now to make space for the rest
+        // of the sound:
+        while (spsc_queue_try_remove(&voice->stream, NULL))
+        {
+        }
+
+        bool is_current = voice->pending_buffer.generation == generation;
+        if (is_current)
+        {
+            audio_mixer_add_voice(mix, voice->pending_buffer.samples, voice->pending_buffer.sample_count, voice->gain);
+        }
+        atomic_store_explicit(&voice->has_pending_buffer, false, memory_order_release);
+        if (is_current)
         {
-            size_t bytes_read;
-            size_t bytes_to_read = (samples_remaining_in_file > SAMPLES_IN_BUFFER)
-                ? sizeof(write_buffer[0]) * SAMPLES_IN_BUFFER
-                : sizeof(write_buffer[0]) * samples_remaining_in_file;
+            return;
+        }
+    }
 
-            f_read(&audio_file, write_buffer, bytes_to_read, &bytes_read);
+    while (spsc_queue_try_remove(&voice->stream, &mix_buffer))
+    {
+        if (mix_buffer.generation == generation)
+        {
+            audio_mixer_add_voice(mix, mix_buffer.samples, mix_buffer.sample_count, voice->gain);
+            return;
+        }
+    }
 
-            sample_count = bytes_read / sizeof(write_buffer[0]); // divide bytes_read by number of bytes per sample
-            samples_remaining_in_file -= sample_count;
+    // Nothing was read ahead in time, so this voice is silent for a buffer:
+    if (voice->is_file_open)
+    {
+        underrun_count++;
+    }
+}
 
-            // Check if we've read all the samples or if we've reached the end of the file:
-            if (samples_remaining_in_file == 0 || bytes_read < bytes_to_read)
+// Reads the next buffer of a voice's file onto the end of its stream. file_mutex must be held, and
+// there must be space in the stream, or nothing in it from the current sound and no pending
+// buffer:
+static void stream_voice(voice_t *voice)
+{
+    size_t bytes_read;
+    size_t bytes_to_read = (voice->samples_remaining_in_file > SAMPLES_IN_BUFFER)
+        ? sizeof(read_buffer.samples[0]) * SAMPLES_IN_BUFFER
+        : sizeof(read_buffer.samples[0]) * voice->samples_remaining_in_file;
+
+    f_read(&voice->file, read_buffer.samples, bytes_to_read, &bytes_read);
+
+    read_buffer.sample_count = bytes_read / sizeof(read_buffer.samples[0]); // divide bytes_read by number of bytes per sample
+    read_buffer.generation = atomic_load_explicit(&voice->generation, memory_order_relaxed);
+    voice->samples_remaining_in_file -= read_buffer.sample_count;
+
+    // Keep a copy for the clip cache:
+    audio_clip_t *clip = voice->filling_clip;
+    if (clip != NULL && read_buffer.sample_count > 0)
+    {
+        memcpy(audio_clip_cache_get_samples(&clip_cache, clip, voice->filling_position++),
+            read_buffer.samples, bytes_read);
+    }
+
+    // Check if we've read all the samples or if we've reached the end of the file:
+    if (voice->samples_remaining_in_file == 0 || bytes_read < bytes_to_read)
+    {
+        f_close(&voice->file);
+        voice->is_file_open = false;
+
+        // A file that ends early doesn't have all the samples the clip was made for:
+        if (clip != NULL)
+        {
+            if (voice->samples_remaining_in_file == 0)
             {
-                f_close(&audio_file);
-                is_file_open = false;
+                audio_clip_cache_complete(&clip_cache, clip);
             }
-
-            // Convert all samples to correct format and duplicate samples by PWM_CYCLES_PER_SAMPLE.
-            // Because we'll be "stretching out" the buffer, we need to start at the end so that we don't
-            // overwrite samples we haven't processed yet.
-            for (
-                size_t sample_index = sample_count - 1;
-                sample_index != -1;
-                sample_index--)
+            else
             {
-                // The WAVE files we're reading store values as signed 16 bit values, but PWM will need
-                // unsigned. We may also want to change the bit depth.
-                uint16_t sample = CONVERT_SAMPLE_FROM_S16(write_buffer[sample_index]);
-
-                // Duplicate the sample PWM_CYCLES_PER_SAMPLE times:
-                for (size_t i = 0; i < PWM_CYCLES_PER_SAMPLE; i++)
-                {
-                    write_buffer[sample_index * PWM_CYCLES_PER_SAMPLE + i] = sample;
-                }
+                audio_clip_cache_remove(&clip_cache, clip);
             }
+            voice->filling_clip = NULL;
+        }
+    }
+
+    if (read_buffer.sample_count > 0 && !spsc_queue_try_add(&voice->stream, &read_buffer))
+    {
+        // The stream is full of buffers from a sound that was stopped, which
+        // fill_write_buffer_irh() hasn't skipped yet. Keep this one aside to play first:
+        voice->pending_buffer = read_buffer;
+        atomic_store_explicit(&voice->has_pending_buffer, true, memory_order_release);
+    }
+}
+
+// Returns whether a clip is playing on any voice, for the clip cache:
+static bool is_clip_playing(void *context, const audio_clip_t *clip)
+{
+    (void)context;
+    for (size_t i = 0; i < AUDIO_VOICE_COUNT; i++)
+    {
+        if (voices[i].clip == clip)
+        {
+            return true;
         }
-        mutex_exit(&file_mutex);
-    } // end of file reading
+    }
+    return false;
+}
 
-    // Fill any remaining samples with zeros:
-    size_t start_index = sample_count * PWM_CYCLES_PER_SAMPLE;
-    for (size_t i = start_index; i < AUDIO_BUFFER_SIZE; i++)
+static void fill_write_buffer_irh()
+{
+    // Fill the write buffer with samples, by mixing together the next samples from every voice
+    // that's playing. Any voice that has run out of samples (or that isn't playing) adds silence.
+    uint16_t *buffer = write_buffer;
+
+    // The samples have already been read from the SD card by audio_update(), so this doesn't need
+    // file_mutex, and plays on while something else is using the card:
+    audio_mixer_clear(mix, SAMPLES_IN_BUFFER);
+    for (size_t i = 0; i < AUDIO_VOICE_COUNT; i++)
     {
-        write_buffer[i] = CONVERT_SAMPLE_FROM_S16(0);
+        mix_voice(&voices[i]);
+    }
+
+    // Clip the mix back to signed 16-bit samples, like the WAVE files store them:
+    int16_t *mixed_samples = (int16_t *)buffer;
+    audio_mixer_output(mix, mixed_samples, SAMPLES_IN_BUFFER);
+
+    // PWM will need unsigned values rather than signed. We may also want to change the bit depth.
+    for (size_t i = 0; i < SAMPLES_IN_BUFFER; i++)
+    {
+        buffer[i] = CONVERT_SAMPLE_FROM_S16(mixed_samples[i]);
     }
 
     // Clear interrupt request:
@@ -158,15 +325,37 @@ void audio_init()
         return;
     }
     mutex_init(&file_mutex);
+    is_sd_card_mounted = true;
+
+    for (size_t i = 0; i < AUDIO_VOICE_COUNT; i++)
+    {
+        spsc_queue_init(&voices[i].stream, voices[i].stream_buffers, sizeof(stream_buffer_t), AUDIO_STREAM_BUFFER_COUNT);
+        atomic_init(&voices[i].generation, 0);
+        atomic_init(&voices[i].has_pending_buffer, false);
+    }
+    audio_clip_cache_init(&clip_cache, is_clip_playing, NULL);
 
-    // Claim DMA channel:
-    pwm_dma_channel = dma_claim_unused_channel(false); // don't panic
-    if (pwm_dma_channel == -1)
+    // Claim a DMA channel for each buffer:
+    for (size_t i = 0; i < 2; i++)
     {
-        // Can't play audio since we need a DMA channel.
-        printf("audio: Error: Failed to claim DMA channel. Continuing without audio.\n");
+        pwm_dma_channels[i] = dma_claim_unused_channel(false); // don't panic
+        if (pwm_dma_channels[i] == -1)
+        {
+            // Can't play audio since we need the DMA channels.
+            printf("audio: Error: Failed to claim DMA channel. Continuing without audio.\n");
+            return;
+        }
+    }
+
+    // Claim a DMA pacing timer, to write samples at the sample rate:
+    pwm_dma_timer = dma_claim_unused_timer(false); // don't panic
+    if (pwm_dma_timer == -1)
+    {
+        // Can't play audio since nothing would pace the samples.
+        printf("audio: Error: Failed to claim DMA timer. Continuing without audio.\n");
         return;
     }
+    dma_timer_set_fraction(pwm_dma_timer, 1, CLOCK_CYCLES_PER_SAMPLE);
 
     // Claim user IRQ:
     fill_write_buffer_irq = user_irq_claim_unused(false); // don't panic
@@ -185,25 +374,31 @@ void audio_init()
     pwm_config_set_wrap(&config, POWER_OF_2(BITS_PER_SAMPLE) - 1);
     pwm_init(audio_pin_slice, &config, true); // start PWM now
 
-    // Set up DMA:
-    pwm_dma_channel_config = dma_channel_get_default_config(pwm_dma_channel);
-    channel_config_set_transfer_data_size(&pwm_dma_channel_config, DMA_SIZE_16);
-    channel_config_set_read_increment(&pwm_dma_channel_config, true);
-    channel_config_set_write_increment(&pwm_dma_channel_config, false);
-    channel_config_set_dreq(&pwm_dma_channel_config, DREQ_PWM_WRAP0 + audio_pin_slice); // transfer each time PWM overflows
-    dma_channel_configure(
-        pwm_dma_channel,
-        &pwm_dma_channel_config,
-        &pwm_hw->slice[audio_pin_slice].cc, // write to PWM counter-compare
-        playback_buffer, // read from playback_buffer
-        AUDIO_BUFFER_SIZE,
-        false // don't start yet
-    );
-
-    // Set up interrupt handler for DMA finish:
-    dma_channel_set_irq1_enabled(pwm_dma_channel, true);
-    irq_set_priority(DMA_IRQ_1, PICO_HIGHEST_IRQ_PRIORITY); // needs to be serviced quickly to avoid glitches in the audio.
-    irq_add_shared_handler(DMA_IRQ_1, playback_buffer_finished_irh, PICO_SHARED_IRQ_HANDLER_HIGHEST_ORDER_PRIORITY);
+    // Set up DMA. Each channel plays its buffer, then starts the other channel:
+    for (size_t i = 0; i < 2; i++)
+    {
+        dma_channel_config dma_config = dma_channel_get_default_config(pwm_dma_channels[i]);
+        channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_16);
+        channel_config_set_read_increment(&dma_config, true);
+        channel_config_set_write_increment(&dma_config, false);
+        channel_config_set_dreq(&dma_config, dma_get_timer_dreq(pwm_dma_timer)); // transfer once per sample
+        channel_config_set_chain_to(&dma_config, pwm_dma_channels[1 - i]);
+        dma_channel_configure(
+            pwm_dma_channels[i],
+            &dma_config,
+            &pwm_hw->slice[audio_pin_slice].cc, // write to PWM counter-compare, which takes effect at the next wrap
+            audio_buffers[i], // read from this channel's buffer
+            SAMPLES_IN_BUFFER,
+            false // don't start yet
+        );
+        dma_channel_set_irq1_enabled(pwm_dma_channels[i], true);
+    }
+
+    // Set up interrupt handler for DMA finish. Playback carries on in hardware while it waits, so
+    // it only has to rewind the finished channel before the other one finishes, and doesn't need
+    // a high priority:
+    irq_set_priority(DMA_IRQ_1, PICO_DEFAULT_IRQ_PRIORITY);
+    irq_add_shared_handler(DMA_IRQ_1, playback_buffer_finished_irh, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
     irq_set_enabled(DMA_IRQ_1, true);
 
     // Set up interrupt handler for filling the write_buffer:
@@ -219,28 +414,14 @@ void audio_init()
     printf("audio: Initialisation successful.\n");
 
     // Start the first DMA transfer. Subsequent transfers will be triggered
-    // automatically whenever the whole buffer has been played.
-    dma_channel_start(pwm_dma_channel);
+    // automatically by the other channel whenever the whole buffer has been played.
+    dma_channel_start(pwm_dma_channels[0]);
 }
 
-void audio_play_sound(size_t sound_number)
+// Opens the WAVE file for a sound, leaving it at the start of the samples. Returns false, with the
+// file closed, if it can't be opened or played. file_mutex must be held:
+static bool open_wave_file(FIL *audio_file, size_t sound_number, size_t *sample_count)
 {
-    // If audio wasn't initialised, we can't play audio:
-    if (!audio_initialised)
-    {
-        printf("audio: Error: Can't play audio file. Audio not initialised.\n");
-        return;
-    }
-
-    mutex_enter_blocking(&file_mutex);
-
-    // If a file is open, close it:
-    if (is_file_open)
-    {
-        f_close(&audio_file);
-        is_file_open = false;
-    }
-
     // Audio files have numeric names (in lowercase hex) like "5b.wav", given by the sound_number.
     const size_t filename_length =
         sizeof(sound_number) * 2 // enough space for two hex digits per byte
@@ -250,18 +431,15 @@ void audio_play_sound(size_t sound_number)
     snprintf(filename, filename_length, "%x.wav", sound_number);
 
     // Open file:
-    FRESULT result = f_open(&audio_file, filename, FA_READ);
+    FRESULT result = f_open(audio_file, filename, FA_READ);
     if (result == FR_OK)
     {
-        is_file_open = true;
-        samples_remaining_in_file = 0; // default value in case we can't process the file
-
         size_t bytes_read;
         uint8_t buffer[4];
 
         // Read RIFF header "ChunkID":
-        f_lseek(&audio_file, 0); // make sure we're at the beginning of the file
-        f_read(&audio_file, buffer, 4, &bytes_read);
+        f_lseek(audio_file, 0); // make sure we're at the beginning of the file
+        f_read(audio_file, buffer, 4, &bytes_read);
         if (memcmp(buffer, "RIFF", 4) != 0)
         {
             printf("audio: Error: Audio file \"%s\" is not a valid RIFF (WAVE) file.", filename);
@@ -269,8 +447,8 @@ void audio_play_sound(size_t sound_number)
         }
 
         // Read format (should be WAVE):
-        f_lseek(&audio_file, 8); // seek to format
-        f_read(&audio_file, buffer, 4, &bytes_read);
+        f_lseek(audio_file, 8); // seek to format
+        f_read(audio_file, buffer, 4, &bytes_read);
         if (memcmp(buffer, "WAVE", 4) != 0)
         {
             printf("audio: Error: Audio file \"%s\" is not a valid WAVE file.", filename);
@@ -278,8 +456,8 @@ void audio_play_sound(size_t sound_number)
         }
 
         // Read audio format (should be PCM):
-        f_lseek(&audio_file, 20); // seek to audio format
-        f_read(&audio_file, buffer, 2, &bytes_read);
+        f_lseek(audio_file, 20); // seek to audio format
+        f_read(audio_file, buffer, 2, &bytes_read);
         uint16_t audio_format = (buffer[1] << 8) | (buffer[0]);
         if (audio_format != 1) // PCM format
         {
@@ -288,8 +466,8 @@ void audio_play_sound(size_t sound_number)
         }
 
         // Read number of channels (should be 1):
-        f_lseek(&audio_file, 22); // seek to number of channels
-        f_read(&audio_file, buffer, 2, &bytes_read);
+        f_lseek(audio_file, 22); // seek to number of channels
+        f_read(audio_file, buffer, 2, &bytes_read);
         uint16_t num_channels = (buffer[1] << 8) | (buffer[0]);
         if (num_channels != 1)
         {
@@ -298,8 +476,8 @@ void audio_play_sound(size_t sound_number)
         }
 
         // Read bits per sample (should be 16):
-        f_lseek(&audio_file, 34); // seek to bits per sample
-        f_read(&audio_file, buffer, 2, &bytes_read);
+        f_lseek(audio_file, 34); // seek to bits per sample
+        f_read(audio_file, buffer, 2, &bytes_read);
         uint16_t bits_per_sample = (buffer[1] << 8) | (buffer[0]);
         if (bits_per_sample != 16)
         {
@@ -310,8 +488,8 @@ void audio_play_sound(size_t sound_number)
         printf("audio: Playing audio file \"%s\".\n", filename);
 
         // Read sample rate:
-        f_lseek(&audio_file, 24); // seek to sample rate
-        f_read(&audio_file, buffer, 4, &bytes_read);
+        f_lseek(audio_file, 24); // seek to sample rate
+        f_read(audio_file, buffer, 4, &bytes_read);
         uint32_t file_sample_rate = (buffer[3] << 24) | (buffer[2] << 16) | (buffer[1] << 8) | (buffer[0]);
         if (file_sample_rate != SAMPLE_RATE)
         {
@@ -323,25 +501,277 @@ void audio_play_sound(size_t sound_number)
         }
 
         // Read number of samples:
-        f_lseek(&audio_file, 40); // seek to data size
-        f_read(&audio_file, buffer, 4, &bytes_read);
+        f_lseek(audio_file, 40); // seek to data size
+        f_read(audio_file, buffer, 4, &bytes_read);
         uint32_t data_size = (buffer[3] << 24) | (buffer[2] << 16) | (buffer[1] << 8) | (buffer[0]);
-        samples_remaining_in_file = data_size / 2;
+        *sample_count = data_size / 2;
 
         // Place file pointer at the start of the samples:
-        f_lseek(&audio_file, 44);
+        f_lseek(audio_file, 44);
+        return true;
     }
     else
     {
         printf("audio: Error: Failed to open audio file \"%s\".\n", filename);
+        return false;
     }
 
-    mutex_exit(&file_mutex);
-    return;
-
 invalid_file:
     // If the file couldn't be processed, close it:
-    f_close(&audio_file);
-    is_file_open = false;
+    f_close(audio_file);
+    return false;
+}
+
+// Stops whatever a voice is playing, including anything already read ahead. file_mutex must be
+// held:
+static void stop_voice(voice_t *voice)
+{
+    atomic_fetch_add_explicit(&voice->generation, 1, memory_order_release);
+    voice->clip = NULL;
+
+    if (voice->is_file_open)
+    {
+        f_close(&voice->file);
+        voice->is_file_open = false;
+    }
+
+    // The clip being filled in won't get the rest of its samples now:
+    if (voice->filling_clip != NULL)
+    {
+        audio_clip_cache_remove(&clip_cache, voice->filling_clip);
+        voice->filling_clip = NULL;
+    }
+}
+
+// Returns roughly how many samples a voice has left to play. file_mutex must be held:
+static size_t get_samples_remaining(voice_t *voice)
+{
+    size_t samples_remaining = voice->samples_remaining_in_file + spsc_queue_get_level(&voice->stream) * SAMPLES_IN_BUFFER;
+
+    audio_clip_t *clip = voice->clip;
+    if (clip != NULL)
+    {
+        samples_remaining += clip->sample_count - voice->clip_position * SAMPLES_IN_BUFFER;
+    }
+    return samples_remaining;
+}
+
+// Reads a whole sound into the clip cache. Returns NULL if it can't be read or doesn't fit.
+// file_mutex must be held:
+static audio_clip_t *load_clip(size_t sound_number)
+{
+    static FIL file;
+    size_t sample_count;
+    if (!open_wave_file(&file, sound_number, &sample_count))
+    {
+        return NULL;
+    }
+
+    audio_clip_t *clip = audio_clip_cache_add(&clip_cache, sound_number, sample_count);
+    for (size_t i = 0; clip != NULL && i < clip->buffer_count; i++)
+    {
+        size_t bytes_read;
+        size_t bytes_to_read = sizeof(int16_t) * audio_clip_cache_get_sample_count(clip, i);
+        if (f_read(&file, audio_clip_cache_get_samples(&clip_cache, clip, i), bytes_to_read, &bytes_read) != FR_OK
+            || bytes_read < bytes_to_read)
+        {
+            audio_clip_cache_remove(&clip_cache, clip);
+            clip = NULL;
+        }
+    }
+    f_close(&file);
+
+    if (clip != NULL)
+    {
+        audio_clip_cache_complete(&clip_cache, clip);
+    }
+    return clip;
+}
+
+void audio_play_sound(size_t sound_number)
+{
+    audio_play_sound_with_gain(sound_number, AUDIO_GAIN_UNITY);
+}
+
+int audio_play_sound_with_gain(size_t sound_number, uint16_t gain)
+{
+    // If audio wasn't initialised, we can't play audio:
+    if (!audio_initialised)
+    {
+        printf("audio: Error: Can't play audio file. Audio not initialised.\n");
+        return -1;
+    }
+
+    mutex_enter_blocking(&file_mutex);
+
+    // Use a free voice. If they're all busy, cut off the sound that's closest to finishing:
+    int voice_number = 0;
+    size_t fewest_samples_remaining = SIZE_MAX;
+    for (size_t i = 0; i < AUDIO_VOICE_COUNT && fewest_samples_remaining > 0; i++)
+    {
+        size_t samples_remaining = get_samples_remaining(&voices[i]);
+        if (samples_remaining < fewest_samples_remaining)
+        {
+            voice_number = i;
+            fewest_samples_remaining = samples_remaining;
+        }
+    }
+
+    voice_t *voice = &voices[voice_number];
+    stop_voice(voice);
+    voice->gain = (gain > AUDIO_MIXER_MAX_GAIN) ? AUDIO_MIXER_MAX_GAIN : gain;
+
+    // A cached sound starts with the next buffer played, without touching the SD card:
+    audio_clip_t *clip = audio_clip_cache_find(&clip_cache, sound_number);
+    if (clip != NULL)
+    {
+        printf("audio: Playing cached sound %x.\n", sound_number);
+        voice->clip_position = 0;
+        voice->clip = clip;
+    }
+    else if (open_wave_file(&voice->file, sound_number, &voice->samples_remaining_in_file))
+    {
+        voice->is_file_open = true;
+
+        // Cache the sound as it's read, if it's short enough:
+        voice->filling_clip = audio_clip_cache_add(&clip_cache, sound_number, voice->samples_remaining_in_file);
+        voice->filling_position = 0;
+
+        // Read the first buffer now, so the sound starts with the next buffer played. If a buffer
+        // from an earlier sound is still pending, audio_update() reads it once that's cleared:
+        if (!atomic_load_explicit(&voice->has_pending_buffer, memory_order_acquire))
+        {
+            stream_voice(voice);
+        }
+    }
+    else
+    {
+        voice_number = -1;
+    }
+
+    mutex_exit(&file_mutex);
+    return voice_number;
+}
+
+void audio_set_voice_gain(int voice_number, uint16_t gain)
+{
+    if (!audio_initialised || voice_number < 0 || voice_number >= AUDIO_VOICE_COUNT)
+    {
+        return;
+    }
+
+    mutex_enter_blocking(&file_mutex);
+    voices[voice_number].gain = (gain > AUDIO_MIXER_MAX_GAIN) ? AUDIO_MIXER_MAX_GAIN : gain;
+    mutex_exit(&file_mutex);
+}
+
+void audio_update()
+{
+    if (!audio_initialised)
+    {
+        return;
+    }
+
+    // Read a single buffer per call, so that one call never holds up the caller for more than one
+    // read from the SD card. The voices take turns, starting after the one read last time, so they
+    // all keep up as long as there are more calls than buffers played by all the voices together:
+    mutex_enter_blocking(&file_mutex);
+    for (size_t i = 0; i < AUDIO_VOICE_COUNT; i++)
+    {
+        size_t voice_number = (next_stream_voice + i) % AUDIO_VOICE_COUNT;
+        voice_t *voice = &voices[voice_number];
+        if (voice->is_file_open && spsc_queue_get_level(&voice->stream) < AUDIO_STREAM_BUFFER_COUNT
+            && !atomic_load_explicit(&voice->has_pending_buffer, memory_order_acquire))
+        {
+            stream_voice(voice);
+            next_stream_voice = (voice_number + 1) % AUDIO_VOICE_COUNT;
+            break;
+        }
+    }
+    mutex_exit(&file_mutex);
+}
+
+bool audio_pin_sound(size_t sound_number)
+{
+    if (!audio_initialised)
+    {
+        return false;
+    }
+
+    mutex_enter_blocking(&file_mutex);
+    audio_clip_t *clip = audio_clip_cache_get(&clip_cache, sound_number);
+    if (clip == NULL || !clip->is_complete)
+    {
+        // A clip that's still being filled in by a voice gets finished by it, but it could still
+        // fail. Loading it again is simpler:
+        if (clip != NULL)
+        {
+            for (size_t i = 0; i < AUDIO_VOICE_COUNT; i++)
+            {
+                if (voices[i].filling_clip == clip)
+                {
+                    voices[i].filling_clip = NULL;
+                }
+            }
+            audio_clip_cache_remove(&clip_cache, clip);
+        }
+        clip = load_clip(sound_number);
+    }
+    if (clip != NULL)
+    {
+        clip->is_pinned = true;
+    }
+    mutex_exit(&file_mutex);
+
+    return clip != NULL;
+}
+
+void audio_unpin_sound(size_t sound_number)
+{
+    if (!audio_initialised)
+    {
+        return;
+    }
+
+    mutex_enter_blocking(&file_mutex);
+    audio_clip_t *clip = audio_clip_cache_get(&clip_cache, sound_number);
+    if (clip != NULL)
+    {
+        clip->is_pinned = false;
+    }
+    mutex_exit(&file_mutex);
+}
+
+void audio_get_clip_cache_stats(audio_clip_cache_stats_t *stats)
+{
+    if (!audio_initialised)
+    {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    mutex_enter_blocking(&file_mutex);
+    audio_clip_cache_get_stats(&clip_cache, stats);
+    mutex_exit(&file_mutex);
+}
+
+uint32_t audio_get_underrun_count()
+{
+    return underrun_count;
+}
+
+bool audio_claim_sd_card()
+{
+    if (!is_sd_card_mounted)
+    {
+        return false;
+    }
+
+    mutex_enter_blocking(&file_mutex);
+    return true;
+}
+
+void audio_release_sd_card()
+{
     mutex_exit(&file_mutex);
 }
\ No newline at end of file
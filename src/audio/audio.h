@@ -1,19 +1,87 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include "audio_clip_cache.h"
+#include "audio_mixer.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #define AUDIO_SOUND_BT_CONNECTED 0
 #define AUDIO_SOUND_BT_DISCONNECTED 1
 
+// Number of sounds that can play at once:
+#define AUDIO_VOICE_COUNT 4
+
+// Gain of a sound played at its normal volume. Gains are fixed point, up to AUDIO_MIXER_MAX_GAIN:
+#define AUDIO_GAIN_UNITY AUDIO_MIXER_GAIN_UNITY
+
 /**
  * Initialises the audio module.
  */
 void audio_init();
 
 /**
- * Plays a given sound.
+ * Plays a given sound at its normal volume, over any others that are playing.
  */
 void audio_play_sound(size_t sound);
 
+/**
+ * Plays a given sound scaled by 'gain', over any others that are playing. If every voice is busy,
+ * the sound that's closest to finishing is cut off. Returns the voice the sound is playing on, or
+ * -1 if it couldn't be played.
+ */
+int audio_play_sound_with_gain(size_t sound, uint16_t gain);
+
+/**
+ * Changes the gain of whatever is playing on a voice returned by audio_play_sound_with_gain().
+ */
+void audio_set_voice_gain(int voice, uint16_t gain);
+
+/**
+ * Loads a sound into the clip cache, if it isn't there already, and keeps it there until
+ * audio_unpin_sound(). Playing it never touches the SD card. Returns false if it couldn't be read
+ * or is too long to cache.
+ *
+ * Other short sounds are cached when they're first played, and evicted when the space is needed.
+ */
+bool audio_pin_sound(size_t sound);
+
+/**
+ * Lets a sound pinned by audio_pin_sound() be evicted from the clip cache again.
+ */
+void audio_unpin_sound(size_t sound);
+
+/**
+ * Copies the clip cache's hit, miss and eviction counts, and how full it is, into 'stats'.
+ */
+void audio_get_clip_cache_stats(audio_clip_cache_stats_t *stats);
+
+/**
+ * Reads ahead one buffer from the SD card for one of the sounds that are playing, taking turns.
+ * Call this from the main program, never from an interrupt, more often than every voice together
+ * plays buffers (every 2 ms or so). Playback itself carries on in the background, as long as the
+ * read-ahead keeps up.
+ */
+void audio_update();
+
+/**
+ * Returns the number of buffers of a playing sound that were replaced with silence because
+ * audio_update() hadn't read them in time.
+ */
+uint32_t audio_get_underrun_count();
+
+/**
+ * Claims the SD card, which audio_init() mounts as "0:", for reading other files with FatFs.
+ * Sounds can't be read ahead until audio_release_sd_card() is called, so only hold it for short
+ * reads.
+ * Returns false, without claiming anything, if the card isn't mounted.
+ */
+bool audio_claim_sd_card();
+
+/**
+ * Gives the SD card back to audio playback after audio_claim_sd_card().
+ */
+void audio_release_sd_card();
+
 #endif /* AUDIO_H */
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "audio_clip_cache.h"
+#include <string.h>
+
+// Returns the least recently used clip that can be evicted, or NULL:
+static audio_clip_t *find_eviction(audio_clip_cache_t *cache)
+{
+    audio_clip_t *oldest = NULL;
+    for (size_t i = 0; i < AUDIO_CLIP_CACHE_MAX_CLIPS; i++)
+    {
+        audio_clip_t *clip = &cache->clips[i];
+
+        // Clips that are still being filled in are in use too, by whatever is filling them:
+        if (clip->is_used && clip->is_complete && !clip->is_pinned
+            && (oldest == NULL || clip->last_used < oldest->last_used)
+            && !cache->is_playing(cache->context, clip))
+        {
+            oldest = clip;
+        }
+    }
+    return oldest;
+}
+
+static audio_clip_t *find_free_clip(audio_clip_cache_t *cache)
+{
+    for (size_t i = 0; i < AUDIO_CLIP_CACHE_MAX_CLIPS; i++)
+    {
+        if (!cache->clips[i].is_used)
+        {
+            return &cache->clips[i];
+        }
+    }
+    return NULL;
+}
+
+audio_clip_t *audio_clip_cache_add(audio_clip_cache_t *cache, size_t sound, size_t sample_count)
+{
+    size_t buffer_count = (sample_count + AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER - 1) / AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER;
+    if (buffer_count == 0 || buffer_count > AUDIO_CLIP_CACHE_MAX_CLIP_BUFFERS || audio_clip_cache_get(cache, sound) != NULL)
+    {
+        return NULL;
+    }
+
+    // Make room, oldest clips first:
+    audio_clip_t *clip;
+    while ((clip = find_free_clip(cache)) == NULL || cache->free_buffer_count < buffer_count)
+    {
+        audio_clip_t *evicted = find_eviction(cache);
+        if (evicted == NULL)
+        {
+            return NULL;
+        }
+        audio_clip_cache_remove(cache, evicted);
+        cache->evictions++;
+    }
+
+    clip->sound = sound;
+    clip->sample_count = sample_count;
+    clip->buffer_count = buffer_count;
+    for (size_t i = 0; i < buffer_count; i++)
+    {
+        clip->buffers[i] = cache->free_buffers[--cache->free_buffer_count];
+    }
+    clip->last_used = ++cache->use_count;
+    clip->is_used = true;
+    clip->is_complete = false;
+    clip->is_pinned = false;
+    return clip;
+}
+
+void audio_clip_cache_complete(audio_clip_cache_t *cache, audio_clip_t *clip)
+{
+    (void)cache;
+    clip->is_complete = true;
+}
+
+audio_clip_t *audio_clip_cache_find(audio_clip_cache_t *cache, size_t sound)
+{
+    audio_clip_t *clip = audio_clip_cache_get(cache, sound);
+    if (clip == NULL || !clip->is_complete)
+    {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    clip->last_used = ++cache->use_count;
+    return clip;
+}
+
+audio_clip_t *audio_clip_cache_get(audio_clip_cache_t *cache, size_t sound)
+{
+    for (size_t i = 0; i < AUDIO_CLIP_CACHE_MAX_CLIPS; i++)
+    {
+        if (cache->clips[i].is_used && cache->clips[i].sound == sound)
+        {
+            return &cache->clips[i];
+        }
+    }
+    return NULL;
+}
+
+size_t audio_clip_cache_get_sample_count(const audio_clip_t *clip, size_t index)
+{
+    size_t start = index * AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER;
+    size_t remaining = clip->sample_count - start;
+    return (remaining > AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER) ? AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER : remaining;
+}
+
+int16_t *audio_clip_cache_get_samples(audio_clip_cache_t *cache, const audio_clip_t *clip, size_t index)
+{
+    return cache->samples[clip->buffers[index]];
+}
+
+void audio_clip_cache_get_stats(audio_clip_cache_t *cache, audio_clip_cache_stats_t *stats)
+{
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->clip_count = 0;
+    for (size_t i = 0; i < AUDIO_CLIP_CACHE_MAX_CLIPS; i++)
+    {
+        stats->clip_count += cache->clips[i].is_used;
+    }
+    stats->buffers_used = AUDIO_CLIP_CACHE_BUFFER_COUNT - cache->free_buffer_count;
+}
+
+void audio_clip_cache_init(audio_clip_cache_t *cache, audio_clip_cache_is_playing_t is_playing, void *context)
+{
+    memset(cache->clips, 0, sizeof(cache->clips));
+    for (size_t i = 0; i < AUDIO_CLIP_CACHE_BUFFER_COUNT; i++)
+    {
+        cache->free_buffers[i] = i;
+    }
+    cache->free_buffer_count = AUDIO_CLIP_CACHE_BUFFER_COUNT;
+    cache->use_count = 0;
+    cache->is_playing = is_playing;
+    cache->context = context;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+}
+
+void audio_clip_cache_remove(audio_clip_cache_t *cache, audio_clip_t *clip)
+{
+    for (size_t i = 0; i < clip->buffer_count; i++)
+    {
+        cache->free_buffers[cache->free_buffer_count++] = clip->buffers[i];
+    }
+    clip->is_used = false;
+}
@@ -0,0 +1,109 @@
+#ifndef AUDIO_CLIP_CACHE_H
+#define AUDIO_CLIP_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Keeps the samples of short sounds ("clips") in RAM, so that they can be played again without
+// reading the SD card. Each clip is split into buffers the size of a buffer of audio, which can be
+// anywhere in the cache, so clips come and go without the cache getting fragmented. When there
+// isn't room for a new clip, the least recently used clips are evicted, except for pinned clips
+// and clips that are playing.
+
+#define AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER 512
+#define AUDIO_CLIP_CACHE_BUFFER_COUNT 48 // 48 KB of samples
+#define AUDIO_CLIP_CACHE_MAX_CLIP_BUFFERS 24 // longer sounds are never cached (0.4 s at 30.5 kHz)
+#define AUDIO_CLIP_CACHE_MAX_CLIPS 16
+
+typedef struct
+{
+    size_t sound;
+    size_t sample_count;
+    size_t buffer_count;
+    uint8_t buffers[AUDIO_CLIP_CACHE_MAX_CLIP_BUFFERS]; // indices into the cache's samples
+    uint32_t last_used;
+    bool is_used; // false for a free entry
+    bool is_complete; // false until every sample has been written
+    bool is_pinned; // never evicted
+} audio_clip_t;
+
+/**
+ * Returns whether a clip is being played, so that it can't be evicted.
+ */
+typedef bool (*audio_clip_cache_is_playing_t)(void *context, const audio_clip_t *clip);
+
+typedef struct
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    size_t clip_count;
+    size_t buffers_used; // out of AUDIO_CLIP_CACHE_BUFFER_COUNT
+} audio_clip_cache_stats_t;
+
+typedef struct
+{
+    audio_clip_t clips[AUDIO_CLIP_CACHE_MAX_CLIPS];
+    int16_t samples[AUDIO_CLIP_CACHE_BUFFER_COUNT][AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER];
+    uint8_t free_buffers[AUDIO_CLIP_CACHE_BUFFER_COUNT];
+    size_t free_buffer_count;
+    uint32_t use_count; // counts every use of a clip, to find the least recently used one
+    audio_clip_cache_is_playing_t is_playing;
+    void *context;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+} audio_clip_cache_t;
+
+/**
+ * Adds an empty clip for 'sound', with space for 'sample_count' samples, evicting other clips if
+ * needed. Fill it in with audio_clip_cache_get_samples(), then call audio_clip_cache_complete().
+ * Returns NULL if the sound is too long to cache, there's already a clip for it, or there isn't
+ * room even after evicting everything that can be evicted.
+ */
+audio_clip_t *audio_clip_cache_add(audio_clip_cache_t *cache, size_t sound, size_t sample_count);
+
+/**
+ * Marks a clip as having all of its samples, so that it can be found.
+ */
+void audio_clip_cache_complete(audio_clip_cache_t *cache, audio_clip_t *clip);
+
+/**
+ * Finds the complete clip for 'sound', counting a hit and marking the clip as just used. Returns
+ * NULL, counting a miss, if it isn't cached.
+ */
+audio_clip_t *audio_clip_cache_find(audio_clip_cache_t *cache, size_t sound);
+
+/**
+ * Returns the clip for 'sound', complete or not, without counting it as a use. Returns NULL if
+ * there isn't one.
+ */
+audio_clip_t *audio_clip_cache_get(audio_clip_cache_t *cache, size_t sound);
+
+/**
+ * Returns the number of samples in buffer 'index' of a clip. Every buffer but the last is full.
+ */
+size_t audio_clip_cache_get_sample_count(const audio_clip_t *clip, size_t index);
+
+/**
+ * Returns the samples in buffer 'index' of a clip.
+ */
+int16_t *audio_clip_cache_get_samples(audio_clip_cache_t *cache, const audio_clip_t *clip, size_t index);
+
+/**
+ * Copies the cache's statistics into 'stats'.
+ */
+void audio_clip_cache_get_stats(audio_clip_cache_t *cache, audio_clip_cache_stats_t *stats);
+
+/**
+ * Initialises an empty cache. 'is_playing' is called with 'context' before evicting a clip.
+ */
+void audio_clip_cache_init(audio_clip_cache_t *cache, audio_clip_cache_is_playing_t is_playing, void *context);
+
+/**
+ * Removes a clip from the cache, whether it's complete or not.
+ */
+void audio_clip_cache_remove(audio_clip_cache_t *cache, audio_clip_t *clip);
+
+#endif /* AUDIO_CLIP_CACHE_H */
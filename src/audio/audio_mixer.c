@@ -0,0 +1,44 @@
+#include "audio_mixer.h"
+#include <string.h>
+
+void audio_mixer_clear(int32_t *mix, size_t sample_count)
+{
+    memset(mix, 0, sample_count * sizeof(mix[0]));
+}
+
+void audio_mixer_add_voice(int32_t *mix, const int16_t *samples, size_t sample_count, uint16_t gain)
+{
+    // Voices at unity gain are common (and every voice is at unity by default), so skip the
+    // multiply for them:
+    if (gain == AUDIO_MIXER_GAIN_UNITY)
+    {
+        for (size_t i = 0; i < sample_count; i++)
+        {
+            mix[i] += (int32_t)samples[i] << AUDIO_MIXER_GAIN_SHIFT;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < sample_count; i++)
+        {
+            mix[i] += (int32_t)samples[i] * gain;
+        }
+    }
+}
+
+void audio_mixer_output(const int32_t *mix, int16_t *output, size_t sample_count)
+{
+    for (size_t i = 0; i < sample_count; i++)
+    {
+        int32_t sample = mix[i] >> AUDIO_MIXER_GAIN_SHIFT;
+        if (sample > INT16_MAX)
+        {
+            sample = INT16_MAX;
+        }
+        else if (sample < INT16_MIN)
+        {
+            sample = INT16_MIN;
+        }
+        output[i] = sample;
+    }
+}
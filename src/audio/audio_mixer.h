@@ -0,0 +1,34 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Mixes several voices of signed 16-bit samples into one. Each voice is scaled by its gain and
+// added into a 32-bit mix, and the mix is only clipped to 16 bits at the end, so loud voices can
+// be made quieter by others without distorting.
+
+// Gains are fixed point, with this as 1.0. Gains above it amplify the voice, up to
+// AUDIO_MIXER_MAX_GAIN, which keeps the mix of up to 64 voices from overflowing:
+#define AUDIO_MIXER_GAIN_SHIFT 8
+#define AUDIO_MIXER_GAIN_UNITY (1 << AUDIO_MIXER_GAIN_SHIFT)
+#define AUDIO_MIXER_MAX_GAIN (4 * AUDIO_MIXER_GAIN_UNITY)
+
+/**
+ * Sets the first 'sample_count' samples of 'mix' to silence.
+ */
+void audio_mixer_clear(int32_t *mix, size_t sample_count);
+
+/**
+ * Adds 'sample_count' samples of a voice, scaled by 'gain' (at most AUDIO_MIXER_MAX_GAIN), to the
+ * start of 'mix'.
+ */
+void audio_mixer_add_voice(int32_t *mix, const int16_t *samples, size_t sample_count, uint16_t gain);
+
+/**
+ * Writes the first 'sample_count' samples of 'mix' to 'output' as signed 16-bit samples,
+ * saturating any that are too loud instead of letting them wrap around.
+ */
+void audio_mixer_output(const int32_t *mix, int16_t *output, size_t sample_count);
+
+#endif /* AUDIO_MIXER_H */
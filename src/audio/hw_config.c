@@ -14,6 +14,8 @@ static spi_t spis[] = {  // One for each SPI.
         .mosi_gpio = 11,
         .sck_gpio = 10,
         .baud_rate = 12500 * 1000, // 12.5 MHz
+        // DMA_IRQ_0 belongs to block_io, which may be scanning on the other core:
+        .DMA_IRQ_num = DMA_IRQ_1,
     }
 };
 
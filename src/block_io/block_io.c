@@ -1,34 +1,1196 @@
 #include <string.h>
 #include "block_io.h"
-#include "hardware/spi.h"
-#include "hardware/gpio.h"
-#include "pico/time.h"
-
-#define SS_DATA_PIN 0
-#define SS_CLK_PIN 1
-#define SPI_SCK_PIN 2
-#define SPI_TX_PIN 3
-#define SPI_RX_PIN 4
-
-#define HEIGHT_LIMIT 16
-
-static uint8_t target_structure[BLOCK_IO_TILE_COUNT][HEIGHT_LIMIT];
-static uint8_t current_structure[BLOCK_IO_TILE_COUNT][HEIGHT_LIMIT];
-static uint8_t grid_height[BLOCK_IO_TILE_COUNT];
-static bool is_complete = false;
-static bool is_corrupted = false;
+#include "block_io_port.h"
+#include "packed_stack.h"
+#include "spsc_queue.h"
+
+// SPI clock rates that the block bus can run at, slowest first. The slowest is the original fixed
+// rate, which works on every board:
+static const uint32_t spi_baud_rates[] = { 250000, 500000, 1000000, 2000000, 4000000 };
+#define SPI_BAUD_RATE_COUNT (sizeof(spi_baud_rates) / sizeof(spi_baud_rates[0]))
+
+// Number of scans in a row that must be free of corruption for calibration to accept a rate:
+#define CALIBRATION_SCAN_COUNT 20
+
+// Number of corrupted scans in a row after which the SPI clock is slowed down by one step:
+#define BACKOFF_CORRUPTED_SCANS 2
+
+// Number of scans in a row that must be free of corruption, with a tall stack, before the SPI clock
+// is sped up by one step again. Each time it has to be slowed down, twice as many are needed next
+// time, up to STEP_UP_MAX_CLEAN_SCANS:
+#define STEP_UP_CLEAN_SCANS 500
+#define STEP_UP_MAX_CLEAN_SCANS 64000
+
+// Number of times a corrupted stack is read again within the same scan, before giving up and
+// keeping the data from its last good scan:
+#define STACK_RETRY_COUNT 2
+
+// Queue sizes must be powers of 2. Neither queue holds a whole grid of BLOCK_IO_MAX_BLOCKS: once the
+// command queue is full, send_command() waits for the scanner to make room, and once the event
+// queue is full, change events are dropped and reported by block_io_has_lost_change_events(). Grids
+// of a few boards get by with short queues:
+#if BLOCK_IO_MAX_BLOCKS > 512
+#define COMMAND_QUEUE_SIZE 512
+#define EVENT_QUEUE_SIZE 256
+#else
+#define COMMAND_QUEUE_SIZE 64
+#define EVENT_QUEUE_SIZE 64
+#endif
+#define RESULT_QUEUE_SIZE 4
+
+// Number of steps a pulsing LED ramps up and down through. Each step lights it for one more LED
+// refresh out of every PULSE_STEP_COUNT:
+#define PULSE_STEP_COUNT 4
+
+// Each entry of the LED frame buffer is 0 to follow the LED mode, or a colour and animation set by
+// block_io_set_block_led():
+#define LED_FRAME_IS_SET 0x80
+#define LED_FRAME_COLOUR_MASK 0x03
+#define LED_FRAME_ANIMATION_SHIFT 2
+
+// Changes requested through the public functions, which are applied by the scanning core:
+typedef enum
+{
+    COMMAND_CLEAR_TARGET,
+    COMMAND_SET_TARGET_BLOCK,
+    COMMAND_COMMIT_TARGET,
+    COMMAND_REVERT_TARGET,
+    COMMAND_LOAD_TARGET,
+    COMMAND_SET_LED_MODE,
+    COMMAND_CLEAR_BLOCK_LEDS,
+    COMMAND_SET_BLOCK_LED,
+    COMMAND_SET_LED_ANIMATION
+} command_type_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t grid_tile;
+    uint8_t height;
+    uint8_t data;
+    uint16_t period_ms; // only for COMMAND_SET_LED_ANIMATION
+    uint16_t duration_ms; // only for COMMAND_SET_LED_ANIMATION
+} command_t;
+
+// A complete copy of everything a scan produces, passed from the scanning core to the other one.
+// The arrays that depend on the grid size follow on straight after, in 'grid_data':
+//   uint32_t tile_error_count[tile_count]
+//   uint8_t structure[tile_count * stack_size]
+//   uint8_t grid_height[tile_count]
+//   bool tile_is_corrupted[tile_count]
+typedef struct
+{
+    bool is_complete;
+    bool is_corrupted;
+    uint32_t structure_hash;
+    uint32_t scan_time_us;
+    uint32_t scan_period_us;
+    uint32_t spi_baud_rate;
+    uint32_t grid_data[];
+} scan_result_t;
+
+// Everything that depends on the grid size is carved out of a single pool, laid out for exactly
+// the size in use. There are copies of the scan result for the scan in progress, the latest result
+// and every entry in the result queue. The target structure, the staged one and the one being
+// loaded, the last good scan of each stack and its hash, whether each block matched the target, the
+// LED frame buffer and which stacks need reading again are kept once. Each structure holds
+// 'block_count' blocks, including the padding at the top of each stack.
+#define RESULT_COPIES (2 + RESULT_QUEUE_SIZE)
+#define ALIGN_4(size) (((size) + 3) & ~(size_t)3)
+#define RESULT_SIZE(tile_count, block_count) ALIGN_4(sizeof(scan_result_t) + 6 * (tile_count) + (block_count))
+#define POOL_SIZE(tile_count, block_count) \
+    (RESULT_COPIES * RESULT_SIZE(tile_count, block_count) + 6 * (block_count) + 2 * ALIGN_4(tile_count) + 4 * (tile_count))
+#define MAX_PADDED_BLOCKS (BLOCK_IO_MAX_BLOCKS + 3 * BLOCK_IO_MAX_TILE_COUNT)
+
+static uint32_t pool[POOL_SIZE(BLOCK_IO_MAX_TILE_COUNT, MAX_PADDED_BLOCKS) / sizeof(uint32_t)];
+static size_t pool_used;
+
+static size_t tile_count;
+static size_t height_limit;
+static size_t stack_size; // the height limit, padded to whole words
+static size_t stack_word_count;
+static size_t result_size;
+
+// These variables belong to whichever core calls block_io_update() (core 1 once the scanner has
+// been started). The other core only sees them through the queues. Blocks are stored one stack
+// after another, each padded with zeros to a whole number of words (see packed_stack.h), so the
+// block at 'grid_tile' and 'height' is at [grid_tile * stack_size + height]:
+static uint8_t *target_structure;
+static uint8_t *staged_target_structure; // changes to the target build up here until committed
+static scan_result_t *scan;
+static uint8_t *scan_structure;
+static uint8_t *scan_grid_height;
+static bool *scan_tile_is_corrupted;
+static uint32_t *scan_tile_error_count;
 static led_mode_t led_mode = TARGET;
 
+// The LEDs set by block_io_set_block_led(), one entry per block laid out like the structure, and
+// how many of them are animated:
+static uint8_t *led_frame;
+static size_t animated_block_count = 0;
+
+// The animation from block_io_set_led_animation(), which ends at 'grid_animation_end_us' unless
+// that's 0:
+static led_animation_t grid_animation = LED_ANIMATION_NONE;
+static led_mode_t grid_animation_mode;
+static uint32_t grid_animation_period_us;
+static uint64_t grid_animation_start_us;
+static uint64_t grid_animation_end_us;
+
+// Whether each animation has its LEDs lit, worked out once at the start of every pass along the
+// buses that sends LED data:
+static uint32_t led_pass_count = 0;
+static bool is_grid_animation_lit;
+static bool is_block_flash_lit;
+static bool is_block_pulse_lit;
+
+// A whole target structure written by block_io_load_target_block() on the other core, without going
+// through the command queue. It's only copied into the staged target by COMMAND_LOAD_TARGET, and
+// can't be written again until that has happened:
+static uint8_t *loading_target_structure;
+static volatile bool is_target_load_pending = false;
+
+// The last stacks that were read without corruption, to compare new scans against:
+static uint8_t *previous_structure;
+static uint8_t *previous_grid_height;
+static bool previous_is_complete = false;
+
+// Hash of each stack in the last good scan, and of the whole structure:
+static uint32_t *stack_hashes;
+static uint32_t structure_hash;
+
+// Change events are only produced once something has asked for them with
+// block_io_enable_change_events(), so that nobody pays for events that are never read:
+static volatile bool is_change_event_enabled = false;
+static volatile uint32_t lost_event_count = 0;
+
+// Whether each block in the last scan matched the target, for working out its LED data when
+// scanning with DMA:
+static bool *is_block_correct;
+
+// Stacks that were corrupted in the current pass along their bus, to read again in the next one:
+static bool *is_stack_retry_needed;
+
+// Whether any stack was corrupted during the current scan, even if it was read correctly on a
+// retry. This is what calibration and backoff go by, since a retry still means the bus is unreliable:
+static bool has_read_error;
+
+// Whether any stack in the current scan was at least half the height limit. Corruption mostly shows
+// up in tall stacks, where the data passes through many blocks, and an empty grid reads the same at
+// any rate. So only scans like this show that a rate is reliable:
+static bool has_tall_stack;
+
+// The latest scan result, as seen by the public functions:
+static scan_result_t *result;
+static bool is_result_new = false;
+
+static command_t command_queue_buffer[COMMAND_QUEUE_SIZE];
+static spsc_queue_t command_queue;
+static spsc_queue_t result_queue;
+static block_io_event_t event_queue_buffer[EVENT_QUEUE_SIZE];
+static spsc_queue_t event_queue;
+static uint32_t lost_event_count_seen = 0;
+
+// The grid is split between the block buses in whole boards, so each bus has a run of tiles of its
+// own. With DMA, all the buses are read at once, and every stack is read up to the height limit,
+// plus one byte to check for the zero byte:
+typedef struct
+{
+    size_t first_tile;
+    size_t tile_count;
+    size_t next_select_tile; // the tile that the next '1' shifted into the SS shift register selects
+    size_t retry_pass; // 0 for the first pass along the bus, then 1 for the first retry and so on
+    size_t retry_stack_count; // stacks waiting to be read in the next pass
+    size_t async_grid_tile; // the tile being read by block_io_update_async()
+    uint8_t dma_write_buffer[BLOCK_IO_MAX_HEIGHT_LIMIT + 1];
+    uint8_t dma_read_buffer[BLOCK_IO_MAX_HEIGHT_LIMIT + 1];
+} bus_t;
+
+static bus_t buses[BLOCK_IO_MAX_BUS_COUNT];
+static size_t bus_count = 1;
+
+// State of a scan started by block_io_update_async():
+static size_t dma_transfer_length;
+static volatile bool is_async_scan_running = false;
+static size_t async_buses_running;
+static void (*async_complete_callback)();
+
+// Number of buses still sending LED data in refresh_leds():
+static volatile size_t led_refresh_buses_running;
+
+static uint64_t scan_start_time_us;
+
+static size_t spi_baud_index = 0;
+static size_t corrupted_scans_in_a_row = 0;
+static size_t clean_scans_in_a_row = 0;
+static size_t step_up_clean_scans = STEP_UP_CLEAN_SCANS;
+
+static volatile bool is_scanner_running = false;
+static void (*scanner_callback)();
+
+// How often to scan, depending on whether anything is happening. Until block_io_set_scan_policy()
+// is called, the scanner keeps to a steady 50 ms:
+static block_io_scan_policy_t scan_policy = {
+    .active_period_us = 50000,
+    .active_hold_us = 0,
+    .connected_period_us = 50000,
+    .idle_period_us = 50000,
+    .led_refresh_period_us = 20000
+};
+static volatile bool is_host_connected = false;
+static bool has_scan_changed; // whether any block changed in the current scan
+static uint64_t active_until_us = 0;
+
+static void stack_scan_finished_irh(size_t bus);
+static void led_refresh_finished_irh(size_t bus);
+
+static size_t block_index(size_t grid_tile, size_t height)
+{
+    return grid_tile * stack_size + height;
+}
+
+static uint32_t *get_stack_words(uint8_t *structure, size_t grid_tile)
+{
+    return (uint32_t *)&structure[block_index(grid_tile, 0)];
+}
+
+static uint32_t *get_tile_error_counts(scan_result_t *scan_result)
+{
+    return scan_result->grid_data;
+}
+
+static uint8_t *get_structure(scan_result_t *scan_result)
+{
+    return (uint8_t *)&scan_result->grid_data[tile_count];
+}
+
+static uint8_t *get_grid_heights(scan_result_t *scan_result)
+{
+    return get_structure(scan_result) + tile_count * stack_size;
+}
+
+static bool *get_tile_is_corrupted(scan_result_t *scan_result)
+{
+    return (bool *)(get_grid_heights(scan_result) + tile_count);
+}
+
+// Takes 'size' bytes from the pool, keeping everything 4-byte aligned:
+static void *allocate(size_t size)
+{
+    void *memory = (uint8_t *)pool + pool_used;
+    pool_used += ALIGN_4(size);
+    return memory;
+}
+
+static led_animation_t get_led_frame_animation(uint8_t entry)
+{
+    return (entry >> LED_FRAME_ANIMATION_SHIFT) & 0x03;
+}
+
+static void apply_command(const command_t *command)
+{
+    switch (command->type)
+    {
+        case COMMAND_CLEAR_TARGET:
+            memset(staged_target_structure, 0, tile_count * stack_size);
+            break;
+        case COMMAND_SET_TARGET_BLOCK:
+            staged_target_structure[block_index(command->grid_tile, command->height)] = command->data;
+            break;
+        case COMMAND_COMMIT_TARGET:
+        {
+            // Commands are only applied between scans, so a scan only ever sees one target:
+            uint8_t *old_target_structure = target_structure;
+            target_structure = staged_target_structure;
+            staged_target_structure = old_target_structure;
+            memcpy(staged_target_structure, target_structure, tile_count * stack_size);
+            break;
+        }
+        case COMMAND_REVERT_TARGET:
+            memcpy(staged_target_structure, target_structure, tile_count * stack_size);
+            break;
+        case COMMAND_LOAD_TARGET:
+            memcpy(staged_target_structure, loading_target_structure, tile_count * stack_size);
+            is_target_load_pending = false;
+            break;
+        case COMMAND_SET_LED_MODE:
+            led_mode = command->data;
+            break;
+        case COMMAND_CLEAR_BLOCK_LEDS:
+            memset(led_frame, 0, tile_count * stack_size);
+            animated_block_count = 0;
+            break;
+        case COMMAND_SET_BLOCK_LED:
+        {
+            uint8_t *entry = &led_frame[block_index(command->grid_tile, command->height)];
+            animated_block_count -= get_led_frame_animation(*entry) != LED_ANIMATION_NONE;
+            *entry = command->data;
+            animated_block_count += get_led_frame_animation(*entry) != LED_ANIMATION_NONE;
+            break;
+        }
+        case COMMAND_SET_LED_ANIMATION:
+            // 'data' holds the mode in its low nibble and the animation in its high one:
+            grid_animation = command->data >> 4;
+            grid_animation_mode = command->data & 0x0F;
+            grid_animation_period_us = command->period_ms * 1000;
+            grid_animation_start_us = block_io_port_get_time_us();
+            grid_animation_end_us = command->duration_ms > 0 ? grid_animation_start_us + command->duration_ms * 1000 : 0;
+            break;
+    }
+}
+
+static void apply_commands()
+{
+    command_t command;
+    while (spsc_queue_try_remove(&command_queue, &command))
+    {
+        apply_command(&command);
+    }
+}
+
+static void send_command(const command_t *command)
+{
+    if (!is_scanner_running)
+    {
+        apply_command(command);
+        return;
+    }
+
+    // Commands can come from interrupts (like timers) as well as the main program,
+    // so stop them interrupting each other to keep a single producer. If the queue is full, wait
+    // for the scanning core to catch up:
+    while (true)
+    {
+        uint32_t interrupt_status = block_io_port_disable_interrupts();
+        bool success = spsc_queue_try_add(&command_queue, command);
+        block_io_port_restore_interrupts(interrupt_status);
+
+        if (success)
+        {
+            break;
+        }
+    }
+}
+
+static void publish_scan()
+{
+    if (is_scanner_running)
+    {
+        // If the other core isn't keeping up and the queue is full, drop this scan. It will pick
+        // up the ones already in the queue, and then newer ones.
+        spsc_queue_try_add(&result_queue, scan);
+    }
+    else
+    {
+        memcpy(result, scan, result_size);
+        is_result_new = true;
+    }
+}
+
+static uint8_t get_mode_led_data(led_mode_t mode, bool is_correct)
+{
+    switch(mode)
+    {
+        case TARGET:
+            if (is_correct)
+            {
+                return LED_COLOUR_GREEN;
+            }
+            else
+            {
+                return LED_COLOUR_RED;
+            }
+        case GREEN:
+            return LED_COLOUR_GREEN;
+        case RED:
+            return LED_COLOUR_RED;
+        case OFF: // fallthrough
+        default:
+            return LED_COLOUR_OFF;
+    }
+}
+
+// Returns whether an animation has its LEDs lit, 'elapsed_us' into it:
+static bool is_animation_lit(led_animation_t animation, uint64_t elapsed_us, uint32_t period_us)
+{
+    uint32_t phase_us = elapsed_us % period_us;
+    uint32_t half_period_us = period_us / 2;
+
+    switch (animation)
+    {
+        case LED_ANIMATION_FLASH:
+            return phase_us < half_period_us;
+        case LED_ANIMATION_PULSE:
+        {
+            // The blocks have no brightness control, so light the LEDs for more and more of the
+            // passes up to half way through the period, and then fewer and fewer:
+            uint32_t ramp_us = phase_us < half_period_us ? phase_us : period_us - phase_us;
+            uint32_t step = (uint64_t)ramp_us * (PULSE_STEP_COUNT + 1) / (half_period_us + 1);
+            return led_pass_count % PULSE_STEP_COUNT < step;
+        }
+        case LED_ANIMATION_NONE: // fallthrough
+        default:
+            return true;
+    }
+}
+
+// Moves the animations on to the current time, before a pass along the buses sends LED data:
+static void update_led_animations()
+{
+    uint64_t now_us = block_io_port_get_time_us();
+    led_pass_count++;
+
+    if (grid_animation != LED_ANIMATION_NONE && grid_animation_end_us != 0 && now_us >= grid_animation_end_us)
+    {
+        grid_animation = LED_ANIMATION_NONE;
+    }
+    if (grid_animation != LED_ANIMATION_NONE)
+    {
+        is_grid_animation_lit = is_animation_lit(grid_animation, now_us - grid_animation_start_us, grid_animation_period_us);
+    }
+
+    is_block_flash_lit = is_animation_lit(LED_ANIMATION_FLASH, now_us, BLOCK_IO_BLOCK_LED_PERIOD_MS * 1000);
+    is_block_pulse_lit = is_animation_lit(LED_ANIMATION_PULSE, now_us, BLOCK_IO_BLOCK_LED_PERIOD_MS * 1000);
+}
+
+static bool is_led_animating()
+{
+    return grid_animation != LED_ANIMATION_NONE || animated_block_count > 0;
+}
+
+// Works out the LED data for a block. A grid animation takes over from everything else, and
+// otherwise a block's own LED from the frame buffer takes over from the LED mode:
+static uint8_t get_led_data(size_t index)
+{
+    if (grid_animation != LED_ANIMATION_NONE)
+    {
+        return is_grid_animation_lit ? get_mode_led_data(grid_animation_mode, is_block_correct[index]) : LED_COLOUR_OFF;
+    }
+
+    uint8_t entry = led_frame[index];
+    if (entry & LED_FRAME_IS_SET)
+    {
+        bool is_lit = true;
+        switch (get_led_frame_animation(entry))
+        {
+            case LED_ANIMATION_FLASH:
+                is_lit = is_block_flash_lit;
+                break;
+            case LED_ANIMATION_PULSE:
+                is_lit = is_block_pulse_lit;
+                break;
+            default:
+                break;
+        }
+        return is_lit ? entry & LED_FRAME_COLOUR_MASK : LED_COLOUR_OFF;
+    }
+
+    return get_mode_led_data(led_mode, is_block_correct[index]);
+}
+
+// Decodes a byte read from a block, saves it to the scan and records whether it matches the target
+// structure. 'previous_rotation' is the absolute rotation of the block below, and is updated to
+// this block's rotation. Returns whether the byte was corrupted: no block has an ID of zero, so a
+// byte of 0x01 to 0x03 can only be a bit error, and would be saved as 0x00 once rotated, which
+// everything else takes to mean there's no block.
+static bool decode_block(size_t grid_tile, size_t height, uint8_t read_data, uint8_t *previous_rotation)
+{
+    size_t index = block_index(grid_tile, height);
+    uint8_t block_id = read_data & 0xFC;
+    if (block_id == 0x00)
+    {
+        return true;
+    }
+
+    uint8_t relative_rotation = read_data & 0x03;
+    uint8_t absolute_rotation = (relative_rotation + *previous_rotation) & 0x03;
+    uint8_t rotation_mask = ((read_data >> 2) & 0x03);
+    uint8_t block_mask = 0xFC | rotation_mask;
+    uint8_t absolute_block = block_id | absolute_rotation;
+    uint8_t target_block = target_structure[index];
+    bool is_correct = (absolute_block & block_mask) == (target_block & block_mask);
+    *previous_rotation = absolute_rotation;
+
+    // Save block to memory:
+    scan_structure[index] = absolute_block;
+    is_block_correct[index] = is_correct;
+    return false;
+}
+
+static void add_event(const block_io_event_t *event)
+{
+    if (!is_change_event_enabled)
+    {
+        return;
+    }
+
+    // If the events aren't being read fast enough, just count the ones that don't fit:
+    if (!spsc_queue_try_add(&event_queue, event))
+    {
+        lost_event_count++;
+    }
+}
+
+// Adds events for every block that differs from the last good scan of a stack, if they're enabled,
+// and updates the last good scan and the hash of the structure to match.
+static void compare_stack(size_t grid_tile, size_t height)
+{
+    size_t previous_height = previous_grid_height[grid_tile];
+    size_t max_height = height > previous_height ? height : previous_height;
+    uint32_t *previous_words = get_stack_words(previous_structure, grid_tile);
+    const uint32_t *scan_words = get_stack_words(scan_structure, grid_tile);
+
+    // Most stacks don't change from one scan to the next, so check a word at a time first:
+    bool is_changed = height != previous_height;
+    for (size_t i = 0; i < stack_word_count && !is_changed; i++)
+    {
+        is_changed = previous_words[i] != scan_words[i];
+    }
+    if (!is_changed)
+    {
+        return;
+    }
+
+    for (size_t y = 0; y < max_height && is_change_event_enabled; y++)
+    {
+        size_t index = block_index(grid_tile, y);
+        uint8_t old_block = y < previous_height ? previous_structure[index] : 0x00;
+        uint8_t new_block = y < height ? scan_structure[index] : 0x00;
+
+        if (old_block != new_block)
+        {
+            block_io_event_t event = {
+                .type = BLOCK_IO_EVENT_BLOCK_CHANGED,
+                .grid_tile = grid_tile,
+                .height = y,
+                .old_block = old_block,
+                .new_block = new_block
+            };
+            add_event(&event);
+        }
+    }
+
+    // Both stacks are padded with zeros above their tops, so they can be copied a word at a time:
+    memcpy(previous_words, scan_words, stack_size);
+    previous_grid_height[grid_tile] = height;
+    has_scan_changed = true;
+
+    structure_hash ^= stack_hashes[grid_tile];
+    stack_hashes[grid_tile] = packed_stack_hash(grid_tile, previous_words, stack_word_count);
+    structure_hash ^= stack_hashes[grid_tile];
+}
+
+// Records the height of a stack once its terminating zero byte has been read.
+static void finish_stack(size_t grid_tile, size_t height)
+{
+    // Clear the rest of the stack, so that it can be compared a word at a time:
+    memset(&scan_structure[block_index(grid_tile, height)], 0x00, stack_size - height);
+    scan_grid_height[grid_tile] = height;
+    has_tall_stack |= 2 * height >= height_limit;
+    compare_stack(grid_tile, height);
+
+    // Check the whole stack against the target, including that there's nothing above it in the
+    // target either:
+    if (!packed_stack_matches(get_stack_words(scan_structure, grid_tile), get_stack_words(target_structure, grid_tile), stack_word_count))
+    {
+        scan->is_complete = false;
+    }
+}
+
+// Checks the extra byte read after a stack reached the height limit. If it isn't the zero byte,
+// then the stack is either higher than the limit, or the data has been corrupted and we missed the
+// zero byte. We will assume that the data was corrupted. Returns whether it was.
+static bool check_terminator(size_t grid_tile, uint8_t read_data)
+{
+    if (read_data == 0x00)
+    {
+        finish_stack(grid_tile, height_limit);
+        return false;
+    }
+    else
+    {
+        return true;
+    }
+}
+
+// Puts back the last good scan of a stack that couldn't be read, so that the rest of the grid can
+// still be used. Its blocks can't be trusted to match the target any more.
+static void keep_last_good_stack(size_t grid_tile)
+{
+    size_t first_block = block_index(grid_tile, 0);
+    memcpy(&scan_structure[first_block], &previous_structure[first_block], stack_size);
+    memset(&is_block_correct[first_block], false, stack_size);
+    scan_grid_height[grid_tile] = previous_grid_height[grid_tile];
+    scan_tile_is_corrupted[grid_tile] = true;
+    scan->is_complete = false;
+    scan->is_corrupted = true;
+}
+
+// Records whether a stack was read without corruption. A corrupted stack is read again in another
+// pass along its bus, once the rest of the bus has been read, up to STACK_RETRY_COUNT times.
+static void finish_stack_read(size_t bus, size_t grid_tile, bool is_corrupted)
+{
+    is_stack_retry_needed[grid_tile] = false;
+
+    if (!is_corrupted)
+    {
+        scan_tile_is_corrupted[grid_tile] = false;
+        return;
+    }
+
+    has_read_error = true;
+    scan_tile_error_count[grid_tile]++;
+
+    if (buses[bus].retry_pass < STACK_RETRY_COUNT)
+    {
+        is_stack_retry_needed[grid_tile] = true;
+        buses[bus].retry_stack_count++;
+    }
+    else
+    {
+        keep_last_good_stack(grid_tile);
+    }
+}
+
+// Starts a new pass along a bus, so that the next '1' shifted in selects its first tile. A tile
+// that's still selected is shifted off the end of the chain first, so that only one tile is ever
+// selected at a time.
+static void restart_select(size_t bus)
+{
+    size_t end_tile = buses[bus].first_tile + buses[bus].tile_count;
+    while (buses[bus].next_select_tile < end_tile)
+    {
+        block_io_port_shift_select(bus, 1);
+        buses[bus].next_select_tile++;
+    }
+
+    block_io_port_shift_select(bus, 0);
+    buses[bus].next_select_tile = buses[bus].first_tile;
+}
+
+// Shifts the SS shift register of a bus along until 'grid_tile' is selected.
+static void select_tile(size_t bus, size_t grid_tile)
+{
+    while (buses[bus].next_select_tile <= grid_tile)
+    {
+        block_io_port_shift_select(bus, 1);
+        buses[bus].next_select_tile++;
+    }
+}
+
+// Works out which tile a bus should read after 'grid_tile'. The first pass reads every tile, and
+// then each retry pass reads the stacks that were corrupted in the pass before. Returns false once
+// the bus is finished.
+static bool get_next_tile(size_t bus_number, size_t *grid_tile)
+{
+    bus_t *bus = &buses[bus_number];
+    size_t end_tile = bus->first_tile + bus->tile_count;
+    size_t next_tile = *grid_tile + 1;
+
+    if (bus->retry_pass > 0)
+    {
+        while (next_tile < end_tile && !is_stack_retry_needed[next_tile])
+        {
+            next_tile++;
+        }
+    }
+
+    if (next_tile == end_tile)
+    {
+        if (bus->retry_stack_count == 0)
+        {
+            return false;
+        }
+
+        // Go back to the start of the bus for another pass:
+        bus->retry_pass++;
+        bus->retry_stack_count = 0;
+        restart_select(bus_number);
+
+        next_tile = bus->first_tile;
+        while (!is_stack_retry_needed[next_tile])
+        {
+            next_tile++;
+        }
+    }
+
+    *grid_tile = next_tile;
+    return true;
+}
+
+// All the buses run at the same rate, so that a scan takes as long as the longest bus.
+static void set_spi_baud_index(size_t index)
+{
+    spi_baud_index = index;
+    for (size_t bus = 0; bus < bus_count; bus++)
+    {
+        scan->spi_baud_rate = block_io_port_set_baud_rate(bus, spi_baud_rates[index]);
+    }
+}
+
+static void start_scan()
+{
+    // Apply any changes from the other core:
+    apply_commands();
+    update_led_animations();
+
+    scan_start_time_us = block_io_port_get_time_us();
+
+    // Shift in a single '0' into the SS shift register of each bus:
+    for (size_t bus = 0; bus < bus_count; bus++)
+    {
+        restart_select(bus);
+        buses[bus].retry_pass = 0;
+        buses[bus].retry_stack_count = 0;
+    }
+
+    scan->is_complete = true;
+    scan->is_corrupted = false;
+    has_read_error = false;
+    has_tall_stack = false;
+    has_scan_changed = false;
+}
+
+// Works out how long to wait before the next scan. Someone is probably building while blocks keep
+// changing, so scan quickly to keep up with them. Otherwise, only scan often enough for a connected
+// device to stay up to date, or slowly if there isn't one.
+static uint32_t choose_scan_period_us(uint64_t now_us)
+{
+    if (has_scan_changed)
+    {
+        active_until_us = now_us + scan_policy.active_hold_us;
+    }
+
+    if (now_us < active_until_us)
+    {
+        return scan_policy.active_period_us;
+    }
+    else if (is_host_connected)
+    {
+        return scan_policy.connected_period_us;
+    }
+    else
+    {
+        return scan_policy.idle_period_us;
+    }
+}
+
+static void finish_scan()
+{
+    uint64_t now_us = block_io_port_get_time_us();
+    scan->scan_time_us = now_us - scan_start_time_us;
+    scan->structure_hash = structure_hash;
+    scan->scan_period_us = choose_scan_period_us(now_us);
+
+    // Completion can't be trusted if part of the grid couldn't be read:
+    if (!scan->is_corrupted && scan->is_complete != previous_is_complete)
+    {
+        block_io_event_t event = { .type = BLOCK_IO_EVENT_COMPLETION_CHANGED, .is_complete = scan->is_complete };
+        add_event(&event);
+        previous_is_complete = scan->is_complete;
+    }
+
+    // If corruption keeps appearing, the bus is probably running too fast for this board, so slow
+    // it down. The bus is idle between scans, so it's safe to change the rate here:
+    if (has_read_error)
+    {
+        corrupted_scans_in_a_row++;
+        clean_scans_in_a_row = 0;
+
+        if (corrupted_scans_in_a_row >= BACKOFF_CORRUPTED_SCANS && spi_baud_index > 0)
+        {
+            set_spi_baud_index(spi_baud_index - 1);
+            corrupted_scans_in_a_row = 0;
+            if (step_up_clean_scans < STEP_UP_MAX_CLEAN_SCANS)
+            {
+                step_up_clean_scans *= 2;
+            }
+        }
+    }
+    else
+    {
+        corrupted_scans_in_a_row = 0;
+
+        // After a long run of clean scans, try the next rate up. Calibration may not have had any
+        // tall stacks to go by, or whatever made the bus unreliable may have gone away. If the rate
+        // is still too fast, the backoff above soon slows it down again:
+        if (has_tall_stack && ++clean_scans_in_a_row >= step_up_clean_scans)
+        {
+            if (spi_baud_index < SPI_BAUD_RATE_COUNT - 1)
+            {
+                set_spi_baud_index(spi_baud_index + 1);
+            }
+            clean_scans_in_a_row = 0;
+        }
+    }
+
+    publish_scan();
+}
+
+// Selects the next tile on a bus and starts DMA transfers to read the whole of its stack.
+static void start_stack_scan(size_t bus)
+{
+    size_t grid_tile = buses[bus].async_grid_tile;
+    uint8_t *dma_write_buffer = buses[bus].dma_write_buffer;
+
+    // The LED data can't depend on the blocks being read, since it's all sent in one go. Use the
+    // previous scan of this tile instead. Each block ends up with one of the last bytes sent, so
+    // the LED data goes at the end, in order, and everything else is zero:
+    size_t previous_height = scan_grid_height[grid_tile];
+    memset(dma_write_buffer, 0x00, dma_transfer_length);
+    for (size_t height = 0; height < previous_height; height++)
+    {
+        dma_write_buffer[dma_transfer_length - previous_height + height] = get_led_data(block_index(grid_tile, height));
+    }
+
+    // Shift SS to the tile:
+    select_tile(bus, grid_tile);
+
+    block_io_port_start_transfer(bus, dma_write_buffer, buses[bus].dma_read_buffer, dma_transfer_length, stack_scan_finished_irh);
+}
+
+// Decodes a whole stack read by DMA. Returns whether it was corrupted.
+static bool decode_stack_scan(size_t grid_tile, const uint8_t *dma_read_buffer)
+{
+    uint8_t previous_rotation = 0x00; // base tile has a rotation of 0
+
+    for (size_t height = 0; height < height_limit; height++)
+    {
+        if (dma_read_buffer[height] == 0x00)
+        {
+            finish_stack(grid_tile, height);
+            return false;
+        }
+
+        if (decode_block(grid_tile, height, dma_read_buffer[height], &previous_rotation))
+        {
+            return true;
+        }
+    }
+
+    return check_terminator(grid_tile, dma_read_buffer[height_limit]);
+}
+
+// Every bus's DMA interrupt is handled on the scanning core, one at a time, so the buses can share
+// the scan without locking.
+static void stack_scan_finished_irh(size_t bus)
+{
+    size_t grid_tile = buses[bus].async_grid_tile;
+    finish_stack_read(bus, grid_tile, decode_stack_scan(grid_tile, buses[bus].dma_read_buffer));
+
+    if (get_next_tile(bus, &buses[bus].async_grid_tile))
+    {
+        start_stack_scan(bus);
+        return;
+    }
+
+    // The scan is finished once the last bus has read its last tile:
+    async_buses_running--;
+    if (async_buses_running == 0)
+    {
+        finish_scan();
+        is_async_scan_running = false;
+
+        if (async_complete_callback)
+        {
+            async_complete_callback();
+        }
+    }
+}
+
+// Finds the next stack on a bus with any blocks, from its 'async_grid_tile' onwards, and starts a
+// DMA transfer of just its LED data. Each block ends up with one of the bytes sent, in order, and
+// what's read back is ignored. Returns false once there are no stacks left.
+static bool start_led_refresh(size_t bus)
+{
+    size_t end_tile = buses[bus].first_tile + buses[bus].tile_count;
+    size_t grid_tile = buses[bus].async_grid_tile;
+    while (grid_tile < end_tile && scan_grid_height[grid_tile] == 0)
+    {
+        grid_tile++;
+    }
+    buses[bus].async_grid_tile = grid_tile;
+
+    if (grid_tile == end_tile)
+    {
+        return false;
+    }
+
+    // A stack's height comes from its last scan:
+    size_t height = scan_grid_height[grid_tile];
+    for (size_t y = 0; y < height; y++)
+    {
+        buses[bus].dma_write_buffer[y] = get_led_data(block_index(grid_tile, y));
+    }
+
+    select_tile(bus, grid_tile);
+    block_io_port_start_transfer(bus, buses[bus].dma_write_buffer, buses[bus].dma_read_buffer, height, led_refresh_finished_irh);
+    return true;
+}
+
+static void led_refresh_finished_irh(size_t bus)
+{
+    buses[bus].async_grid_tile++;
+    if (!start_led_refresh(bus))
+    {
+        led_refresh_buses_running--;
+    }
+}
+
+// Sends every stack its LED data without reading the grid, on all the buses at once, and waits for
+// it to finish. Empty stacks are skipped, so this is much quicker than a scan.
+static void refresh_leds()
+{
+    apply_commands();
+    update_led_animations();
+
+    // Count the buses with any blocks on before starting any, since the first may finish before
+    // the last has started:
+    led_refresh_buses_running = 0;
+    bool has_blocks[BLOCK_IO_MAX_BUS_COUNT] = { false };
+    for (size_t bus = 0; bus < bus_count; bus++)
+    {
+        for (size_t grid_tile = buses[bus].first_tile; grid_tile < buses[bus].first_tile + buses[bus].tile_count; grid_tile++)
+        {
+            has_blocks[bus] |= scan_grid_height[grid_tile] > 0;
+        }
+        led_refresh_buses_running += has_blocks[bus];
+    }
+
+    for (size_t bus = 0; bus < bus_count; bus++)
+    {
+        if (has_blocks[bus])
+        {
+            restart_select(bus);
+            buses[bus].async_grid_tile = buses[bus].first_tile;
+            start_led_refresh(bus);
+        }
+    }
+
+    while (led_refresh_buses_running > 0)
+    {
+        block_io_port_wait_for_event();
+    }
+}
+
+static void scanner_entry()
+{
+    // Every DMA transfer from now on is started on this core, so finish them here too:
+    block_io_port_claim_transfer_irq();
+
+    uint64_t next_scan_us = block_io_port_get_time_us();
+
+    while (true)
+    {
+        // Scan in the background. The callback is called from the DMA interrupt once done:
+        block_io_update_async(scanner_callback);
+
+        // The period depends on what the scan found, so wait for it to finish:
+        while (is_async_scan_running)
+        {
+            block_io_port_wait_for_event();
+        }
+
+        // Keep to the scan period. If a scan overran, start the next one straight away rather
+        // than trying to catch up:
+        next_scan_us += scan->scan_period_us;
+        if (next_scan_us <= block_io_port_get_time_us())
+        {
+            next_scan_us = block_io_port_get_time_us();
+        }
+
+        // Refresh the LEDs in between scans while they're animating or have been changed. Changes
+        // to the target structure are picked up too, but only show up once the next scan has
+        // checked the blocks against it:
+        uint32_t refresh_period_us = scan_policy.led_refresh_period_us;
+        for (uint64_t refresh_us = block_io_port_get_time_us() + refresh_period_us;
+            refresh_period_us > 0 && refresh_us < next_scan_us; refresh_us += refresh_period_us)
+        {
+            block_io_port_sleep_until(refresh_us);
+            if (is_led_animating() || spsc_queue_get_level(&command_queue) > 0)
+            {
+                refresh_leds();
+            }
+        }
+        block_io_port_sleep_until(next_scan_us);
+    }
+}
+
+// Gives each bus the same number of whole boards, in order, with any left over on the last bus.
+static void split_grid_between_buses()
+{
+    size_t board_count = (tile_count + BLOCK_IO_TILES_PER_BOARD - 1) / BLOCK_IO_TILES_PER_BOARD;
+    size_t tiles_per_bus = (board_count + bus_count - 1) / bus_count * BLOCK_IO_TILES_PER_BOARD;
+    size_t first_tile = 0;
+
+    for (size_t bus = 0; bus < bus_count; bus++)
+    {
+        size_t remaining_tiles = tile_count - first_tile;
+        buses[bus].first_tile = first_tile;
+        buses[bus].tile_count = remaining_tiles < tiles_per_bus ? remaining_tiles : tiles_per_bus;
+        first_tile += buses[bus].tile_count;
+
+        // Intialise the slave select shift register by filling it with ones:
+        for(size_t i = 0; i < buses[bus].tile_count; i++)
+        {
+            block_io_port_shift_select(bus, 1);
+        }
+        buses[bus].next_select_tile = first_tile; // the end of this bus, so nothing is selected
+    }
+}
+
+// Reads the stack on the selected tile one byte at a time. Returns whether it was corrupted.
+static bool read_stack(size_t bus, size_t grid_tile)
+{
+    uint8_t read_buffer;
+    uint8_t write_buffer = 0x00; // first byte will be the zero byte
+    uint8_t previous_rotation = 0x00; // base tile has a rotation of 0
+
+    // Process and shift blocks:
+    for (size_t height = 0; height < height_limit; height++)
+    {
+        read_buffer = block_io_port_transfer(bus, write_buffer);
+
+        // Once we've read all the blocks and gotten to the top of the stack, the next
+        // thing we'll read is the null block that we sent at the beginning.
+        if (read_buffer == 0x00)
+        {
+            finish_stack(grid_tile, height);
+            return false;
+        }
+
+        if (decode_block(grid_tile, height, read_buffer, &previous_rotation))
+        {
+            return true;
+        }
+
+        // The LED data for this block is sent straight back, as the next byte:
+        write_buffer = get_led_data(block_index(grid_tile, height));
+    } // end of block stack for-loop
+
+    // If we reached the height limit without reading a zero byte, read one more
+    // byte to see if we get the zero byte.
+    read_buffer = block_io_port_transfer(bus, write_buffer);
+    return check_terminator(grid_tile, read_buffer);
+}
+
+uint32_t block_io_calibrate_spi()
+{
+    if (is_scanner_running)
+    {
+        return result->spi_baud_rate;
+    }
+
+    // Try each rate in turn, keeping the fastest one that reads the grid without corruption. A
+    // rate is only accepted if every scan had a tall stack to test it with, so on an empty or low
+    // grid this stays at the slowest rate, and finish_scan() steps it up once there's something
+    // on the grid to go by:
+    size_t best_index = 0;
+    for (size_t index = 0; index < SPI_BAUD_RATE_COUNT; index++)
+    {
+        set_spi_baud_index(index);
+        corrupted_scans_in_a_row = 0;
+
+        bool is_reliable = true;
+        for (size_t i = 0; i < CALIBRATION_SCAN_COUNT && is_reliable; i++)
+        {
+            block_io_update();
+            is_reliable = !has_read_error && has_tall_stack;
+        }
+
+        if (!is_reliable)
+        {
+            break;
+        }
+        best_index = index;
+    }
+
+    set_spi_baud_index(best_index);
+    corrupted_scans_in_a_row = 0;
+    clean_scans_in_a_row = 0;
+    step_up_clean_scans = STEP_UP_CLEAN_SCANS;
+
+    // Errors are expected while calibrating, so don't count them:
+    memset(scan_tile_error_count, 0, tile_count * sizeof(uint32_t));
+    result->spi_baud_rate = scan->spi_baud_rate;
+    memset(get_tile_error_counts(result), 0, tile_count * sizeof(uint32_t));
+
+    return scan->spi_baud_rate;
+}
+
+void block_io_clear_block_leds()
+{
+    command_t command = { .type = COMMAND_CLEAR_BLOCK_LEDS };
+    send_command(&command);
+}
+
 void block_io_clear_target_structure()
 {
-    memset(target_structure, 0, sizeof(target_structure));
+    command_t command = { .type = COMMAND_CLEAR_TARGET };
+    send_command(&command);
+}
+
+void block_io_commit_target_structure()
+{
+    command_t command = { .type = COMMAND_COMMIT_TARGET };
+    send_command(&command);
+}
+
+void block_io_enable_change_events()
+{
+    is_change_event_enabled = true;
+}
+
+bool block_io_fetch_scan()
+{
+    if (is_scanner_running)
+    {
+        // Skip to the newest scan in the queue:
+        while (spsc_queue_try_remove(&result_queue, result))
+        {
+            is_result_new = true;
+        }
+    }
+
+    bool is_new = is_result_new;
+    is_result_new = false;
+    return is_new;
+}
+
+void block_io_finish_target_load()
+{
+    is_target_load_pending = true;
+    command_t command = { .type = COMMAND_LOAD_TARGET };
+    send_command(&command);
+}
+
+bool block_io_get_change_event(block_io_event_t *event)
+{
+    return spsc_queue_try_remove(&event_queue, event);
 }
 
 uint8_t block_io_get_block(size_t grid_tile, size_t height)
 {
-    if (grid_tile < BLOCK_IO_TILE_COUNT && height < HEIGHT_LIMIT)
+    if (grid_tile < tile_count && height < height_limit)
+    {
+        return get_structure(result)[block_index(grid_tile, height)];
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+size_t block_io_get_bus_count()
+{
+    return bus_count;
+}
+
+size_t block_io_get_bus_tile_count(size_t bus)
+{
+    if (bus < bus_count)
     {
-        return current_structure[grid_tile][height];
+        return buses[bus].tile_count;
     }
     else
     {
@@ -36,11 +1198,21 @@ uint8_t block_io_get_block(size_t grid_tile, size_t height)
     }
 }
 
+size_t block_io_get_height_limit()
+{
+    return height_limit;
+}
+
+size_t block_io_get_memory_used()
+{
+    return pool_used;
+}
+
 size_t block_io_get_stack_height(size_t grid_tile)
 {
-    if (grid_tile < BLOCK_IO_TILE_COUNT)
+    if (grid_tile < tile_count)
     {
-        return grid_height[grid_tile];
+        return get_grid_heights(result)[grid_tile];
     }
     else
     {
@@ -48,160 +1220,353 @@ size_t block_io_get_stack_height(size_t grid_tile)
     }
 }
 
+bool block_io_has_lost_change_events()
+{
+    // The count is only written by the scanning core, so compare it rather than clearing it:
+    uint32_t count = lost_event_count;
+    bool is_lost = count != lost_event_count_seen;
+    lost_event_count_seen = count;
+    return is_lost;
+}
+
 void block_io_init()
 {
-    // Set baudrate:
-    spi_init(spi0, 250000);
+    spsc_queue_init(&command_queue, command_queue_buffer, sizeof(command_t), COMMAND_QUEUE_SIZE);
+    spsc_queue_init(&event_queue, event_queue_buffer, sizeof(block_io_event_t), EVENT_QUEUE_SIZE);
+
+    // Start at the slowest baudrate. block_io_calibrate_spi() can find a faster one:
+    uint32_t spi_baud_rate = block_io_port_init_bus(0, spi_baud_rates[0]);
+
+    // Until the scanner is started, DMA scans and LED refreshes are finished on this core:
+    block_io_port_claim_transfer_irq();
+    bus_count = 1;
+
+    block_io_set_grid_size(BLOCK_IO_TILES_PER_BOARD, BLOCK_IO_DEFAULT_HEIGHT_LIMIT);
+
+    scan->spi_baud_rate = spi_baud_rate;
+    result->spi_baud_rate = spi_baud_rate;
+}
+
+size_t block_io_get_tile_count()
+{
+    return tile_count;
+}
+
+uint32_t block_io_get_structure_hash()
+{
+    return result->structure_hash;
+}
+
+uint32_t block_io_get_scan_period_us()
+{
+    return result->scan_period_us;
+}
+
+uint32_t block_io_get_scan_time_us()
+{
+    return result->scan_time_us;
+}
 
-    // Set GPIO pins:
-    gpio_set_function(SPI_RX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(SPI_SCK_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(SPI_TX_PIN, GPIO_FUNC_SPI);
-    gpio_init(SS_DATA_PIN);
-    gpio_init(SS_CLK_PIN);
-    gpio_set_dir(SS_DATA_PIN, GPIO_OUT);
-    gpio_set_dir(SS_CLK_PIN, GPIO_OUT);
+uint32_t block_io_get_spi_baud_rate()
+{
+    return result->spi_baud_rate;
+}
 
-    // Intialise the slave select shift register by filling it with ones:
-    gpio_put(SS_DATA_PIN, 1);
-    for(int i=0;i<BLOCK_IO_TILE_COUNT;i++)
+uint32_t block_io_get_tile_error_count(size_t grid_tile)
+{
+    if (grid_tile < tile_count)
+    {
+        return get_tile_error_counts(result)[grid_tile];
+    }
+    else
     {
-        gpio_put(SS_CLK_PIN, 0);
-        sleep_us(1);
-        gpio_put(SS_CLK_PIN, 1);
-        sleep_us(1);
+        return 0;
     }
 }
 
 bool block_io_is_complete()
 {
-    return is_complete;
+    return result->is_complete;
 }
 
 bool block_io_is_corrupted()
 {
-    return is_corrupted;
+    return result->is_corrupted;
+}
+
+bool block_io_is_tile_corrupted(size_t grid_tile)
+{
+    if (grid_tile < tile_count)
+    {
+        return get_tile_is_corrupted(result)[grid_tile];
+    }
+    else
+    {
+        return false;
+    }
+}
+
+bool block_io_is_scanning()
+{
+    return is_async_scan_running;
+}
+
+bool block_io_set_bus_count(size_t new_bus_count)
+{
+    if (is_scanner_running || new_bus_count == 0 || new_bus_count > BLOCK_IO_MAX_BUS_COUNT)
+    {
+        return false;
+    }
+
+    // Wait for any scan started by block_io_update_async() to finish:
+    while (is_async_scan_running)
+    {
+        block_io_port_wait_for_event();
+    }
+
+    // The new buses start at the same rate as the others:
+    for (size_t bus = 0; bus < new_bus_count; bus++)
+    {
+        block_io_port_init_bus(bus, spi_baud_rates[spi_baud_index]);
+    }
+    bus_count = new_bus_count;
+
+    split_grid_between_buses();
+
+    return true;
+}
+
+bool block_io_set_grid_size(size_t new_tile_count, size_t new_height_limit)
+{
+    if (is_scanner_running || new_tile_count == 0 || new_tile_count > BLOCK_IO_MAX_TILE_COUNT
+        || new_height_limit == 0 || new_height_limit > BLOCK_IO_MAX_HEIGHT_LIMIT
+        || new_tile_count * new_height_limit > BLOCK_IO_MAX_BLOCKS)
+    {
+        return false;
+    }
+
+    // Wait for any scan started by block_io_update_async() to finish:
+    while (is_async_scan_running)
+    {
+        block_io_port_wait_for_event();
+    }
+
+    uint32_t spi_baud_rate = scan ? scan->spi_baud_rate : 0;
+
+    tile_count = new_tile_count;
+    height_limit = new_height_limit;
+    stack_word_count = PACKED_STACK_WORD_COUNT(height_limit);
+    stack_size = stack_word_count * sizeof(uint32_t);
+    result_size = RESULT_SIZE(tile_count, tile_count * stack_size);
+    dma_transfer_length = height_limit + 1;
+
+    // Lay out the pool for the new size, starting from nothing:
+    memset(pool, 0, sizeof(pool));
+    pool_used = 0;
+
+    scan = allocate(result_size);
+    result = allocate(result_size);
+    spsc_queue_init(&result_queue, allocate(RESULT_QUEUE_SIZE * result_size), result_size, RESULT_QUEUE_SIZE);
+    target_structure = allocate(tile_count * stack_size);
+    staged_target_structure = allocate(tile_count * stack_size);
+    loading_target_structure = allocate(tile_count * stack_size);
+    previous_structure = allocate(tile_count * stack_size);
+    is_block_correct = allocate(tile_count * stack_size);
+    led_frame = allocate(tile_count * stack_size);
+    previous_grid_height = allocate(tile_count);
+    is_stack_retry_needed = allocate(tile_count);
+    stack_hashes = allocate(tile_count * sizeof(uint32_t));
+
+    scan_structure = get_structure(scan);
+    scan_grid_height = get_grid_heights(scan);
+    scan_tile_is_corrupted = get_tile_is_corrupted(scan);
+    scan_tile_error_count = get_tile_error_counts(scan);
+
+    // Every stack starts out empty:
+    structure_hash = 0;
+    for (size_t grid_tile = 0; grid_tile < tile_count; grid_tile++)
+    {
+        stack_hashes[grid_tile] = packed_stack_hash(grid_tile, get_stack_words(previous_structure, grid_tile), stack_word_count);
+        structure_hash ^= stack_hashes[grid_tile];
+    }
+
+    scan->spi_baud_rate = spi_baud_rate;
+    result->spi_baud_rate = spi_baud_rate;
+    scan->structure_hash = structure_hash;
+    result->structure_hash = structure_hash;
+    previous_is_complete = false;
+    is_target_load_pending = false;
+    is_result_new = false;
+    animated_block_count = 0;
+
+    split_grid_between_buses();
+
+    return true;
+}
+
+void block_io_load_target_block(size_t grid_tile, size_t height, uint8_t block_data)
+{
+    if (grid_tile < tile_count && height < height_limit)
+    {
+        loading_target_structure[block_index(grid_tile, height)] = block_data;
+    }
+}
+
+void block_io_refresh_leds()
+{
+    if (is_scanner_running)
+    {
+        return;
+    }
+
+    // Wait for any scan started by block_io_update_async() to finish:
+    while (is_async_scan_running)
+    {
+        block_io_port_wait_for_event();
+    }
+
+    refresh_leds();
+}
+
+void block_io_revert_target_structure()
+{
+    command_t command = { .type = COMMAND_REVERT_TARGET };
+    send_command(&command);
+}
+
+void block_io_set_block_led(size_t grid_tile, size_t height, led_colour_t colour, led_animation_t animation)
+{
+    if (grid_tile < tile_count && height < height_limit)
+    {
+        command_t command = {
+            .type = COMMAND_SET_BLOCK_LED,
+            .grid_tile = grid_tile,
+            .height = height,
+            .data = LED_FRAME_IS_SET | (animation << LED_FRAME_ANIMATION_SHIFT) | (colour & LED_FRAME_COLOUR_MASK)
+        };
+        send_command(&command);
+    }
+}
+
+void block_io_set_host_connected(bool is_connected)
+{
+    is_host_connected = is_connected;
+}
+
+void block_io_set_led_animation(led_mode_t mode, led_animation_t animation, uint16_t period_ms, uint16_t duration_ms)
+{
+    command_t command = {
+        .type = COMMAND_SET_LED_ANIMATION,
+        .data = (animation << 4) | mode,
+        .period_ms = period_ms > 0 ? period_ms : 1,
+        .duration_ms = duration_ms
+    };
+    send_command(&command);
 }
 
 void block_io_set_led_mode(led_mode_t mode)
 {
-    led_mode = mode;
+    command_t command = { .type = COMMAND_SET_LED_MODE, .data = mode };
+    send_command(&command);
+}
+
+void block_io_set_scan_policy(const block_io_scan_policy_t *policy)
+{
+    if (!is_scanner_running)
+    {
+        scan_policy = *policy;
+    }
 }
 
 void block_io_set_target_block(size_t grid_tile, size_t height, uint8_t block_data)
 {
-    if (grid_tile < BLOCK_IO_TILE_COUNT && height < HEIGHT_LIMIT)
+    if (grid_tile < tile_count && height < height_limit)
     {
-        target_structure[grid_tile][height] = block_data;
+        command_t command = { .type = COMMAND_SET_TARGET_BLOCK, .grid_tile = grid_tile, .height = height, .data = block_data };
+        send_command(&command);
     }
 }
 
-void block_io_update()
+void block_io_start_scanner(void (*on_scan)())
 {
-    // Shift in a single '0' into the SS shift register:
-    gpio_put(SS_DATA_PIN, 0);
-    gpio_put(SS_CLK_PIN, 0);
-    sleep_us(1);
-    gpio_put(SS_CLK_PIN, 1);
-    sleep_us(1);
-    gpio_put(SS_DATA_PIN, 1);
+    scanner_callback = on_scan;
+    is_scanner_running = true;
+
+    // Hand the transfer interrupt over to the scanning core, or both cores would handle it:
+    block_io_port_release_transfer_irq();
+    block_io_port_launch_scanner(scanner_entry);
+}
 
-    is_complete = true;
-    is_corrupted = false;
+void block_io_start_target_load()
+{
+    // The scanner copies the last load at its next scan or LED refresh, so this only waits if loads
+    // come one straight after another:
+    while (is_target_load_pending)
+    {
+        block_io_port_wait_for_event();
+    }
+    memset(loading_target_structure, 0, tile_count * stack_size);
+}
 
-    // For every tile in grid:
-    for(int grid_tile = 0; grid_tile < BLOCK_IO_TILE_COUNT; grid_tile++)
+void block_io_update()
+{
+    // Wait for any scan started by block_io_update_async() to finish:
+    while (is_async_scan_running)
     {
-        uint8_t read_buffer;
-        uint8_t write_buffer = 0x00; // first byte will be the zero byte
-        uint8_t previous_rotation = 0x00; // base tile has a rotation of 0
-        uint8_t height;
+        block_io_port_wait_for_event();
+    }
 
-        // Shift SS to next slave:
-        gpio_put(SS_CLK_PIN, 0);
-        sleep_us(1);
-        gpio_put(SS_CLK_PIN, 1);
-        sleep_us(1);
+    start_scan();
 
-        // Process and shift blocks:
-        for (height = 0; height < HEIGHT_LIMIT; height++)
+    // For every tile in grid, one bus after another:
+    for (size_t bus = 0; bus < bus_count; bus++)
+    {
+        if (buses[bus].tile_count == 0)
         {
-            spi_write_read_blocking(spi0, &write_buffer, &read_buffer, 1);
-
-            // Once we've read all the blocks and gotten to the top of the stack, the next
-            // thing we'll read is the null block that we sent at the beginning. Exit the loop.
-            if (read_buffer == 0x00)
-            {
-                grid_height[grid_tile] = height;
+            continue;
+        }
 
-                // Check whether this is the top block in the target_structure too:
-                if (target_structure[grid_tile][height] != 0x00)
-                {
-                    is_complete = false;
-                }
+        size_t grid_tile = buses[bus].first_tile;
+        do
+        {
+            // Shift SS to the tile:
+            select_tile(bus, grid_tile);
+            finish_stack_read(bus, grid_tile, read_stack(bus, grid_tile));
+        } while (get_next_tile(bus, &grid_tile));
+    } // end of bus for-loop
 
-                break;
-            }
+    finish_scan();
+}
 
-            // Decode block data:
-            uint8_t block_id = read_buffer & 0xFC;
-            uint8_t relative_rotation = read_buffer & 0x03;
-            uint8_t absolute_rotation = (relative_rotation + previous_rotation) & 0x03;
-            uint8_t rotation_mask = ((read_buffer >> 2) & 0x03);
-            uint8_t block_mask = 0xFC | rotation_mask;
-            uint8_t absolute_block = block_id | absolute_rotation;
-            uint8_t target_block = target_structure[grid_tile][height];
-            bool is_correct = (absolute_block & block_mask) == (target_block & block_mask);
-            previous_rotation = absolute_rotation;
-
-            if (!is_correct)
-            {
-                is_complete = false;
-            }
+void block_io_update_async(void (*on_complete)())
+{
+    // Wait for the previous scan to finish:
+    while (is_async_scan_running)
+    {
+        block_io_port_wait_for_event();
+    }
 
-            // Save block to memory:
-            current_structure[grid_tile][height] = absolute_block;
+    async_complete_callback = on_complete;
+    is_async_scan_running = true;
 
-            // LED data generation:
-            switch(led_mode)
-            {
-                case TARGET:
-                    if (is_correct)
-                    {
-                        write_buffer = 0x02; // green LED
-                    }
-                    else
-                    {
-                        write_buffer = 0x01; // red LED
-                    }
-                    break;
-                case GREEN:
-                    write_buffer = 0x02; // green LED
-                    break;
-                case RED:
-                    write_buffer = 0x01; // red LED
-                    break;
-                case OFF: // fallthrough
-                default:
-                    write_buffer = 0x00; // no LED
-                    break;
-            }
-        } // end of block stack for-loop
+    start_scan();
 
-        // If we reached the height limit without reading a zero byte, read one more
-        // byte to see if we get the zero byte. If not, then the stack is either higher
-        // than the limit, or the data has been corrupted and we missed the zero byte.
-        // We will assume that the data was corrupted.
-        if (height == HEIGHT_LIMIT)
+    // Count the buses before starting any, since the first may finish before the last has started:
+    async_buses_running = 0;
+    for (size_t bus = 0; bus < bus_count; bus++)
+    {
+        buses[bus].async_grid_tile = buses[bus].first_tile;
+        if (buses[bus].tile_count > 0)
         {
-            spi_write_read_blocking(spi0, &write_buffer, &read_buffer, 1);
+            async_buses_running++;
+        }
+    }
 
-            if (read_buffer != 0x00)
-            {
-                grid_height[grid_tile] = 0;
-                is_complete = false;
-                is_corrupted = true;
-            }
+    for (size_t bus = 0; bus < bus_count; bus++)
+    {
+        if (buses[bus].tile_count > 0)
+        {
+            start_stack_scan(bus);
         }
-    } // end of grid tile for-loop
-}
\ No newline at end of file
+    }
+}
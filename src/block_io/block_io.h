@@ -5,28 +5,221 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
-#define BLOCK_IO_TILE_COUNT 9
+// Each base board has a 3x3 grid of tiles. Base boards can be chained together, which extends the
+// slave select shift register, so a chain of N boards has N * BLOCK_IO_TILES_PER_BOARD tiles:
+#define BLOCK_IO_TILES_PER_BOARD 9
+#define BLOCK_IO_DEFAULT_HEIGHT_LIMIT 16
+
+// Most base boards that can be chained together, set at build time with the BLOCK_IO_MAX_BOARD_COUNT
+// CMake option. Storage for the grid, here and in the structure messages, is reserved for this many
+// boards at the default height limit, so a single board doesn't pay for a long chain:
+#ifndef BLOCK_IO_MAX_BOARD_COUNT
+#define BLOCK_IO_MAX_BOARD_COUNT 1
+#endif
+
+// Largest grid that block_io_set_grid_size() accepts. Storage for the grid is reserved for
+// BLOCK_IO_MAX_BLOCKS blocks, shared out between however many tiles there are, so taller stacks
+// are allowed on grids with fewer tiles. Tiles are numbered with a single byte:
+#ifndef BLOCK_IO_MAX_TILE_COUNT
+#define BLOCK_IO_MAX_TILE_COUNT (BLOCK_IO_MAX_BOARD_COUNT * BLOCK_IO_TILES_PER_BOARD)
+#endif
+#define BLOCK_IO_MAX_HEIGHT_LIMIT 32
+#ifndef BLOCK_IO_MAX_BLOCKS
+#define BLOCK_IO_MAX_BLOCKS (BLOCK_IO_MAX_TILE_COUNT * BLOCK_IO_DEFAULT_HEIGHT_LIMIT)
+#endif
+
+#if BLOCK_IO_MAX_TILE_COUNT > 256
+#error "BLOCK_IO_MAX_TILE_COUNT can't be more than 256"
+#endif
+
+// Number of block buses the board can drive. Each bus has its own slave select shift register and
+// chain of base boards, and all of them are scanned at the same time:
+#define BLOCK_IO_MAX_BUS_COUNT 3
+
+// Animation period of the LEDs set by block_io_set_block_led():
+#define BLOCK_IO_BLOCK_LED_PERIOD_MS 1000
 
 typedef enum { TARGET, GREEN, RED, OFF } led_mode_t;
 
+// The LED data a block is sent. Each block has a red and a green LED, with no brightness control:
+typedef enum { LED_COLOUR_OFF = 0x00, LED_COLOUR_RED = 0x01, LED_COLOUR_GREEN = 0x02 } led_colour_t;
+
+// How an LED changes over its animation period. A flashing LED is lit for the first half of each
+// period. A pulsing one is lit for a share of LED refreshes that rises and falls over the period.
+typedef enum { LED_ANIMATION_NONE, LED_ANIMATION_FLASH, LED_ANIMATION_PULSE } led_animation_t;
+
+typedef enum { BLOCK_IO_EVENT_BLOCK_CHANGED, BLOCK_IO_EVENT_COMPLETION_CHANGED } block_io_event_type_t;
+
+/**
+ * Something that changed between one scan and the next. For BLOCK_IO_EVENT_BLOCK_CHANGED,
+ * 'old_block' and 'new_block' are the block data at 'grid_tile' and 'height' before and after the
+ * change, where 0x00 means there was no block. For BLOCK_IO_EVENT_COMPLETION_CHANGED,
+ * 'is_complete' is the new result of block_io_is_complete().
+ */
+typedef struct
+{
+    block_io_event_type_t type;
+    uint8_t grid_tile;
+    uint8_t height;
+    uint8_t old_block;
+    uint8_t new_block;
+    bool is_complete;
+} block_io_event_t;
+
+/**
+ * How often the scanner started by block_io_start_scanner() reads the grid. After any block
+ * changes, it scans every 'active_period_us' until nothing has changed for 'active_hold_us'. Then
+ * it slows down to 'connected_period_us' while a device is connected (see
+ * block_io_set_host_connected()), or 'idle_period_us' while nobody is.
+ *
+ * Between scans, the LEDs are refreshed every 'led_refresh_period_us' while they're animating or
+ * have just been changed, without reading the grid (see block_io_refresh_leds()). 0 only updates
+ * the LEDs with each scan.
+ */
+typedef struct
+{
+    uint32_t active_period_us;
+    uint32_t active_hold_us;
+    uint32_t connected_period_us;
+    uint32_t idle_period_us;
+    uint32_t led_refresh_period_us;
+} block_io_scan_policy_t;
+
 /**
- * Removes all the blocks from the target structure. Call this before setting a new target
+ * Finds the fastest SPI clock rate that the block bus can run at reliably, and switches to it.
+ * Each rate, from slowest to fastest, is used for a number of scans, stopping at the first one
+ * which gives a corrupted scan. Only scans with a stack at least half the height limit count, so
+ * with no stacks that tall on the grid, the slowest rate is kept. Returns the chosen rate in Hz.
+ * Must be called before block_io_start_scanner(); after that it just returns the current rate.
+ *
+ * Whatever rate is chosen, the clock is slowed down again if corruption keeps appearing, and sped
+ * up again after a long run of clean scans with tall stacks.
+ */
+uint32_t block_io_calibrate_spi();
+
+/**
+ * Removes the LED colours set by block_io_set_block_led(), so that every block goes back to the
+ * LED mode.
+ */
+void block_io_clear_block_leds();
+
+/**
+ * Removes all the blocks from the staged target structure. Call this before setting a new target
  * structure with block_io_set_target_block().
  */
 void block_io_clear_target_structure();
 
+/**
+ * Swaps the staged target structure in, so that scans check against it from then on. Each scan
+ * sees either the whole of the old target or the whole of the new one, never a mix. The staged
+ * target then starts again as a copy of the new one, ready for further changes.
+ */
+void block_io_commit_target_structure();
+
+/**
+ * Starts producing change events for block_io_get_change_event(). Until this is called, scans
+ * don't produce any, so the queue doesn't fill up with events that nobody reads. Can be called
+ * from core 0 at any time.
+ */
+void block_io_enable_change_events();
+
+/**
+ * Fetches the latest results from the scanner started by block_io_start_scanner(). Returns
+ * whether there was a new scan since the last call. The results returned by
+ * block_io_get_block(), block_io_get_stack_height(), block_io_is_complete() and
+ * block_io_is_corrupted() only change when this is called, so they always come from the same scan.
+ */
+bool block_io_fetch_scan();
+
+/**
+ * Stages the target structure written since block_io_start_target_load(), replacing the staged
+ * target as a whole. Use block_io_commit_target_structure() afterwards to swap it in.
+ */
+void block_io_finish_target_load();
+
+/**
+ * Removes the oldest change event from the queue and copies it into 'event'. Returns false if
+ * there are no events. Events are only produced once block_io_enable_change_events() has been
+ * called, and are available as soon as a scan finishes, without calling block_io_fetch_scan().
+ * Corrupted stacks don't produce events: changes are reported once the stack is read properly
+ * again.
+ */
+bool block_io_get_change_event(block_io_event_t *event);
+
+/**
+ * Returns the number of block buses in use.
+ */
+size_t block_io_get_bus_count();
+
+/**
+ * Returns the number of tiles on a block bus. Bus 0 has the first tiles of the grid, followed by
+ * bus 1 and so on.
+ */
+size_t block_io_get_bus_tile_count(size_t bus);
+
 /**
  * Returns the data of a block at a given location of actual structure.
  */
 uint8_t block_io_get_block(size_t grid_tile, size_t height);
 
+/**
+ * Returns how long the scanner waits between the start of the last scan and the next one, in
+ * microseconds, as chosen by the scan policy.
+ */
+uint32_t block_io_get_scan_period_us();
+
+/**
+ * Returns how long the last scan took, in microseconds.
+ */
+uint32_t block_io_get_scan_time_us();
+
+/**
+ * Returns the maximum number of blocks in each stack.
+ */
+size_t block_io_get_height_limit();
+
+/**
+ * Returns the number of bytes of grid storage being used for the current grid size.
+ */
+size_t block_io_get_memory_used();
+
+/**
+ * Returns the SPI clock rate the block bus is running at, in Hz.
+ */
+uint32_t block_io_get_spi_baud_rate();
+
 /**
  * Return the height of a stack on a given tile of the actual structure, not the target.
  */
 size_t block_io_get_stack_height(size_t grid_tile);
 
 /**
- * Initialise block I/O module.
+ * Returns a hash of the current structure, as given by block_io_get_block() and
+ * block_io_get_stack_height(). It's kept up to date a stack at a time as the structure changes, so
+ * it's cheap to use for checking whether anything changed since an earlier scan.
+ */
+uint32_t block_io_get_structure_hash();
+
+/**
+ * Returns the number of tiles in the grid.
+ */
+size_t block_io_get_tile_count();
+
+/**
+ * Returns the number of times the stack on 'grid_tile' was read corrupted, including reads that
+ * were put right by reading it again, since initialisation or calibration.
+ */
+uint32_t block_io_get_tile_error_count(size_t grid_tile);
+
+/**
+ * Returns true if change events have been lost because the queue was full, since the last time
+ * this was called. If so, the events no longer describe every change, and the whole grid should
+ * be read again.
+ */
+bool block_io_has_lost_change_events();
+
+/**
+ * Initialise block I/O module, with a grid of a single base board.
  */
 void block_io_init();
 
@@ -36,26 +229,136 @@ void block_io_init();
 bool block_io_is_complete();
 
 /**
- * Returns whether the current structure is corrupted. If it is, then some of the data given
- * by block_io_get_block(), block_io_get_stack_height() and block_io_is_complete() may be wrong.
- * Another call to block_io_update will read the structure again and should fix the corruption.
+ * Returns whether any stack in the current structure is corrupted. A stack that is corrupted is read
+ * again straight away, within the same scan, so this only happens if it stayed corrupted after
+ * several attempts. block_io_is_tile_corrupted() gives the stacks affected, which keep the data
+ * from their last good scan, so the rest of the grid can still be used as normal. Completion can't
+ * be judged while any stack is corrupted, so block_io_is_complete() returns false.
  */
 bool block_io_is_corrupted();
 
 /**
- * Sets the block LED mode.
+ * Returns whether the stack on 'grid_tile' couldn't be read in the current scan. If so,
+ * block_io_get_block() and block_io_get_stack_height() give the stack from the last scan in which
+ * it was read correctly.
+ */
+bool block_io_is_tile_corrupted(size_t grid_tile);
+
+/**
+ * Returns whether a scan started by block_io_update_async() is still running.
+ */
+bool block_io_is_scanning();
+
+/**
+ * Sets a single block of the target structure being loaded since block_io_start_target_load().
+ * Unlike block_io_set_target_block(), this never waits for the scanner, so it's the quick way to
+ * set a whole structure.
+ */
+void block_io_load_target_block(size_t grid_tile, size_t height, uint8_t block_data);
+
+/**
+ * Throws away any changes to the staged target structure since the last commit, making it a copy
+ * of the target in use again.
+ */
+void block_io_revert_target_structure();
+
+/**
+ * Sends the LED data to every block without reading the grid, so that LED changes and animations
+ * show up between scans. Stacks are assumed to be the height they were in the last scan, so a
+ * block added since then gets the wrong LED data until the next scan. Only use this when not using
+ * block_io_start_scanner(), which refreshes the LEDs itself.
+ */
+void block_io_refresh_leds();
+
+/**
+ * Spreads the grid across 'bus_count' block buses, so that they can be scanned at the same time.
+ * Each bus gets the same number of whole base boards, in order, apart from the last one which may
+ * get fewer. For example, with 4 boards on 2 buses, boards 1 and 2 are on bus 0 and boards 3 and 4
+ * are on bus 1. Returns false, leaving the buses as they were, if 'bus_count' is more than
+ * BLOCK_IO_MAX_BUS_COUNT. Only call this before block_io_start_scanner().
+ */
+bool block_io_set_bus_count(size_t bus_count);
+
+/**
+ * Sets the number of tiles in the grid and the maximum number of blocks in each stack. Returns
+ * false, leaving the grid as it was, if it's bigger than the BLOCK_IO_MAX_ limits. The target
+ * structure, error counts and scan results are all cleared. Only call this before
+ * block_io_start_scanner().
+ */
+bool block_io_set_grid_size(size_t tile_count, size_t height_limit);
+
+/**
+ * Tells the scanner whether a device is connected, for the scan policy. Can be called from core 0
+ * at any time.
+ */
+void block_io_set_host_connected(bool is_connected);
+
+/**
+ * Sets the LED of a single block, overriding the LED mode for that block until
+ * block_io_clear_block_leds() is called. An animated block flashes or pulses with a period of
+ * BLOCK_IO_BLOCK_LED_PERIOD_MS. The colour stays with the position in the grid, whichever block is
+ * there.
+ */
+void block_io_set_block_led(size_t grid_tile, size_t height, led_colour_t colour, led_animation_t animation);
+
+/**
+ * Plays an animation across the whole grid, taking over from the LED mode and any block LEDs.
+ * Every block shows the LED data of 'mode', animated with a period of 'period_ms', for
+ * 'duration_ms' (or until the next call, if 0). Afterwards the LEDs go back to normal.
+ * LED_ANIMATION_NONE stops the animation straight away.
+ */
+void block_io_set_led_animation(led_mode_t mode, led_animation_t animation, uint16_t period_ms, uint16_t duration_ms);
+
+/**
+ * Sets the block LED mode. While an animation from block_io_set_led_animation() is playing, the
+ * new mode is shown once it finishes.
  */
 void block_io_set_led_mode(led_mode_t mode);
 
 /**
- * Sets a single block in the target structure. Use block_io_clear_target_structure() first when
+ * Sets how often the scanner reads the grid. Only call this before block_io_start_scanner(). The
+ * default is a steady 50 ms, with the LEDs refreshed every 20 ms in between.
+ */
+void block_io_set_scan_policy(const block_io_scan_policy_t *policy);
+
+/**
+ * Sets a single block in the staged target structure, which takes effect once
+ * block_io_commit_target_structure() is called. Use block_io_clear_target_structure() first when
  * starting a new target structure.
  */
 void block_io_set_target_block(size_t grid_tile, size_t height, uint8_t block_data);
 
 /**
- * Reads entire grid and sends appropriate LED data.
+ * Starts scanning the grid on core 1, as often as the scan policy says. After each scan, 'on_scan'
+ * (if not NULL) is called on core 1 from the scan's DMA interrupt, so keep it short; use
+ * block_io_fetch_scan() on core 0 to get the results. The target structure and LED functions
+ * can still be used from core 0 (including from interrupts), and are passed over to core 1. Don't
+ * call block_io_update() after this.
+ */
+void block_io_start_scanner(void (*on_scan)());
+
+/**
+ * Starts loading a new target structure, with no blocks, which is built up with
+ * block_io_load_target_block() and staged in one go by block_io_finish_target_load(). A load
+ * that's never finished is just thrown away. Only call these from core 0's main program, not from
+ * interrupts. If the previous load is still waiting for the scanner to pick it up, this waits for
+ * it first.
+ */
+void block_io_start_target_load();
+
+/**
+ * Reads entire grid and sends appropriate LED data. Only use this when not using
+ * block_io_start_scanner().
  */
 void block_io_update();
 
+/**
+ * Starts reading the entire grid in the background using DMA, and returns straight away. Waits
+ * first if a previous scan is still running. 'on_complete' (if not NULL) is called from the DMA
+ * interrupt, on the calling core, once the results are ready. The LED data sent with each stack
+ * is based on the previous scan of it, so the LEDs lag the blocks by one scan. Only use this
+ * when not using block_io_start_scanner().
+ */
+void block_io_update_async(void (*on_complete)());
+
 #endif /* BLOCK_IO_H */
\ No newline at end of file
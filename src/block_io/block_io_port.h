@@ -0,0 +1,88 @@
+#ifndef BLOCK_IO_PORT_H
+#define BLOCK_IO_PORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Everything block_io.c needs from the hardware. block_io_port_rp2040.c drives the real block buses,
+// and the host tests provide simulated ones so that scanning can be tested and measured on a PC.
+//
+// There are up to BLOCK_IO_MAX_BUS_COUNT block buses, numbered from 0. Each has its own SPI
+// master, DMA channels and slave select shift register, so they can all transfer at once.
+
+/**
+ * Sets up a block bus: its SPI master, DMA channels and slave select shift register. Does nothing
+ * if it's already set up. Returns the actual SPI clock rate, which may differ slightly from
+ * 'baud_rate'.
+ */
+uint32_t block_io_port_init_bus(size_t bus, uint32_t baud_rate);
+
+/**
+ * Changes the SPI clock rate of a bus. Only call while the bus is idle. Returns the actual rate.
+ */
+uint32_t block_io_port_set_baud_rate(size_t bus, uint32_t baud_rate);
+
+/**
+ * Shifts a bit into a bus's slave select shift register, and waits for it to get there.
+ */
+void block_io_port_shift_select(size_t bus, bool bit);
+
+/**
+ * Sends a byte to the selected stack on a bus while reading one back, and waits for it to finish.
+ */
+uint8_t block_io_port_transfer(size_t bus, uint8_t data);
+
+/**
+ * Starts sending 'length' bytes from 'write_buffer' to the selected stack on a bus while reading
+ * the same number back into 'read_buffer', and returns straight away. 'on_complete' is called
+ * with the bus number from an interrupt, on the calling core, once the last byte has been read.
+ * Only one transfer can run on each bus at a time, but every bus can be running one.
+ */
+void block_io_port_start_transfer(size_t bus, const uint8_t *write_buffer, uint8_t *read_buffer, size_t length, void (*on_complete)(size_t bus));
+
+/**
+ * Sets up the transfer interrupt on the calling core, so that the 'on_complete' callbacks of
+ * block_io_port_start_transfer() are called there. Interrupts are enabled per core, so only one
+ * core can have it at a time: release it with block_io_port_release_transfer_irq() before
+ * claiming it on the other one.
+ */
+void block_io_port_claim_transfer_irq();
+
+/**
+ * Stops the transfer interrupt on the calling core, which must be the one that claimed it.
+ */
+void block_io_port_release_transfer_irq();
+
+/**
+ * Returns the time since boot, in microseconds.
+ */
+uint64_t block_io_port_get_time_us();
+
+/**
+ * Sleeps until the given time since boot, in microseconds.
+ */
+void block_io_port_sleep_until(uint64_t time_us);
+
+/**
+ * Sleeps until an interrupt or event, such as the end of a transfer, may have happened.
+ */
+void block_io_port_wait_for_event();
+
+/**
+ * Disables interrupts on the calling core, returning the previous state to pass to
+ * block_io_port_restore_interrupts().
+ */
+uint32_t block_io_port_disable_interrupts();
+
+/**
+ * Restores the interrupt state returned by block_io_port_disable_interrupts().
+ */
+void block_io_port_restore_interrupts(uint32_t status);
+
+/**
+ * Runs 'entry' on the other core.
+ */
+void block_io_port_launch_scanner(void (*entry)());
+
+#endif /* BLOCK_IO_PORT_H */
@@ -0,0 +1,268 @@
+#include "block_io.h"
+#include "block_io_port.h"
+#include "block_io_spi.pio.h"
+#include "block_io_ss.pio.h"
+#include "hardware/spi.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+#include "pico/platform.h"
+#include "pico/time.h"
+
+// The slave select shift registers are clocked by PIO state machines. At 10 MHz, each step
+// takes 600 ns.
+#define SS_PIO pio0
+#define SS_PIO_CLKDIV 12.5f
+
+// spi1 is used by the SD card, so any buses after the first use PIO SPI masters instead:
+#define SPI_PIO pio1
+#define SPI_PIO_CYCLES_PER_BIT 4
+
+typedef struct
+{
+    spi_inst_t *spi; // NULL for a PIO SPI master
+    uint ss_data_pin;
+    uint ss_clk_pin;
+    uint sck_pin;
+    uint tx_pin;
+    uint rx_pin;
+} bus_config_t;
+
+static const bus_config_t bus_configs[BLOCK_IO_MAX_BUS_COUNT] = {
+    { .spi = spi0, .ss_data_pin = 0, .ss_clk_pin = 1, .sck_pin = 2, .tx_pin = 3, .rx_pin = 4 },
+    { .spi = NULL, .ss_data_pin = 14, .ss_clk_pin = 15, .sck_pin = 16, .tx_pin = 17, .rx_pin = 19 },
+    { .spi = NULL, .ss_data_pin = 20, .ss_clk_pin = 21, .sck_pin = 22, .tx_pin = 26, .rx_pin = 27 },
+};
+
+typedef struct
+{
+    bool is_initialised;
+    uint ss_sm;
+    uint spi_sm; // only for PIO SPI masters
+    uint tx_dma_channel;
+    uint rx_dma_channel;
+    void (*on_complete)(size_t bus);
+} bus_t;
+
+static bus_t buses[BLOCK_IO_MAX_BUS_COUNT];
+
+static bool is_ss_program_added = false;
+static uint ss_program_offset;
+static bool is_spi_program_added = false;
+static uint spi_program_offset;
+static bool is_irq_handler_added = false;
+
+static void spi_dma_finished_irh()
+{
+    // This interrupt is potentially shared by other DMA channels.
+    // Check which of our DMA channels triggered the interrupt.
+    for (size_t bus = 0; bus < BLOCK_IO_MAX_BUS_COUNT; bus++)
+    {
+        if (buses[bus].is_initialised && dma_channel_get_irq0_status(buses[bus].rx_dma_channel))
+        {
+            dma_channel_acknowledge_irq0(buses[bus].rx_dma_channel);
+            buses[bus].on_complete(bus);
+        }
+    }
+}
+
+static float get_pio_clkdiv(uint32_t baud_rate)
+{
+    return (float)clock_get_hz(clk_sys) / (SPI_PIO_CYCLES_PER_BIT * baud_rate);
+}
+
+static uint32_t get_pio_baud_rate(float clkdiv)
+{
+    return clock_get_hz(clk_sys) / (SPI_PIO_CYCLES_PER_BIT * clkdiv);
+}
+
+uint32_t block_io_port_init_bus(size_t bus_number, uint32_t baud_rate)
+{
+    const bus_config_t *config = &bus_configs[bus_number];
+    bus_t *bus = &buses[bus_number];
+
+    if (bus->is_initialised)
+    {
+        return block_io_port_set_baud_rate(bus_number, baud_rate);
+    }
+
+    // Set up the SPI master. The DMA channels read and write its data register (or FIFOs):
+    uint32_t actual_baud_rate;
+    volatile void *tx_register;
+    const volatile void *rx_register;
+    uint tx_dreq;
+    uint rx_dreq;
+
+    if (config->spi)
+    {
+        actual_baud_rate = spi_init(config->spi, baud_rate);
+        gpio_set_function(config->rx_pin, GPIO_FUNC_SPI);
+        gpio_set_function(config->sck_pin, GPIO_FUNC_SPI);
+        gpio_set_function(config->tx_pin, GPIO_FUNC_SPI);
+
+        tx_register = &spi_get_hw(config->spi)->dr;
+        rx_register = &spi_get_hw(config->spi)->dr;
+        tx_dreq = spi_get_dreq(config->spi, true);
+        rx_dreq = spi_get_dreq(config->spi, false);
+    }
+    else
+    {
+        if (!is_spi_program_added)
+        {
+            spi_program_offset = pio_add_program(SPI_PIO, &block_io_spi_program);
+            is_spi_program_added = true;
+        }
+        bus->spi_sm = pio_claim_unused_sm(SPI_PIO, true);
+        float clkdiv = get_pio_clkdiv(baud_rate);
+        block_io_spi_program_init(SPI_PIO, bus->spi_sm, spi_program_offset, config->sck_pin, config->tx_pin, config->rx_pin, clkdiv);
+        actual_baud_rate = get_pio_baud_rate(clkdiv);
+
+        // Byte accesses to the FIFOs, so that the byte written is copied across the whole word and
+        // the byte read is the one just received:
+        tx_register = (volatile uint8_t *)&SPI_PIO->txf[bus->spi_sm];
+        rx_register = (const volatile uint8_t *)&SPI_PIO->rxf[bus->spi_sm];
+        tx_dreq = pio_get_dreq(SPI_PIO, bus->spi_sm, true);
+        rx_dreq = pio_get_dreq(SPI_PIO, bus->spi_sm, false);
+    }
+
+    // Set up DMA for block_io_port_start_transfer(). One channel feeds the SPI master's TX FIFO
+    // while the other empties its RX FIFO. The interrupt is raised once the last byte has been
+    // received:
+    bus->tx_dma_channel = dma_claim_unused_channel(true);
+    bus->rx_dma_channel = dma_claim_unused_channel(true);
+
+    dma_channel_config tx_dma_channel_config = dma_channel_get_default_config(bus->tx_dma_channel);
+    channel_config_set_transfer_data_size(&tx_dma_channel_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&tx_dma_channel_config, true);
+    channel_config_set_write_increment(&tx_dma_channel_config, false);
+    channel_config_set_dreq(&tx_dma_channel_config, tx_dreq);
+    dma_channel_set_config(bus->tx_dma_channel, &tx_dma_channel_config, false);
+    dma_channel_set_write_addr(bus->tx_dma_channel, tx_register, false);
+
+    dma_channel_config rx_dma_channel_config = dma_channel_get_default_config(bus->rx_dma_channel);
+    channel_config_set_transfer_data_size(&rx_dma_channel_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&rx_dma_channel_config, false);
+    channel_config_set_write_increment(&rx_dma_channel_config, true);
+    channel_config_set_dreq(&rx_dma_channel_config, rx_dreq);
+    dma_channel_set_config(bus->rx_dma_channel, &rx_dma_channel_config, false);
+    dma_channel_set_read_addr(bus->rx_dma_channel, rx_register, false);
+    dma_channel_set_irq0_enabled(bus->rx_dma_channel, true);
+
+    // Set up the state machine which clocks the slave select shift register:
+    if (!is_ss_program_added)
+    {
+        ss_program_offset = pio_add_program(SS_PIO, &block_io_ss_program);
+        is_ss_program_added = true;
+    }
+    bus->ss_sm = pio_claim_unused_sm(SS_PIO, true);
+    block_io_ss_program_init(SS_PIO, bus->ss_sm, ss_program_offset, config->ss_data_pin, config->ss_clk_pin, SS_PIO_CLKDIV);
+
+    bus->is_initialised = true;
+
+    return actual_baud_rate;
+}
+
+uint32_t block_io_port_set_baud_rate(size_t bus, uint32_t baud_rate)
+{
+    const bus_config_t *config = &bus_configs[bus];
+
+    if (config->spi)
+    {
+        return spi_set_baudrate(config->spi, baud_rate);
+    }
+    else
+    {
+        float clkdiv = get_pio_clkdiv(baud_rate);
+        pio_sm_set_clkdiv(SPI_PIO, buses[bus].spi_sm, clkdiv);
+        return get_pio_baud_rate(clkdiv);
+    }
+}
+
+void block_io_port_shift_select(size_t bus, bool bit)
+{
+    pio_sm_put_blocking(SS_PIO, buses[bus].ss_sm, bit);
+    pio_sm_get_blocking(SS_PIO, buses[bus].ss_sm);
+}
+
+uint8_t block_io_port_transfer(size_t bus, uint8_t data)
+{
+    const bus_config_t *config = &bus_configs[bus];
+
+    if (config->spi)
+    {
+        uint8_t read_data;
+        spi_write_read_blocking(config->spi, &data, &read_data, 1);
+        return read_data;
+    }
+    else
+    {
+        // The state machine sends the most significant bits of the word first:
+        pio_sm_put_blocking(SPI_PIO, buses[bus].spi_sm, (uint32_t)data << 24);
+        return pio_sm_get_blocking(SPI_PIO, buses[bus].spi_sm) & 0xFF;
+    }
+}
+
+void block_io_port_start_transfer(size_t bus, const uint8_t *write_buffer, uint8_t *read_buffer, size_t length, void (*on_complete)(size_t bus))
+{
+    uint tx_dma_channel = buses[bus].tx_dma_channel;
+    uint rx_dma_channel = buses[bus].rx_dma_channel;
+    buses[bus].on_complete = on_complete;
+
+    dma_channel_set_read_addr(tx_dma_channel, write_buffer, false);
+    dma_channel_set_trans_count(tx_dma_channel, length, false);
+    dma_channel_set_write_addr(rx_dma_channel, read_buffer, false);
+    dma_channel_set_trans_count(rx_dma_channel, length, false);
+    dma_start_channel_mask((1u << tx_dma_channel) | (1u << rx_dma_channel));
+}
+
+void block_io_port_claim_transfer_irq()
+{
+    // DMA_IRQ_0 is kept for block_io: the SD card driver, bt_serial and audio all use DMA_IRQ_1
+    // on core 0. Both cores share the vector table, so the handler is only added once, but the
+    // interrupt is enabled on each core separately:
+    if (!is_irq_handler_added)
+    {
+        irq_add_shared_handler(DMA_IRQ_0, spi_dma_finished_irh, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        is_irq_handler_added = true;
+    }
+    irq_set_enabled(DMA_IRQ_0, true);
+}
+
+void block_io_port_release_transfer_irq()
+{
+    irq_set_enabled(DMA_IRQ_0, false);
+}
+
+uint64_t block_io_port_get_time_us()
+{
+    return time_us_64();
+}
+
+void block_io_port_sleep_until(uint64_t time_us)
+{
+    sleep_until(from_us_since_boot(time_us));
+}
+
+void block_io_port_wait_for_event()
+{
+    __wfe();
+}
+
+uint32_t block_io_port_disable_interrupts()
+{
+    return save_and_disable_interrupts();
+}
+
+void block_io_port_restore_interrupts(uint32_t status)
+{
+    restore_interrupts(status);
+}
+
+void block_io_port_launch_scanner(void (*entry)())
+{
+    multicore_launch_core1(entry);
+}
@@ -0,0 +1,39 @@
+#include "packed_stack.h"
+
+uint32_t packed_stack_get_match_mask(uint32_t word)
+{
+    // The block ID always matters. Bits 2 and 3 of each block (the lower ID bits) move down into
+    // the rotation bits they stand for:
+    return 0xFCFCFCFC | ((word >> 2) & 0x03030303);
+}
+
+bool packed_stack_matches(const uint32_t *stack, const uint32_t *target, size_t word_count)
+{
+    for (size_t i = 0; i < word_count; i++)
+    {
+        if ((stack[i] ^ target[i]) & packed_stack_get_match_mask(stack[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t packed_stack_hash(size_t grid_tile, const uint32_t *stack, size_t word_count)
+{
+    // FNV-1a over the words, starting from the tile so that the same stack on different tiles
+    // hashes differently:
+    uint32_t hash = 2166136261u ^ (uint32_t)grid_tile;
+    for (size_t i = 0; i < word_count; i++)
+    {
+        hash = (hash ^ stack[i]) * 16777619u;
+    }
+
+    // Mix the bits, so that exclusive ors of many stacks don't cancel out:
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+    return hash;
+}
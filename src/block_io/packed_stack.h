@@ -0,0 +1,37 @@
+#ifndef PACKED_STACK_H
+#define PACKED_STACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// block_io keeps each stack of blocks as a run of bytes, bottom first, padded with zero bytes up
+// to a multiple of 4 so that it can be handled a word (4 blocks) at a time. Positions above the top
+// of the stack are always zero.
+
+/**
+ * Returns the number of words in a packed stack for the given height limit.
+ */
+#define PACKED_STACK_WORD_COUNT(height_limit) (((height_limit) + 3) / 4)
+
+/**
+ * Returns the bits to compare in each of the four blocks in 'word' when checking them against a
+ * target. Block IDs and rotations are in the upper 6 and lower 2 bits of each block. The lower 2
+ * bits of the ID say which rotation bits matter, since some blocks look the same when turned.
+ */
+uint32_t packed_stack_get_match_mask(uint32_t word);
+
+/**
+ * Returns whether every block in 'stack' matches 'target', using the mask from
+ * packed_stack_get_match_mask() for the blocks in 'stack'. Empty positions only match empty ones,
+ * so this also checks the stacks have the same height.
+ */
+bool packed_stack_matches(const uint32_t *stack, const uint32_t *target, size_t word_count);
+
+/**
+ * Returns a hash of the stack on 'grid_tile'. The hash of a whole structure is the exclusive or of
+ * the hashes of its stacks, so it can be updated one stack at a time.
+ */
+uint32_t packed_stack_hash(size_t grid_tile, const uint32_t *stack, size_t word_count);
+
+#endif /* PACKED_STACK_H */
@@ -2,24 +2,96 @@
 #include "block_io.h"
 #include "bt_commands.h"
 #include "bt_serial.h"
+#include "scheduler.h"
+#include "hardware/sync.h"
 #include "pico/stdio_usb.h"
 #include "pico/time.h"
 
+// How often to check for bluetooth commands. Received bytes are collected by DMA in the
+// background, so checking is cheap when nothing has arrived:
+#define BT_RX_PERIOD_US 1000
+
+// How often to read ahead from the SD card for the sounds that are playing. Each call reads at most
+// one buffer (16.8 ms of audio) for one sound, so that it only holds up the bluetooth task for one
+// SD card read. With every voice playing, that's about 240 buffers a second, so this leaves room:
+#define AUDIO_PERIOD_US 2000
+
+// How often to scan the blocks (on core 1). Scan quickly while someone is building, and slowly
+// when nothing has changed for a while and there's no app connected to see it. LED animations are
+// refreshed at 50 Hz whatever the scan rate:
+static const block_io_scan_policy_t scan_policy = {
+    .active_period_us = 10000,
+    .active_hold_us = 2000000,
+    .connected_period_us = 50000,
+    .idle_period_us = 200000,
+    .led_refresh_period_us = 20000
+};
+
+// Number of base boards chained together to make the grid. block_io only has room for the number
+// it was built for (see src/block_io/CMakeLists.txt):
+#define BASE_BOARD_COUNT BLOCK_IO_MAX_BOARD_COUNT
+
+// Number of block buses the boards are spread across, so that they're scanned at the same time:
+#define BLOCK_BUS_COUNT 1
+
+static int send_structure_task_id;
+
+static void bt_rx_task()
+{
+    bt_commands_update_rx();
+    bt_commands_update_tx();
+}
+
+static void audio_task()
+{
+    audio_update();
+}
+
+// Called on core 1 after every scan:
+static void on_scan()
+{
+    // Report the new scan straight away, waking up core 0 if it's asleep:
+    scheduler_signal(send_structure_task_id);
+    __sev();
+}
+
+static void send_structure_task()
+{
+    if (block_io_fetch_scan())
+    {
+        bt_commands_send_current_structure();
+    }
+}
+
 int main()
 {
     stdio_usb_init();
 
     audio_init();
+    audio_pin_sound(AUDIO_SOUND_BT_CONNECTED); // played often, so keep them in RAM
+    audio_pin_sound(AUDIO_SOUND_BT_DISCONNECTED);
     block_io_init();
+    block_io_set_grid_size(BASE_BOARD_COUNT * BLOCK_IO_TILES_PER_BOARD, BLOCK_IO_DEFAULT_HEIGHT_LIMIT);
+    block_io_set_bus_count(BLOCK_BUS_COUNT);
     bt_serial_init();
-    
+    bt_commands_init();
+
+    scheduler_init(time_us_64);
+    scheduler_add_task(bt_rx_task, BT_RX_PERIOD_US);
+    scheduler_add_task(audio_task, AUDIO_PERIOD_US);
+    send_structure_task_id = scheduler_add_task(send_structure_task, 0); // only runs after a scan
+
+    // Run the block bus as fast as this board allows:
+    block_io_calibrate_spi();
+    block_io_set_scan_policy(&scan_policy);
+    block_io_start_scanner(on_scan);
+
     while (1)
     {
-        bt_commands_update_rx();
-        block_io_update();
-        bt_commands_send_current_structure();
+        uint64_t next_deadline = scheduler_run();
 
-        // Update roughly 20 times per second:
-        sleep_ms(50);
+        // Sleep until the next task is due. Any interrupt (bluetooth, timers, audio) or event
+        // from core 1 wakes us early, in case it has signalled a task:
+        best_effort_wfe_or_timeout(from_us_since_boot(next_deadline));
     }
-}
\ No newline at end of file
+}
@@ -1,59 +1,237 @@
 #include "audio.h"
 #include "block_io.h"
 #include "bt_commands.h"
+#include "bt_parser.h"
 #include "bt_serial.h"
+#include "puzzle_library.h"
+#include "structure_delta.h"
 #include "pico/printf.h"
 #include "pico/time.h"
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
-#define BT_COMMAND_NONE 0x00
+// Commands sent to the app. Commands received from the app are defined in bt_parser.h.
 #define BT_COMMAND_CURRENT_STRUCTURE 0x10
-#define BT_COMMAND_TARGET_STRUCTURE 0x10
-#define BT_COMMAND_SET_LEDS 0x20
-#define BT_COMMAND_PLAY_AUDIO 0x30
-#define BT_COMMAND_USER_SIGNAL_COMPLETION 0x40
 #define BT_COMMAND_CONFIRM_COMPLETION 0x50
+#define BT_COMMAND_PUZZLE_LOADED 0x80 // plus 1 if the puzzle was loaded
+#define BT_COMMAND_GRID_SIZE 0x90
 
-static uint8_t current_command = BT_COMMAND_NONE;
-static size_t blocks_remaining = 0;
+// The LEDs flash green or red to show whether the structure is complete, 8 times:
+#define COMPLETION_FLASH_PERIOD_MS 400
+#define COMPLETION_FLASH_DURATION_MS 3200
 
-static repeating_timer_t led_timer;
-static bool led_on;
-static uint8_t led_timer_count;
-static bool is_structure_correct;
+// Full structure messages aren't acknowledged, so an unchanged structure is still sent this often
+// in case the last one was lost:
+#define FULL_STRUCTURE_REFRESH_MS 1000
+
+// Replies to the app's commands are only a few bytes each:
+#define REPLY_BUFFER_SIZE 16
 
 static bool device_connected_previous = false;
 
-static bool led_timer_callback(repeating_timer_t *rt)
+// Once the app acknowledges a structure message, it is sent deltas instead of full structures. Apps
+// that support them are sent compact snapshots instead of full structures and keyframes, which is
+// kept in structure_delta.is_compact:
+static bool is_delta_mode = false;
+static structure_delta_t structure_delta;
+static structure_snapshot_t structure;
+static uint8_t structure_message[STRUCTURE_DELTA_MAX_MESSAGE_SIZE];
+
+// Structure messages for big grids don't fit in the transmit buffer, so they are fed into it a bit
+// at a time as it empties, rather than waiting for the whole message to be sent:
+static size_t structure_message_length = 0;
+static size_t structure_message_sent = 0;
+
+// Replies can't be sent in the middle of a structure message, so they wait here until it's done:
+static uint8_t reply_message[REPLY_BUFFER_SIZE];
+static size_t reply_length = 0;
+
+// Hash of the structure that the app has (or will have once it acknowledges), so that an unchanged
+// structure isn't copied and encoded again after every scan:
+static bool is_sent_hash_valid = false;
+static uint32_t sent_hash;
+static uint32_t sent_ms;
+
+// Writes as much of the waiting structure message and replies as fits in the transmit buffer,
+// without waiting. Returns whether everything has been written:
+static bool write_pending_messages()
 {
-    // Flash LEDs:
-    led_on = !led_on;
-    if (led_on)
+    size_t remaining = structure_message_length - structure_message_sent;
+    size_t free = bt_serial_tx_free();
+    size_t length = (remaining < free) ? remaining : free;
+    if (length > 0)
+    {
+        bt_serial_write_multiple(&structure_message[structure_message_sent], length);
+        structure_message_sent += length;
+    }
+    if (structure_message_sent < structure_message_length)
     {
-        // Flash red or green depending on completion:
-        if (is_structure_correct)
+        return false;
+    }
+
+    if (reply_length > 0)
+    {
+        if (bt_serial_tx_free() < reply_length)
         {
-            block_io_set_led_mode(GREEN);
+            return false;
         }
-        else
-        {
+        bt_serial_write_multiple(reply_message, reply_length);
+        reply_length = 0;
+    }
+    return true;
+}
+
+static void send_reply(uint8_t *message, size_t length)
+{
+    if (reply_length + length > REPLY_BUFFER_SIZE)
+    {
+        printf("bt_commands: reply dropped, too many waiting\n");
+        return;
+    }
+    memcpy(&reply_message[reply_length], message, length);
+    reply_length += length;
+    write_pending_messages();
+}
+
+static void handle_set_leds(uint8_t led_mode)
+{
+    printf("bt_commands: commmand received: set LEDs - ");
+    switch (led_mode)
+    {
+        case 0:
+            printf("off\n");
+            block_io_set_led_mode(OFF);
+            break;
+        case 1:
+            printf("red\n");
             block_io_set_led_mode(RED);
-        }
+            break;
+        case 2:
+            printf("green\n");
+            block_io_set_led_mode(GREEN);
+            break;
+        case 3:
+            printf("target\n");
+            block_io_set_led_mode(TARGET);
+            break;
+    }
+}
+
+static void handle_play_audio(uint8_t audio_number)
+{
+    printf("bt_commands: commmand received: play audio %u\n", audio_number);
+    audio_play_sound(audio_number);
+}
+
+static void handle_signal_completion()
+{
+    printf("bt_commands: commmand received: signal completion\n");
+    bool is_structure_correct = block_io_is_complete();
+
+    // Flash the LEDs. This replaces any flashing that's still going on:
+    block_io_set_led_animation(is_structure_correct ? GREEN : RED, LED_ANIMATION_FLASH,
+        COMPLETION_FLASH_PERIOD_MS, COMPLETION_FLASH_DURATION_MS);
+
+    // Send response saying whether the structure is complete:
+    uint8_t message = BT_COMMAND_CONFIRM_COMPLETION | is_structure_correct;
+    send_reply(&message, 1);
+}
+
+static void handle_structure_ack(uint8_t sequence)
+{
+    printf("bt_commands: commmand received: structure acknowledged %u\n", sequence);
+
+    if (!is_delta_mode)
+    {
+        is_delta_mode = true;
+        structure_delta_reset(&structure_delta);
+        is_sent_hash_valid = false;
     }
     else
     {
-        block_io_set_led_mode(OFF);
+        structure_delta_acknowledge(&structure_delta, sequence);
     }
+}
+
+static void handle_get_grid_size()
+{
+    printf("bt_commands: commmand received: get grid size\n");
+
+    // Reply with the number of tiles (2 bytes, most significant first) and the height limit:
+    size_t tile_count = block_io_get_tile_count();
+    uint8_t message[4] = { BT_COMMAND_GRID_SIZE, tile_count >> 8, tile_count & 0xFF, block_io_get_height_limit() };
+    send_reply(message, sizeof(message));
+}
+
+static void handle_load_puzzle(uint16_t puzzle_id)
+{
+    printf("bt_commands: commmand received: load puzzle %u\n", puzzle_id);
+
+    // Reply saying whether it worked. If not, the old target is still in use:
+    bool is_loaded = puzzle_library_load(puzzle_id);
+    uint8_t message = BT_COMMAND_PUZZLE_LOADED | is_loaded;
+    send_reply(&message, 1);
+}
 
-    // After 8 flashes, stop:
-    if (led_timer_count++ == 15)
+static void handle_set_features(uint8_t features)
+{
+    printf("bt_commands: commmand received: set features 0x%x\n", features);
+
+    // Send the structure again straight away, in case the app needs it in the new format:
+    structure_delta.is_compact = features & BT_FEATURE_COMPACT_STRUCTURE;
+    is_sent_hash_valid = false;
+}
+
+static void handle_target_begin(size_t block_count)
+{
+    printf("bt_commands: commmand received: target structure with %u blocks\n", block_count);
+
+    // The new structure is staged while it arrives, so the old one is still used until it's all
+    // here:
+    block_io_clear_target_structure();
+}
+
+static void handle_target_block(uint8_t grid_tile, uint8_t height, uint8_t block_data)
+{
+    printf("bt_commands:   block[%u][%u] = 0x%02x\n", grid_tile, height, block_data);
+    block_io_set_target_block(grid_tile, height, block_data);
+}
+
+static void handle_target_end(bool is_valid)
+{
+    if (is_valid)
+    {
+        block_io_commit_target_structure();
+    }
+    else
     {
-        block_io_set_led_mode(TARGET);
-        cancel_repeating_timer(&led_timer);
+        // Keep the old target:
+        printf("bt_commands: target structure checksum failed\n");
+        block_io_revert_target_structure();
     }
 }
 
+static const bt_parser_handlers_t parser_handlers = {
+    .set_leds = handle_set_leds,
+    .play_audio = handle_play_audio,
+    .signal_completion = handle_signal_completion,
+    .structure_ack = handle_structure_ack,
+    .get_grid_size = handle_get_grid_size,
+    .load_puzzle = handle_load_puzzle,
+    .set_features = handle_set_features,
+    .target_begin = handle_target_begin,
+    .target_block = handle_target_block,
+    .target_end = handle_target_end,
+};
+
+static bt_parser_t parser;
+
+void bt_commands_init()
+{
+    bt_parser_init(&parser, &parser_handlers);
+}
+
 void bt_commands_update_rx()
 {
     // Play sound on bluetooth connect/disconnect:
@@ -67,161 +245,120 @@ void bt_commands_update_rx()
     {
         printf("bt_commands: device disconnected\n");
         audio_play_sound(AUDIO_SOUND_BT_DISCONNECTED);
+
+        // The next app might not support deltas or compact snapshots:
+        is_delta_mode = false;
+        structure_delta.is_compact = false;
+        structure_delta_reset(&structure_delta);
+        is_sent_hash_valid = false;
+
+        // Nobody is listening to the rest of the message:
+        structure_message_length = 0;
+        structure_message_sent = 0;
+        reply_length = 0;
     }
     device_connected_previous = device_connected;
+    block_io_set_host_connected(device_connected);
 
-    // Read next command:
-    if (current_command == BT_COMMAND_NONE)
+    // Handle every byte that has arrived, straight from the receive buffer. Commands that
+    // haven't fully arrived yet are finished off on a later call:
+    const uint8_t *data;
+    size_t length;
+    while ((length = bt_serial_peek_span(&data)) > 0)
     {
-        if (bt_serial_available())
-        {
-            current_command = bt_serial_read();
-            printf("bt_commands: commmand received: ");
-        }
+        bt_parser_feed(&parser, data, length);
+        bt_serial_consume(length);
     }
+}
 
-    // Handle command: 
-    switch (current_command & 0xF0)
-    {
-        case BT_COMMAND_SET_LEDS:
-            printf("set LEDs - ");
-            uint8_t led_mode = current_command & 0x03;
-            switch (led_mode)
-            {
-                case 0:
-                    printf("off\n");
-                    block_io_set_led_mode(OFF);
-                    break;
-                case 1:
-                    printf("red\n");
-                    block_io_set_led_mode(RED);
-                    break;
-                case 2:
-                    printf("green\n");
-                    block_io_set_led_mode(GREEN);
-                    break;
-                case 3:
-                    printf("target\n");
-                    block_io_set_led_mode(TARGET);
-                    break;
-            }
-
-            current_command = BT_COMMAND_NONE;
-            break;
-        case BT_COMMAND_PLAY_AUDIO:
-            uint8_t audio_number = current_command & 0x0F;
-            printf("play audio %u\n", audio_number);
-            audio_play_sound(audio_number);
-
-            current_command = BT_COMMAND_NONE;
-            break;
-        case BT_COMMAND_USER_SIGNAL_COMPLETION:
-            printf("signal completion\n");
-            // Set up timer to flash LEDs:
-            led_timer_count = 0;
-            led_on = false;
-            cancel_repeating_timer(&led_timer); // cancel any ongoing timer
-            add_repeating_timer_ms(-200, led_timer_callback, NULL, &led_timer);
-
-            // Send response saying whether the structure is complete:
-            is_structure_correct = block_io_is_complete();
-            bt_serial_write(BT_COMMAND_CONFIRM_COMPLETION | is_structure_correct);
-
-            current_command = BT_COMMAND_NONE;
-            break;
-        case BT_COMMAND_TARGET_STRUCTURE:
-            // If this is the first byte after the command:
-            if (blocks_remaining == 0)
-            {
-                if (bt_serial_available())
-                {
-                    // Next byte after the command is the number of blocks in
-                    // the target structure:
-                    blocks_remaining = bt_serial_read();
-
-                    printf("target structure with %u blocks\n", blocks_remaining);
-
-                    // Clear target structure to prepare for writing new structure:
-                    block_io_clear_target_structure();
-                }
-            }
-
-            // Handle the remaining bytes:
-            if (blocks_remaining > 0)
-            {
-                // Each block takes up two bytes - wait for both to arrive:
-                if (bt_serial_available() >= 2)
-                {
-                    // First byte contains positional data:
-                    uint8_t position = bt_serial_read();
-                    uint8_t grid_tile = (position >> 4) & 0x0F;
-                    uint8_t height = position & 0x0F;
-
-                    // Second byte contains the block data:
-                    uint8_t block_data = bt_serial_read();
-
-                    printf("bt_commands:   block[%u][%u] = 0x%02x\n", grid_tile, height, block_data);
-
-                    block_io_set_target_block(grid_tile, height, block_data);
-                    blocks_remaining--;
-                }
-            }
-
-            // Once all blocks have been read, the command is finished:
-            if (blocks_remaining == 0)
-            {
-                current_command = BT_COMMAND_NONE;
-            }
+void bt_commands_update_tx()
+{
+    write_pending_messages();
 
-            break;
-        default:
-            // Unrecognised command
-            current_command = BT_COMMAND_NONE;
-            break;
+    // The app can only acknowledge a structure message once all of it has arrived, so only start
+    // waiting for the acknowledgement once the last byte has left the transmit buffer:
+    if (is_delta_mode && structure_message_sent == structure_message_length
+        && bt_serial_tx_free() == BT_SERIAL_TX_BUFFER_SIZE)
+    {
+        structure_delta_mark_sent(&structure_delta, to_ms_since_boot(get_absolute_time()));
     }
 }
 
 void bt_commands_send_current_structure()
 {
-    if (!bt_serial_is_connected() || block_io_is_corrupted())
+    // Stacks that couldn't be read keep their last good data, so the structure can always be sent:
+    if (!bt_serial_is_connected())
     {
         return;
     }
 
-    size_t total_blocks = 0;
-    for (size_t grid_tile = 0; grid_tile < BLOCK_IO_TILE_COUNT; grid_tile++)
+    // Skip a structure that the app already has. A delta that hasn't been acknowledged yet may
+    // still need resending though:
+    uint32_t hash = block_io_get_structure_hash();
+    uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    if (is_sent_hash_valid && hash == sent_hash)
     {
-        size_t stack_height = block_io_get_stack_height(grid_tile);
-        if (stack_height > 16)
+        if (is_delta_mode ? !structure_delta.is_pending : now_ms - sent_ms < FULL_STRUCTURE_REFRESH_MS)
         {
-            // Stack too high to send over bluetooth
-            printf("bt_commands: structure is too tall to send over bluetooth.");
             return;
         }
-        total_blocks += stack_height;
     }
 
-    if (total_blocks > 255)
+    // If the last structure is still being sent, don't queue up another one behind it. The
+    // next call will send the latest structure instead. Messages for big grids may not fit in the
+    // buffer at all, so for those just wait for it to empty, then send them a bit at a time:
+    if (!write_pending_messages())
+    {
+        return;
+    }
+
+    size_t tile_count = block_io_get_tile_count();
+    size_t height_limit = block_io_get_height_limit();
+    size_t max_length = structure_delta_get_max_message_size(tile_count, height_limit);
+    if (bt_serial_tx_free() < max_length && bt_serial_tx_free() < BT_SERIAL_TX_BUFFER_SIZE)
     {
-        // Too many blocks to send over bluetooth
-        printf("bt_commands: structure has too many blocks to send over bluetooth.");
         return;
     }
 
-    printf("bt_commands: sending structure containing %u blocks\n", total_blocks);
-    // Send structure over bluetooth:
-    bt_serial_write(BT_COMMAND_CURRENT_STRUCTURE);
-    bt_serial_write(total_blocks);
-    for (size_t grid_tile = 0; grid_tile < BLOCK_IO_TILE_COUNT; grid_tile++)
+    // Take a copy of the structure, with every position above the stacks set to zero:
+    structure_delta_clear_snapshot(&structure, tile_count, height_limit);
+    for (size_t grid_tile = 0; grid_tile < tile_count; grid_tile++)
     {
         size_t stack_height = block_io_get_stack_height(grid_tile);
+        structure.stack_height[grid_tile] = stack_height;
         for (size_t y = 0; y < stack_height; y++)
         {
-            uint8_t location_data = (grid_tile << 4) | (y & 0x0F);
-            uint8_t block_data = block_io_get_block(grid_tile, y);
-            printf("bt_commands:   block[%u][%u] = 0x%02x\n", grid_tile, y, block_data);
-            bt_serial_write(location_data);
-            bt_serial_write(block_data);
+            structure.blocks[grid_tile * height_limit + y] = block_io_get_block(grid_tile, y);
         }
     }
+
+    size_t length;
+    if (is_delta_mode)
+    {
+        length = structure_delta_encode(&structure_delta, &structure, now_ms, structure_message);
+    }
+    else if (structure_delta.is_compact)
+    {
+        length = structure_delta_encode_compact(&structure, 0, structure_message);
+    }
+    else
+    {
+        length = structure_delta_encode_full(&structure, structure_message);
+    }
+
+    if (length > 0)
+    {
+        printf("bt_commands: sending structure message 0x%02x (%u bytes)\n", structure_message[0], length);
+        structure_message_length = length;
+        structure_message_sent = 0;
+        write_pending_messages();
+    }
+
+    // With nothing waiting for an acknowledgement, the app has (or will have) this structure:
+    if (length > 0 || !structure_delta.is_pending)
+    {
+        is_sent_hash_valid = true;
+        sent_hash = hash;
+        sent_ms = now_ms;
+    }
 }
\ No newline at end of file
@@ -2,12 +2,24 @@
 #define BT_COMMANDS_H
 
 /**
- * Handles any incoming bluetooth commands.
+ * Initialises the bluetooth command handler. Call after bt_serial_init().
+ */
+void bt_commands_init();
+
+/**
+ * Handles all incoming bluetooth commands that have arrived so far.
  */
 void bt_commands_update_rx();
 
 /**
- * Sends the current block structure over bluetooth.
+ * Sends as much of any waiting outgoing message as fits in the bluetooth transmit buffer, without
+ * waiting. Call regularly.
+ */
+void bt_commands_update_tx();
+
+/**
+ * Sends the current block structure over bluetooth. Big messages are only started here, and
+ * bt_commands_update_tx() sends the rest as the transmit buffer empties.
  */
 void bt_commands_send_current_structure();
 
@@ -0,0 +1,184 @@
+#include "bt_parser.h"
+
+typedef enum
+{
+    STATE_COMMAND,         // waiting for a command byte
+    STATE_ACK_SEQUENCE,    // waiting for the sequence number of a structure acknowledgement
+    STATE_PUZZLE_ID_HIGH,  // waiting for the upper byte of a puzzle ID
+    STATE_PUZZLE_ID,       // waiting for the lower byte of a puzzle ID
+    STATE_TARGET_COUNT_HIGH, // waiting for the upper byte of a wide target structure's block count
+    STATE_TARGET_COUNT,    // waiting for the number of blocks in a target structure
+    STATE_TARGET_TILE,     // waiting for the tile byte of a wide target block
+    STATE_TARGET_POSITION, // waiting for the position byte (or height byte, if wide) of a target block
+    STATE_TARGET_BLOCK,    // waiting for the block data byte of a target block
+    STATE_TARGET_CHECKSUM_HIGH, // waiting for the upper byte of a target structure's checksum
+    STATE_TARGET_CHECKSUM  // waiting for the lower byte of a target structure's checksum
+} parser_state_t;
+
+static void add_to_checksum(bt_parser_t *parser, uint8_t byte)
+{
+    parser->checksum_sum1 = (parser->checksum_sum1 + byte) % 255;
+    parser->checksum_sum2 = (parser->checksum_sum2 + parser->checksum_sum1) % 255;
+}
+
+// Called once the last block of a target structure has been received:
+static void finish_target(bt_parser_t *parser)
+{
+    if (parser->has_checksum)
+    {
+        parser->state = STATE_TARGET_CHECKSUM_HIGH;
+    }
+    else
+    {
+        parser->handlers->target_end(true);
+        parser->state = STATE_COMMAND;
+    }
+}
+
+static void handle_command(bt_parser_t *parser, uint8_t command)
+{
+    parser->command = command;
+
+    switch (command & 0xF0)
+    {
+        case BT_COMMAND_SET_LEDS:
+            parser->handlers->set_leds(command & 0x03);
+            break;
+        case BT_COMMAND_PLAY_AUDIO:
+            parser->handlers->play_audio(command & 0x0F);
+            break;
+        case BT_COMMAND_USER_SIGNAL_COMPLETION:
+            parser->handlers->signal_completion();
+            break;
+        case BT_COMMAND_STRUCTURE_ACK:
+            parser->state = STATE_ACK_SEQUENCE;
+            break;
+        case BT_COMMAND_TARGET_STRUCTURE:
+            parser->is_wide = command & BT_COMMAND_WIDE;
+            parser->has_checksum = command & BT_COMMAND_CHECKSUM;
+            parser->blocks_remaining = 0;
+            parser->checksum_sum1 = 0;
+            parser->checksum_sum2 = 0;
+            add_to_checksum(parser, command);
+            parser->state = parser->is_wide ? STATE_TARGET_COUNT_HIGH : STATE_TARGET_COUNT;
+            break;
+        case BT_COMMAND_GET_GRID_SIZE:
+            parser->handlers->get_grid_size();
+            break;
+        case BT_COMMAND_LOAD_PUZZLE:
+            parser->state = STATE_PUZZLE_ID_HIGH;
+            break;
+        case BT_COMMAND_SET_FEATURES:
+            parser->handlers->set_features(command & 0x0F);
+            break;
+        default:
+            // Unrecognised command
+            break;
+    }
+}
+
+void bt_parser_feed(bt_parser_t *parser, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t byte = data[i];
+
+        // Every byte of a target structure after the command byte is added to the checksum, up to the
+        // checksum itself (the states for these bytes are listed together above):
+        if (parser->state >= STATE_TARGET_COUNT_HIGH && parser->state <= STATE_TARGET_BLOCK)
+        {
+            add_to_checksum(parser, byte);
+        }
+
+        switch (parser->state)
+        {
+            case STATE_COMMAND:
+                handle_command(parser, byte);
+                break;
+            case STATE_ACK_SEQUENCE:
+                parser->handlers->structure_ack(byte);
+                parser->state = STATE_COMMAND;
+                break;
+            case STATE_PUZZLE_ID_HIGH:
+                parser->puzzle_id = byte << 8;
+                parser->state = STATE_PUZZLE_ID;
+                break;
+            case STATE_PUZZLE_ID:
+                parser->handlers->load_puzzle(parser->puzzle_id | byte);
+                parser->state = STATE_COMMAND;
+                break;
+            case STATE_TARGET_COUNT_HIGH:
+                parser->blocks_remaining = byte << 8;
+                parser->state = STATE_TARGET_COUNT;
+                break;
+            case STATE_TARGET_COUNT:
+                // Byte after the command is the number of blocks in the target structure:
+                parser->blocks_remaining |= byte;
+                parser->handlers->target_begin(parser->blocks_remaining);
+
+                if (parser->blocks_remaining > 0)
+                {
+                    parser->state = parser->is_wide ? STATE_TARGET_TILE : STATE_TARGET_POSITION;
+                }
+                else
+                {
+                    finish_target(parser);
+                }
+                break;
+            case STATE_TARGET_TILE:
+                parser->grid_tile = byte;
+                parser->state = STATE_TARGET_POSITION;
+                break;
+            case STATE_TARGET_POSITION:
+                // First byte of each block contains positional data:
+                parser->position = byte;
+                parser->state = STATE_TARGET_BLOCK;
+                break;
+            case STATE_TARGET_BLOCK:
+                // Second byte contains the block data:
+                if (parser->is_wide)
+                {
+                    parser->handlers->target_block(parser->grid_tile, parser->position, byte);
+                }
+                else
+                {
+                    parser->handlers->target_block((parser->position >> 4) & 0x0F, parser->position & 0x0F, byte);
+                }
+
+                if (--parser->blocks_remaining > 0)
+                {
+                    parser->state = parser->is_wide ? STATE_TARGET_TILE : STATE_TARGET_POSITION;
+                }
+                else
+                {
+                    finish_target(parser);
+                }
+                break;
+            case STATE_TARGET_CHECKSUM_HIGH:
+                parser->received_checksum = byte << 8;
+                parser->state = STATE_TARGET_CHECKSUM;
+                break;
+            case STATE_TARGET_CHECKSUM:
+                parser->received_checksum |= byte;
+                parser->handlers->target_end(parser->received_checksum == ((parser->checksum_sum2 << 8) | parser->checksum_sum1));
+                parser->state = STATE_COMMAND;
+                break;
+        }
+    }
+}
+
+void bt_parser_init(bt_parser_t *parser, const bt_parser_handlers_t *handlers)
+{
+    parser->handlers = handlers;
+    parser->state = STATE_COMMAND;
+    parser->command = BT_COMMAND_NONE;
+    parser->is_wide = false;
+    parser->has_checksum = false;
+    parser->checksum_sum1 = 0;
+    parser->checksum_sum2 = 0;
+    parser->received_checksum = 0;
+    parser->puzzle_id = 0;
+    parser->grid_tile = 0;
+    parser->position = 0;
+    parser->blocks_remaining = 0;
+}
@@ -0,0 +1,84 @@
+#ifndef BT_PARSER_H
+#define BT_PARSER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Commands received from the app. The upper 4 bits are the command and the lower 4 bits may
+// hold a parameter:
+#define BT_COMMAND_NONE 0x00
+#define BT_COMMAND_TARGET_STRUCTURE 0x10
+#define BT_COMMAND_SET_LEDS 0x20
+#define BT_COMMAND_PLAY_AUDIO 0x30
+#define BT_COMMAND_USER_SIGNAL_COMPLETION 0x40
+#define BT_COMMAND_STRUCTURE_ACK 0x60
+#define BT_COMMAND_LOAD_PUZZLE 0x80 // followed by a two byte puzzle ID, most significant first
+#define BT_COMMAND_GET_GRID_SIZE 0x90
+#define BT_COMMAND_SET_FEATURES 0xA0 // the lower 4 bits are the BT_FEATURE_ flags the app supports
+
+// Added to BT_COMMAND_TARGET_STRUCTURE for grids too big for one byte positions. The block count is
+// then two bytes (most significant first), and each block's position is two bytes (tile, then
+// height) instead of one:
+#define BT_COMMAND_WIDE 0x01
+
+// Added to BT_COMMAND_TARGET_STRUCTURE to follow the last block with a Fletcher-16 checksum of the
+// whole command, from the command byte to the last block byte. It's two bytes, most significant
+// first: the sum of the sums, then the sum of the bytes, both modulo 255:
+#define BT_COMMAND_CHECKSUM 0x02
+
+// Features that the app can turn on with BT_COMMAND_SET_FEATURES. All of them are off after
+// connecting, so older apps that never send it keep getting the messages they know:
+#define BT_FEATURE_COMPACT_STRUCTURE 0x01 // send compact snapshots instead of full structures
+
+/**
+ * Functions called by the parser as it decodes each command. The blocks of a target structure are
+ * passed on as they arrive, between target_begin() and target_end(). 'is_valid' is false if the
+ * checksum didn't match, in which case the blocks should be thrown away.
+ */
+typedef struct
+{
+    void (*set_leds)(uint8_t led_mode);
+    void (*play_audio)(uint8_t audio_number);
+    void (*signal_completion)();
+    void (*structure_ack)(uint8_t sequence);
+    void (*get_grid_size)();
+    void (*load_puzzle)(uint16_t puzzle_id);
+    void (*set_features)(uint8_t features);
+    void (*target_begin)(size_t block_count);
+    void (*target_block)(uint8_t grid_tile, uint8_t height, uint8_t block_data);
+    void (*target_end)(bool is_valid);
+} bt_parser_handlers_t;
+
+/**
+ * State of the parser between calls to bt_parser_feed(). A command can be split across any
+ * number of calls.
+ */
+typedef struct
+{
+    const bt_parser_handlers_t *handlers;
+    uint8_t state;
+    uint8_t command;
+    bool is_wide;
+    bool has_checksum;
+    uint16_t checksum_sum1;
+    uint16_t checksum_sum2;
+    uint16_t received_checksum;
+    uint16_t puzzle_id;
+    uint8_t grid_tile;
+    uint8_t position;
+    size_t blocks_remaining;
+} bt_parser_t;
+
+/**
+ * Decodes the given bytes, calling the handlers for every command (or part of a target structure)
+ * that is complete. Bytes belonging to an unfinished command are remembered until the next call.
+ */
+void bt_parser_feed(bt_parser_t *parser, const uint8_t *data, size_t length);
+
+/**
+ * Initialises a parser, ready for the start of a command.
+ */
+void bt_parser_init(bt_parser_t *parser, const bt_parser_handlers_t *handlers);
+
+#endif /* BT_PARSER_H */
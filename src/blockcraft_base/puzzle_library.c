@@ -0,0 +1,97 @@
+#include "puzzle_library.h"
+#include "block_io.h"
+#include <string.h>
+
+// The blocks of a puzzle are read this many bytes at a time:
+#define BLOCK_CHUNK_SIZE 64
+
+static uint16_t get_uint16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static uint32_t get_uint32(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+bool puzzle_library_load_from(puzzle_library_read_t read, void *context, uint16_t puzzle_id)
+{
+    // Find the puzzle in the index:
+    uint8_t header[PUZZLE_LIBRARY_HEADER_SIZE];
+    if (!read(context, 0, header, sizeof(header)) || memcmp(header, "BCPL", 4) != 0
+        || header[4] != PUZZLE_LIBRARY_VERSION || puzzle_id >= get_uint16(&header[6]))
+    {
+        return false;
+    }
+
+    uint8_t index_entry[PUZZLE_LIBRARY_INDEX_ENTRY_SIZE];
+    uint32_t index_offset = PUZZLE_LIBRARY_HEADER_SIZE + (uint32_t)puzzle_id * PUZZLE_LIBRARY_INDEX_ENTRY_SIZE;
+    if (!read(context, index_offset, index_entry, sizeof(index_entry)))
+    {
+        return false;
+    }
+    uint32_t offset = get_uint32(&index_entry[0]);
+    uint32_t size = get_uint32(&index_entry[4]);
+
+    // Check that the puzzle fits the grid before touching the target structure:
+    uint8_t tile_count_data[2];
+    if (!read(context, offset, tile_count_data, sizeof(tile_count_data)))
+    {
+        return false;
+    }
+    size_t tile_count = get_uint16(tile_count_data);
+
+    uint8_t heights[BLOCK_IO_MAX_TILE_COUNT];
+    if (tile_count > block_io_get_tile_count() || !read(context, offset + 2, heights, tile_count))
+    {
+        return false;
+    }
+
+    size_t block_count = 0;
+    for (size_t grid_tile = 0; grid_tile < tile_count; grid_tile++)
+    {
+        if (heights[grid_tile] > block_io_get_height_limit())
+        {
+            return false;
+        }
+        block_count += heights[grid_tile];
+    }
+    if (size != 2 + tile_count + block_count)
+    {
+        return false;
+    }
+
+    // Load the new target straight into block_io, rather than a command per block which would
+    // keep waiting for the scanner. It's only staged and swapped in once every block has been read:
+    block_io_start_target_load();
+
+    uint32_t block_offset = offset + 2 + tile_count;
+    uint8_t chunk[BLOCK_CHUNK_SIZE];
+    size_t chunk_length = 0;
+    size_t chunk_index = 0;
+
+    for (size_t grid_tile = 0; grid_tile < tile_count; grid_tile++)
+    {
+        for (size_t height = 0; height < heights[grid_tile]; height++)
+        {
+            if (chunk_index == chunk_length)
+            {
+                chunk_length = block_count < BLOCK_CHUNK_SIZE ? block_count : BLOCK_CHUNK_SIZE;
+                if (!read(context, block_offset, chunk, chunk_length))
+                {
+                    return false;
+                }
+                block_offset += chunk_length;
+                block_count -= chunk_length;
+                chunk_index = 0;
+            }
+
+            block_io_load_target_block(grid_tile, height, chunk[chunk_index++]);
+        }
+    }
+
+    block_io_finish_target_load();
+    block_io_commit_target_structure();
+    return true;
+}
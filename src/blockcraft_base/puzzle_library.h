@@ -0,0 +1,48 @@
+#ifndef PUZZLE_LIBRARY_H
+#define PUZZLE_LIBRARY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// A library of target structures ("puzzles") in a single file on the SD card, so that the app can
+// switch targets by ID instead of sending every block. All numbers are little endian. The file
+// starts with a header:
+//   char magic[4]            "BCPL"
+//   uint8_t version          PUZZLE_LIBRARY_VERSION
+//   uint8_t reserved         0
+//   uint16_t puzzle_count
+// followed by an index entry for each puzzle, in ID order:
+//   uint32_t offset          from the start of the file to the puzzle
+//   uint32_t size            of the puzzle, in bytes
+// Each puzzle is:
+//   uint16_t tile_count      tiles in the grid it was made for
+//   uint8_t height[tile_count]
+//   uint8_t blocks[]         each stack's blocks in turn, bottom first, as given to
+//                            block_io_load_target_block()
+// Tiles past the end of the puzzle's grid are left empty.
+#define PUZZLE_LIBRARY_FILENAME "puzzles.bin"
+#define PUZZLE_LIBRARY_VERSION 1
+#define PUZZLE_LIBRARY_HEADER_SIZE 8
+#define PUZZLE_LIBRARY_INDEX_ENTRY_SIZE 8
+
+/**
+ * Reads 'length' bytes from 'offset' in a puzzle library into 'buffer'. Returns false if they
+ * couldn't all be read.
+ */
+typedef bool (*puzzle_library_read_t)(void *context, uint32_t offset, void *buffer, size_t length);
+
+/**
+ * Loads puzzle 'puzzle_id' from PUZZLE_LIBRARY_FILENAME on the SD card as the target structure.
+ * Returns false, keeping the current target, if the SD card or the library can't be read, there's
+ * no such puzzle, or it doesn't fit the grid.
+ */
+bool puzzle_library_load(uint16_t puzzle_id);
+
+/**
+ * Loads puzzle 'puzzle_id' as the target structure, like puzzle_library_load(), from a library
+ * read through 'read'.
+ */
+bool puzzle_library_load_from(puzzle_library_read_t read, void *context, uint16_t puzzle_id);
+
+#endif /* PUZZLE_LIBRARY_H */
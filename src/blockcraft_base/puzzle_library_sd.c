@@ -0,0 +1,51 @@
+#include "audio.h"
+#include "ff.h"
+#include "puzzle_library.h"
+#include "pico/printf.h"
+
+// Reads the puzzle library from the SD card, for puzzle_library_load(). The card is shared with
+// audio playback, so it's claimed for each read rather than for the whole load. In between reads,
+// the blocks are loaded into block_io, which doesn't wait for the scanner.
+
+static bool read_file(void *context, uint32_t offset, void *buffer, size_t length)
+{
+    FIL *file = context;
+    UINT bytes_read;
+
+    audio_claim_sd_card();
+    bool is_read = f_lseek(file, offset) == FR_OK
+        && f_read(file, buffer, length, &bytes_read) == FR_OK
+        && bytes_read == length;
+    audio_release_sd_card();
+
+    return is_read;
+}
+
+bool puzzle_library_load(uint16_t puzzle_id)
+{
+    static FIL file;
+
+    if (!audio_claim_sd_card())
+    {
+        printf("puzzle_library: Error: SD card not mounted.\n");
+        return false;
+    }
+    bool is_open = f_open(&file, PUZZLE_LIBRARY_FILENAME, FA_READ) == FR_OK;
+    audio_release_sd_card();
+
+    bool is_loaded = false;
+    if (is_open)
+    {
+        is_loaded = puzzle_library_load_from(read_file, &file, puzzle_id);
+
+        audio_claim_sd_card();
+        f_close(&file);
+        audio_release_sd_card();
+    }
+
+    if (!is_loaded)
+    {
+        printf("puzzle_library: Error: Failed to load puzzle %u from \"%s\".\n", puzzle_id, PUZZLE_LIBRARY_FILENAME);
+    }
+    return is_loaded;
+}
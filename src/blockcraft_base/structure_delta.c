@@ -0,0 +1,318 @@
+#include "structure_delta.h"
+#include <string.h>
+
+// Runs of identical blocks shorter than this cost no more to send as they are than as a run:
+#define MIN_RUN_LENGTH 4
+#define MAX_RUN_LENGTH 0xFF
+
+// Writes one entry (position and block data), returning its length:
+static size_t encode_entry(uint8_t *buffer, bool is_wide, size_t grid_tile, size_t height, uint8_t block_data)
+{
+    if (is_wide)
+    {
+        buffer[0] = grid_tile;
+        buffer[1] = height;
+        buffer[2] = block_data;
+        return 3;
+    }
+    else
+    {
+        buffer[0] = (grid_tile << 4) | (height & 0x0F);
+        buffer[1] = block_data;
+        return 2;
+    }
+}
+
+// Writes the entry count, returning its length:
+static size_t encode_count(uint8_t *buffer, bool is_wide, size_t count)
+{
+    if (is_wide)
+    {
+        buffer[0] = count >> 8;
+        buffer[1] = count & 0xFF;
+        return 2;
+    }
+    else
+    {
+        buffer[0] = count;
+        return 1;
+    }
+}
+
+static bool is_snapshot_wide(const structure_snapshot_t *structure)
+{
+    return structure_delta_is_wide(structure->tile_count, structure->height_limit);
+}
+
+static bool is_same_structure(const structure_snapshot_t *a, const structure_snapshot_t *b)
+{
+    return a->tile_count == b->tile_count
+        && a->height_limit == b->height_limit
+        && memcmp(a->stack_height, b->stack_height, a->tile_count) == 0
+        && memcmp(a->blocks, b->blocks, a->tile_count * a->height_limit) == 0;
+}
+
+// Writes every block in the structure, returning the number of entries:
+static size_t encode_blocks(const structure_snapshot_t *structure, uint8_t *buffer)
+{
+    bool is_wide = is_snapshot_wide(structure);
+    size_t count = 0;
+    for (size_t grid_tile = 0; grid_tile < structure->tile_count; grid_tile++)
+    {
+        const uint8_t *stack = &structure->blocks[grid_tile * structure->height_limit];
+        for (size_t height = 0; height < structure->stack_height[grid_tile]; height++)
+        {
+            buffer += encode_entry(buffer, is_wide, grid_tile, height, stack[height]);
+            count++;
+        }
+    }
+    return count;
+}
+
+// Writes the header of a keyframe or delta message, returning its length:
+static size_t encode_header(structure_delta_t *delta, uint8_t command, bool is_wide, size_t count, uint8_t *buffer)
+{
+    buffer[0] = command | (is_wide ? STRUCTURE_COMMAND_WIDE : 0);
+    buffer[1] = delta->next_sequence;
+    return 2 + encode_count(&buffer[2], is_wide, count);
+}
+
+// Writes a run of identical blocks, returning its length. Nothing is written if 'buffer' is NULL:
+static size_t encode_run(uint8_t *buffer, bool is_run_length, uint8_t block_data, size_t run_length)
+{
+    if (is_run_length && run_length >= MIN_RUN_LENGTH)
+    {
+        if (buffer != NULL)
+        {
+            buffer[0] = STRUCTURE_RUN_MARKER;
+            buffer[1] = run_length;
+            buffer[2] = block_data;
+        }
+        return 3;
+    }
+    if (buffer != NULL)
+    {
+        memset(buffer, block_data, run_length);
+    }
+    return run_length;
+}
+
+// Writes every block in the structure in turn, bottom first, without positions, returning the
+// length. With 'is_run_length', runs of identical blocks are coded as STRUCTURE_RUN_MARKER, count
+// and block. If 'buffer' is NULL, only the length is worked out:
+static size_t encode_compact_blocks(const structure_snapshot_t *structure, bool is_run_length, uint8_t *buffer)
+{
+    size_t length = 0;
+    size_t run_length = 0;
+    uint8_t run_block = 0;
+
+    for (size_t grid_tile = 0; grid_tile < structure->tile_count; grid_tile++)
+    {
+        const uint8_t *stack = &structure->blocks[grid_tile * structure->height_limit];
+        for (size_t height = 0; height < structure->stack_height[grid_tile]; height++)
+        {
+            if (run_length > 0 && (stack[height] != run_block || run_length == MAX_RUN_LENGTH))
+            {
+                length += encode_run(buffer ? &buffer[length] : NULL, is_run_length, run_block, run_length);
+                run_length = 0;
+            }
+            run_block = stack[height];
+            run_length++;
+        }
+    }
+    if (run_length > 0)
+    {
+        length += encode_run(buffer ? &buffer[length] : NULL, is_run_length, run_block, run_length);
+    }
+    return length;
+}
+
+static size_t encode_keyframe(structure_delta_t *delta, const structure_snapshot_t *current, uint8_t *buffer)
+{
+    if (delta->is_compact)
+    {
+        delta->updates_since_keyframe = 0;
+        return structure_delta_encode_compact(current, delta->next_sequence, buffer);
+    }
+
+    bool is_wide = is_snapshot_wide(current);
+    size_t header_length = is_wide ? 4 : 3;
+    size_t count = encode_blocks(current, &buffer[header_length]);
+
+    encode_header(delta, STRUCTURE_COMMAND_KEYFRAME, is_wide, count, buffer);
+
+    delta->updates_since_keyframe = 0;
+
+    return header_length + count * (is_wide ? 3 : 2);
+}
+
+static size_t encode_delta(structure_delta_t *delta, const structure_snapshot_t *current, uint8_t *buffer)
+{
+    const structure_snapshot_t *base = &delta->acked;
+    bool is_wide = is_snapshot_wide(current);
+    size_t header_length = is_wide ? 4 : 3;
+    size_t length = header_length;
+    size_t count = 0;
+
+    for (size_t grid_tile = 0; grid_tile < current->tile_count; grid_tile++)
+    {
+        const uint8_t *current_stack = &current->blocks[grid_tile * current->height_limit];
+        const uint8_t *base_stack = &base->blocks[grid_tile * base->height_limit];
+
+        // Blocks above the top of a stack are zero, so comparing up to the taller of the two
+        // stacks also catches added and removed blocks:
+        size_t max_height = (current->stack_height[grid_tile] > base->stack_height[grid_tile])
+            ? current->stack_height[grid_tile]
+            : base->stack_height[grid_tile];
+
+        for (size_t height = 0; height < max_height; height++)
+        {
+            uint8_t block_data = current_stack[height];
+            if (block_data != base_stack[height])
+            {
+                length += encode_entry(&buffer[length], is_wide, grid_tile, height, block_data);
+                count++;
+            }
+        }
+    }
+
+    encode_header(delta, STRUCTURE_COMMAND_DELTA, is_wide, count, buffer);
+
+    delta->updates_since_keyframe++;
+
+    return length;
+}
+
+void structure_delta_acknowledge(structure_delta_t *delta, uint8_t sequence)
+{
+    if (delta->is_pending && sequence == delta->pending_sequence)
+    {
+        delta->acked = delta->pending;
+        delta->is_acked_valid = true;
+        delta->is_pending = false;
+    }
+}
+
+void structure_delta_clear_snapshot(structure_snapshot_t *snapshot, size_t tile_count, size_t height_limit)
+{
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->tile_count = tile_count;
+    snapshot->height_limit = height_limit;
+}
+
+size_t structure_delta_encode(structure_delta_t *delta, const structure_snapshot_t *current, uint32_t now_ms, uint8_t *buffer)
+{
+    bool send_keyframe;
+
+    if (delta->is_pending)
+    {
+        // Wait for the app to acknowledge the last message. If it takes too long after the message
+        // was sent, assume it got lost and start again from a keyframe, since we don't know what
+        // the app has applied:
+        if (!delta->is_pending_sent || now_ms - delta->pending_sent_ms < STRUCTURE_DELTA_ACK_TIMEOUT_MS)
+        {
+            return 0;
+        }
+        send_keyframe = true;
+    }
+    else if (!delta->is_acked_valid)
+    {
+        send_keyframe = true;
+    }
+    else if (is_same_structure(current, &delta->acked))
+    {
+        // Nothing changed since the app's copy of the structure:
+        return 0;
+    }
+    else if (current->tile_count != delta->acked.tile_count || current->height_limit != delta->acked.height_limit)
+    {
+        // Positions can't be compared between grids of different sizes:
+        send_keyframe = true;
+    }
+    else
+    {
+        send_keyframe = delta->updates_since_keyframe >= STRUCTURE_DELTA_KEYFRAME_INTERVAL;
+    }
+
+    size_t length = send_keyframe
+        ? encode_keyframe(delta, current, buffer)
+        : encode_delta(delta, current, buffer);
+
+    delta->pending = *current;
+    delta->is_pending = true;
+    delta->is_pending_sent = false;
+    delta->pending_sequence = delta->next_sequence++;
+
+    return length;
+}
+
+size_t structure_delta_encode_full(const structure_snapshot_t *current, uint8_t *buffer)
+{
+    bool is_wide = is_snapshot_wide(current);
+    size_t header_length = is_wide ? 3 : 2;
+    size_t count = encode_blocks(current, &buffer[header_length]);
+
+    buffer[0] = STRUCTURE_COMMAND_FULL | (is_wide ? STRUCTURE_COMMAND_WIDE : 0);
+    encode_count(&buffer[1], is_wide, count);
+
+    return header_length + count * (is_wide ? 3 : 2);
+}
+
+size_t structure_delta_encode_compact(const structure_snapshot_t *current, uint8_t sequence, uint8_t *buffer)
+{
+    bool is_wide = current->tile_count > 0xFF;
+    size_t length = 0;
+
+    buffer[length++] = STRUCTURE_COMMAND_COMPACT | (is_wide ? STRUCTURE_COMMAND_WIDE : 0);
+    buffer[length++] = sequence;
+    if (is_wide)
+    {
+        buffer[length++] = current->tile_count >> 8;
+    }
+    buffer[length++] = current->tile_count & 0xFF;
+    memcpy(&buffer[length], current->stack_height, current->tile_count);
+    length += current->tile_count;
+
+    // Short runs are sent as they are, so run-length coding is never longer. Only use it when it
+    // saves something, though, so that most messages stay simple for the app to decode:
+    bool is_run_length = encode_compact_blocks(current, true, NULL) < encode_compact_blocks(current, false, NULL);
+    if (is_run_length)
+    {
+        buffer[0] |= STRUCTURE_COMMAND_RUN_LENGTH;
+    }
+    return length + encode_compact_blocks(current, is_run_length, &buffer[length]);
+}
+
+size_t structure_delta_get_max_message_size(size_t tile_count, size_t height_limit)
+{
+    if (structure_delta_is_wide(tile_count, height_limit))
+    {
+        return 4 + 3 * tile_count * height_limit;
+    }
+    else
+    {
+        return 3 + 2 * tile_count * height_limit;
+    }
+}
+
+bool structure_delta_is_wide(size_t tile_count, size_t height_limit)
+{
+    // One byte positions have 4 bits each for the tile and height, and the count must fit in a byte:
+    return tile_count > 16 || height_limit > 16 || tile_count * height_limit > 0xFF;
+}
+
+void structure_delta_mark_sent(structure_delta_t *delta, uint32_t now_ms)
+{
+    if (delta->is_pending && !delta->is_pending_sent)
+    {
+        delta->is_pending_sent = true;
+        delta->pending_sent_ms = now_ms;
+    }
+}
+
+void structure_delta_reset(structure_delta_t *delta)
+{
+    bool is_compact = delta->is_compact;
+    memset(delta, 0, sizeof(*delta));
+    delta->is_compact = is_compact;
+}
@@ -0,0 +1,139 @@
+#ifndef STRUCTURE_DELTA_H
+#define STRUCTURE_DELTA_H
+
+#include "block_io.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define STRUCTURE_COMMAND_FULL 0x10
+#define STRUCTURE_COMMAND_DELTA 0x60
+#define STRUCTURE_COMMAND_KEYFRAME 0x70
+#define STRUCTURE_COMMAND_COMPACT 0xA0
+
+// Added to any of the commands above when the grid is too big for one byte positions (the tile in
+// the upper 4 bits and the height in the lower 4 bits) or a one byte entry count. Positions are
+// then sent as two bytes (tile, then height) and the entry count as two bytes (most significant
+// first). Grids of a single base board never need this, so older apps keep working with them.
+#define STRUCTURE_COMMAND_WIDE 0x01
+
+// A compact snapshot lists the whole structure in about half the bytes of a full structure message,
+// for apps that ask for it. Positions are implied by the order of the blocks:
+//   command byte             STRUCTURE_COMMAND_COMPACT, plus STRUCTURE_COMMAND_WIDE if the tile
+//                            count needs two bytes, plus STRUCTURE_COMMAND_RUN_LENGTH
+//   sequence number          acknowledged like a keyframe's
+//   tile count               one byte, or two if wide (most significant first)
+//   stack height             one byte per tile
+//   blocks                   every stack's blocks in turn, bottom first
+// With STRUCTURE_COMMAND_RUN_LENGTH, a run of identical blocks (which may carry on from one stack
+// into the next) can be sent as STRUCTURE_RUN_MARKER, the number of blocks and then the block.
+// Blocks are never 0x00, since block_io treats a read with a block ID of zero as corrupted, so the
+// marker can't be mistaken for one.
+#define STRUCTURE_COMMAND_RUN_LENGTH 0x02
+#define STRUCTURE_RUN_MARKER 0x00
+
+// Every keyframe or delta message holds a command byte, a sequence number, an entry count and
+// then the position and block data of each entry. This is the biggest possible message, for the
+// biggest grid; use structure_delta_get_max_message_size() for the current one:
+#define STRUCTURE_DELTA_MAX_MESSAGE_SIZE (4 + 3 * BLOCK_IO_MAX_BLOCKS)
+
+// How long to wait for an acknowledgement, once the message has been sent, before giving up and
+// resending a keyframe:
+#define STRUCTURE_DELTA_ACK_TIMEOUT_MS 1000
+
+// Send a keyframe instead of a delta every this many updates:
+#define STRUCTURE_DELTA_KEYFRAME_INTERVAL 16
+
+/**
+ * A copy of a block structure. The block at 'grid_tile' and 'height' is
+ * blocks[grid_tile * height_limit + height]. Positions above the top of each stack must be zero.
+ */
+typedef struct
+{
+    uint16_t tile_count;
+    uint8_t height_limit;
+    uint8_t stack_height[BLOCK_IO_MAX_TILE_COUNT];
+    uint8_t blocks[BLOCK_IO_MAX_BLOCKS];
+} structure_snapshot_t;
+
+/**
+ * State of the delta encoder. Keeps the last structure that the app acknowledged, along with
+ * the one that has been sent but is still waiting for an acknowledgement.
+ */
+typedef struct
+{
+    structure_snapshot_t acked;
+    structure_snapshot_t pending;
+    bool is_acked_valid;
+    bool is_pending;
+    bool is_pending_sent; // whether the pending message has left the transmit buffer yet
+    uint8_t pending_sequence;
+    uint8_t next_sequence;
+    uint32_t pending_sent_ms;
+    size_t updates_since_keyframe;
+    bool is_compact; // send keyframes as compact snapshots. Kept by structure_delta_reset().
+} structure_delta_t;
+
+/**
+ * Acknowledges the message with the given sequence number. If it is the message we're waiting
+ * for, its structure becomes the base for the next delta.
+ */
+void structure_delta_acknowledge(structure_delta_t *delta, uint8_t sequence);
+
+/**
+ * Sets the size of a snapshot's grid and removes all of its blocks.
+ */
+void structure_delta_clear_snapshot(structure_snapshot_t *snapshot, size_t tile_count, size_t height_limit);
+
+/**
+ * Encodes the next message to send for the 'current' structure into 'buffer', which must hold at
+ * least STRUCTURE_DELTA_MAX_MESSAGE_SIZE bytes. Returns the number of bytes to send, which is zero
+ * if nothing changed since the last acknowledged structure or if a previous message is still
+ * waiting for its acknowledgement.
+ *
+ * A delta message lists every position whose block differs from the acknowledged structure. A
+ * block value of 0x00 means the block at that position was removed. A keyframe lists every block
+ * in the structure, like a full structure message, or is a compact snapshot if 'is_compact' is set.
+ *
+ * The acknowledgement timeout only starts once structure_delta_mark_sent() is called.
+ */
+size_t structure_delta_encode(structure_delta_t *delta, const structure_snapshot_t *current, uint32_t now_ms, uint8_t *buffer);
+
+/**
+ * Encodes a full structure message (the original protocol without acknowledgements) into
+ * 'buffer', which must hold at least STRUCTURE_DELTA_MAX_MESSAGE_SIZE bytes. Returns the number
+ * of bytes to send.
+ */
+size_t structure_delta_encode_full(const structure_snapshot_t *current, uint8_t *buffer);
+
+/**
+ * Encodes a compact snapshot of the structure (see STRUCTURE_COMMAND_COMPACT) into 'buffer',
+ * which must hold at least STRUCTURE_DELTA_MAX_MESSAGE_SIZE bytes. Run-length coding is used if it
+ * makes the message shorter. Returns the number of bytes to send.
+ */
+size_t structure_delta_encode_compact(const structure_snapshot_t *current, uint8_t sequence, uint8_t *buffer);
+
+/**
+ * Returns the size of the biggest message that can be encoded for a grid of the given size.
+ */
+size_t structure_delta_get_max_message_size(size_t tile_count, size_t height_limit);
+
+/**
+ * Returns whether messages for a grid of the given size use STRUCTURE_COMMAND_WIDE.
+ */
+bool structure_delta_is_wide(size_t tile_count, size_t height_limit);
+
+/**
+ * Records that the last message from structure_delta_encode() finished sending at 'now_ms', which
+ * starts its acknowledgement timeout. Keyframes for big grids can take several seconds to send,
+ * so the timeout can't start when they are encoded.
+ */
+void structure_delta_mark_sent(structure_delta_t *delta, uint32_t now_ms);
+
+/**
+ * Forgets any acknowledged or pending structure, so that the next message will be a keyframe.
+ * Whether keyframes are compact is kept.
+ */
+void structure_delta_reset(structure_delta_t *delta);
+
+#endif /* STRUCTURE_DELTA_H */
@@ -1,10 +1,15 @@
 #include "bt_serial.h"
 #include "hardware/uart.h"
+#include "hardware/dma.h"
 #include "hardware/irq.h"
 #include "hardware/gpio.h"
-#include "pico/util/queue.h"
+#include "hardware/sync.h"
+#include "pico/platform.h"
+#include <string.h>
 
-#define RX_BUFFER_SIZE 1024
+#define RX_BUFFER_SIZE_BITS 10
+#define RX_BUFFER_SIZE (1 << RX_BUFFER_SIZE_BITS)
+#define RX_DMA_TRANSFER_COUNT 0x80000000 // restarted whenever it runs out
 #define UART_ID        uart1
 #define BAUD_RATE      9600
 #define DATA_BITS      8
@@ -14,27 +19,100 @@
 #define UART_RX_PIN    9
 #define BT_STATUS_PIN  7
 
-static queue_t rx_buffer;
+#define UART_IRQ ((UART_ID == uart0) ? UART0_IRQ : UART1_IRQ)
 
-static void on_uart_rx()
+// Received bytes are written into rx_buffer by DMA, which wraps around at the end of the buffer.
+// rx_write_count and rx_read_count are the total number of bytes written and read so far. The
+// DMA channel only knows how many transfers it has left, so rx_dma_base_count keeps track of the
+// bytes written by all the previous runs of the channel.
+static uint8_t rx_buffer[RX_BUFFER_SIZE] __attribute__((aligned(RX_BUFFER_SIZE)));
+static uint rx_dma_channel;
+static volatile uint32_t rx_dma_base_count = 0;
+static uint32_t rx_read_count = 0;
+static uint32_t rx_overflow_count = 0;
+
+// Bytes waiting to be sent. The program adds bytes at tx_head and the UART interrupt removes them
+// from tx_tail. Both indices count up forever and are wrapped when accessing the buffer, so
+// the buffer is empty when they're equal and full when they're BT_SERIAL_TX_BUFFER_SIZE apart.
+static uint8_t tx_buffer[BT_SERIAL_TX_BUFFER_SIZE];
+static volatile uint32_t tx_head = 0;
+static volatile uint32_t tx_tail = 0;
+
+// Moves bytes from tx_buffer into the UART's TX FIFO until either is exhausted. Leaves the TX
+// interrupt enabled only if there are bytes left over. The interrupt fires when the FIFO drains
+// past its threshold, so it must be full when the interrupt is enabled.
+static void fill_tx_fifo()
 {
-    while (uart_is_readable(UART_ID))
+    uint32_t tail = tx_tail;
+    while (tail != tx_head && uart_is_writable(UART_ID))
     {
-        uint8_t data = uart_getc(UART_ID);
-        bool success = queue_try_add(&rx_buffer, &data);
-        // Currently not implementing overflow detection, so 'success' is not used.
+        uart_putc_raw(UART_ID, tx_buffer[tail % BT_SERIAL_TX_BUFFER_SIZE]);
+        tail++;
     }
+    tx_tail = tail;
+
+    uart_set_irq_enables(UART_ID, false, tail != tx_head);
+}
+
+static void on_uart_irq()
+{
+    fill_tx_fifo();
+}
+
+static void on_rx_dma_finished()
+{
+    // This interrupt is potentially shared by other DMA channels.
+    // Check that our DMA channel triggered the interrupt.
+    if (dma_channel_get_irq1_status(rx_dma_channel))
+    {
+        // Carry on writing where the channel left off:
+        rx_dma_base_count += RX_DMA_TRANSFER_COUNT;
+        dma_channel_set_trans_count(rx_dma_channel, RX_DMA_TRANSFER_COUNT, true);
+
+        dma_channel_acknowledge_irq1(rx_dma_channel);
+    }
+}
+
+// Returns the number of bytes available for reading. If the DMA has lapped the reader, the bytes
+// that were overwritten are counted as lost and skipped.
+static size_t rx_level()
+{
+    // Don't let the DMA interrupt change the base count while we're using it:
+    uint32_t interrupt_status = save_and_disable_interrupts();
+    uint32_t rx_write_count = rx_dma_base_count + (RX_DMA_TRANSFER_COUNT - dma_hw->ch[rx_dma_channel].transfer_count);
+    restore_interrupts(interrupt_status);
+
+    uint32_t level = rx_write_count - rx_read_count;
+    if (level > RX_BUFFER_SIZE)
+    {
+        rx_overflow_count += level - RX_BUFFER_SIZE;
+        rx_read_count = rx_write_count - RX_BUFFER_SIZE;
+        level = RX_BUFFER_SIZE;
+    }
+    return level;
+}
+
+// Starts sending bytes that were just added to tx_buffer, unless the interrupt is already doing so.
+static void start_tx()
+{
+    irq_set_enabled(UART_IRQ, false);
+    fill_tx_fifo();
+    irq_set_enabled(UART_IRQ, true);
 }
 
 size_t bt_serial_available()
 {
-    return queue_get_level(&rx_buffer);
+    return rx_level();
 }
 
-void bt_serial_init()
+void bt_serial_consume(size_t length)
 {
-    queue_init(&rx_buffer, sizeof(uint8_t), RX_BUFFER_SIZE);
+    size_t available = rx_level();
+    rx_read_count += (length > available) ? available : length;
+}
 
+void bt_serial_init()
+{
     uart_init(UART_ID, BAUD_RATE);
 
     gpio_set_function(UART_TX_PIN, GPIO_FUNC_UART);
@@ -45,52 +123,137 @@ void bt_serial_init()
     uart_set_fifo_enabled(UART_ID, true);
     uart_set_translate_crlf(UART_ID, false); // don't translate CR/LF since we're working with raw bytes
 
-    const int UART_IRQ = (UART_ID == uart0) ? UART0_IRQ : UART1_IRQ;
+    // Set up DMA to copy every received byte into rx_buffer:
+    rx_dma_channel = dma_claim_unused_channel(true);
+    dma_channel_config rx_dma_channel_config = dma_channel_get_default_config(rx_dma_channel);
+    channel_config_set_transfer_data_size(&rx_dma_channel_config, DMA_SIZE_8);
+    channel_config_set_read_increment(&rx_dma_channel_config, false);
+    channel_config_set_write_increment(&rx_dma_channel_config, true);
+    channel_config_set_ring(&rx_dma_channel_config, true, RX_BUFFER_SIZE_BITS); // wrap around rx_buffer
+    channel_config_set_dreq(&rx_dma_channel_config, uart_get_dreq(UART_ID, false)); // transfer each time a byte is received
+    dma_channel_configure(
+        rx_dma_channel,
+        &rx_dma_channel_config,
+        rx_buffer, // write to rx_buffer
+        &uart_get_hw(UART_ID)->dr, // read from UART data register
+        RX_DMA_TRANSFER_COUNT,
+        true // start now
+    );
+
+    // Set up interrupt handler for restarting the DMA when it runs out of transfers:
+    // DMA_IRQ_0 is left for block_io, which may use it on the other core.
+    dma_channel_set_irq1_enabled(rx_dma_channel, true);
+    irq_add_shared_handler(DMA_IRQ_1, on_rx_dma_finished, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_1, true);
 
-    irq_set_exclusive_handler(UART_IRQ, on_uart_rx);
+    // The UART interrupt is only used for transmitting:
+    irq_set_exclusive_handler(UART_IRQ, on_uart_irq);
     irq_set_enabled(UART_IRQ, true);
-    uart_set_irq_enables(UART_ID, true, false);
+    uart_set_irq_enables(UART_ID, false, false);
 
     gpio_init(BT_STATUS_PIN); // set status pin as a normal input pin
 }
 
+void bt_serial_flush()
+{
+    while (tx_tail != tx_head)
+    {
+        tight_loop_contents();
+    }
+    uart_tx_wait_blocking(UART_ID);
+}
+
 bool bt_serial_is_connected()
 {
     return gpio_get(BT_STATUS_PIN);
 }
 
+uint32_t bt_serial_get_overflow_count()
+{
+    rx_level(); // account for any bytes that have just been overwritten
+    return rx_overflow_count;
+}
+
 uint8_t bt_serial_peek()
 {
-    uint8_t data;
-    queue_try_peek(&rx_buffer, &data);
-    return data;
+    const uint8_t *data;
+    bt_serial_peek_span(&data);
+    return *data;
+}
+
+size_t bt_serial_peek_span(const uint8_t **data)
+{
+    size_t available = rx_level();
+    size_t offset = rx_read_count % RX_BUFFER_SIZE;
+    size_t until_wrap = RX_BUFFER_SIZE - offset;
+
+    *data = &rx_buffer[offset];
+    return (available > until_wrap) ? until_wrap : available;
 }
 
 uint8_t bt_serial_read()
 {
-    uint8_t data;
-    queue_try_remove(&rx_buffer, &data);
+    uint8_t data = bt_serial_peek();
+    bt_serial_consume(1);
     return data;
 }
 
 size_t bt_serial_read_multiple(uint8_t *buffer, size_t length)
 {
-    size_t available = queue_get_level(&rx_buffer);
-    size_t n_read = (available > length) ? length : available;
+    size_t n_read = 0;
 
-    for (size_t i = 0; i < n_read; i++)
+    // The bytes may wrap around the end of rx_buffer, so copy up to two spans:
+    while (n_read < length)
     {
-        queue_try_remove(&rx_buffer, &buffer[i]);
+        const uint8_t *data;
+        size_t span_length = bt_serial_peek_span(&data);
+        if (span_length == 0)
+        {
+            break;
+        }
+
+        size_t n_copy = (span_length > length - n_read) ? length - n_read : span_length;
+        memcpy(&buffer[n_read], data, n_copy);
+        bt_serial_consume(n_copy);
+        n_read += n_copy;
     }
     return n_read;
 }
 
+size_t bt_serial_tx_free()
+{
+    return BT_SERIAL_TX_BUFFER_SIZE - (tx_head - tx_tail);
+}
+
 void bt_serial_write(uint8_t data)
 {
-    uart_putc_raw(UART_ID, data);
+    bt_serial_write_multiple(&data, 1);
 }
 
 void bt_serial_write_multiple(uint8_t *buffer, size_t length)
 {
-    uart_write_blocking(UART_ID, buffer, length);
+    while (length > 0)
+    {
+        // If the buffer is full, wait for the interrupt to make some space:
+        size_t free = bt_serial_tx_free();
+        if (free == 0)
+        {
+            tight_loop_contents();
+            continue;
+        }
+
+        size_t n_write = (length > free) ? free : length;
+        uint32_t head = tx_head;
+        for (size_t i = 0; i < n_write; i++)
+        {
+            tx_buffer[(head + i) % BT_SERIAL_TX_BUFFER_SIZE] = buffer[i];
+        }
+        __compiler_memory_barrier(); // make sure the bytes are in the buffer before the interrupt can see them
+        tx_head = head + n_write;
+
+        buffer += n_write;
+        length -= n_write;
+
+        start_tx();
+    }
 }
\ No newline at end of file
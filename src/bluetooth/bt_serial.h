@@ -5,11 +5,30 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+// Number of bytes that can be waiting to be sent. Must be a power of 2:
+#define BT_SERIAL_TX_BUFFER_SIZE 512
+
 /**
  * Returns the number of bytes available for reading from the bluetooth serial port.
  */
 size_t bt_serial_available();
 
+/**
+ * Removes up to 'length' bytes from the bluetooth serial port's internal buffer without copying
+ * them. Use together with bt_serial_peek_span().
+ */
+void bt_serial_consume(size_t length);
+
+/**
+ * Waits until every byte written to the bluetooth serial port has been sent.
+ */
+void bt_serial_flush();
+
+/**
+ * Returns the number of received bytes that were lost because the internal buffer was full.
+ */
+uint32_t bt_serial_get_overflow_count();
+
 /**
  * Initialises the bluetooth serial port.
  */
@@ -27,6 +46,14 @@ bool bt_serial_is_connected();
  */
 uint8_t bt_serial_peek();
 
+/**
+ * Points 'data' at the next bytes from the bluetooth serial port, inside the internal buffer, and
+ * returns how many bytes can be read from there. The bytes stay in the buffer until they are removed
+ * with bt_serial_consume(). Because the buffer wraps around, this may be fewer than
+ * bt_serial_available(); call again after consuming to get the rest.
+ */
+size_t bt_serial_peek_span(const uint8_t **data);
+
 /**
  * Returns the next byte from the bluetooth serial port. If no bytes are available, an undefined value is
  * returned.
@@ -41,12 +68,20 @@ uint8_t bt_serial_read();
 size_t bt_serial_read_multiple(uint8_t *buffer, size_t length);
 
 /**
- * Writes a single byte to the bluetooth serial port.
+ * Returns the number of bytes that can be written to the bluetooth serial port without waiting.
+ */
+size_t bt_serial_tx_free();
+
+/**
+ * Writes a single byte to the bluetooth serial port. The byte is added to an internal buffer and
+ * sent in the background. Only waits if the buffer is full.
  */
 void bt_serial_write(uint8_t data);
 
 /**
- * Writes multiple bytes to the bluetooth serial port.
+ * Writes multiple bytes to the bluetooth serial port. The bytes are added to an internal buffer and
+ * sent in the background. Only waits if the buffer is full, until all the bytes fit. Use
+ * bt_serial_tx_free() first to avoid waiting.
  */
 void bt_serial_write_multiple(uint8_t *buffer, size_t length);
 
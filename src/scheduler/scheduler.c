@@ -0,0 +1,107 @@
+#include "scheduler.h"
+
+typedef struct
+{
+    scheduler_task_function_t function;
+    uint32_t period_us;
+    uint64_t next_run_us;
+
+    // Set by scheduler_signal(), possibly from an interrupt. Single byte writes can't be torn,
+    // and the flag is cleared before the task runs, so a signal that arrives while the task is
+    // running makes it run again rather than getting lost.
+    volatile bool is_signalled;
+} task_t;
+
+static task_t tasks[SCHEDULER_MAX_TASKS];
+static size_t task_count = 0;
+static uint64_t (*get_time)();
+
+int scheduler_add_task(scheduler_task_function_t function, uint32_t period_us)
+{
+    if (task_count == SCHEDULER_MAX_TASKS)
+    {
+        return -1;
+    }
+
+    task_t *task = &tasks[task_count];
+    task->function = function;
+    task->period_us = period_us;
+    task->next_run_us = get_time();
+    task->is_signalled = false;
+
+    return task_count++;
+}
+
+void scheduler_init(uint64_t (*get_time_us)())
+{
+    get_time = get_time_us;
+    task_count = 0;
+}
+
+uint64_t scheduler_run()
+{
+    uint64_t next_deadline = SCHEDULER_NO_DEADLINE;
+
+    for (size_t i = 0; i < task_count; i++)
+    {
+        task_t *task = &tasks[i];
+        uint64_t now = get_time();
+        bool is_due = task->period_us > 0 && now >= task->next_run_us;
+
+        if (task->is_signalled || is_due)
+        {
+            task->is_signalled = false;
+
+            if (is_due)
+            {
+                // Keep to the original schedule so the period doesn't drift. If we've fallen
+                // more than a whole period behind, start again from now instead of trying to
+                // catch up with a burst of runs:
+                task->next_run_us += task->period_us;
+                if (task->next_run_us <= now)
+                {
+                    task->next_run_us = now + task->period_us;
+                }
+            }
+
+            task->function();
+        }
+
+        if (task->period_us > 0 && task->next_run_us < next_deadline)
+        {
+            next_deadline = task->next_run_us;
+        }
+    }
+
+    // If a task was signalled after its turn (for example by a later task), it's ready now:
+    for (size_t i = 0; i < task_count; i++)
+    {
+        if (tasks[i].is_signalled)
+        {
+            return get_time();
+        }
+    }
+
+    return next_deadline;
+}
+
+void scheduler_set_period(int task, uint32_t period_us)
+{
+    if (task >= 0 && (size_t)task < task_count)
+    {
+        // If the task was only running when signalled, start its period from now:
+        if (tasks[task].period_us == 0)
+        {
+            tasks[task].next_run_us = get_time() + period_us;
+        }
+        tasks[task].period_us = period_us;
+    }
+}
+
+void scheduler_signal(int task)
+{
+    if (task >= 0 && (size_t)task < task_count)
+    {
+        tasks[task].is_signalled = true;
+    }
+}
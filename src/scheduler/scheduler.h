@@ -0,0 +1,49 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SCHEDULER_MAX_TASKS 8
+#define SCHEDULER_NO_DEADLINE UINT64_MAX
+
+/**
+ * A function run by the scheduler. Tasks run to completion, so they should return quickly.
+ */
+typedef void (*scheduler_task_function_t)();
+
+/**
+ * Adds a task to the scheduler and returns its ID, or -1 if there is no space for more tasks. The
+ * task runs every 'period_us' microseconds, starting straight away. If 'period_us' is zero, the
+ * task only runs when it is signalled with scheduler_signal(). When several tasks are ready at
+ * the same time, they run in the order they were added.
+ */
+int scheduler_add_task(scheduler_task_function_t function, uint32_t period_us);
+
+/**
+ * Initialises the scheduler, removing all tasks. 'get_time_us' must return the current time in
+ * microseconds. On the Pico, use time_us_64().
+ */
+void scheduler_init(uint64_t (*get_time_us)());
+
+/**
+ * Runs every task that is due or has been signalled, once each. Returns the time (from
+ * 'get_time_us') at which the next periodic task is due, or SCHEDULER_NO_DEADLINE if there are
+ * no periodic tasks. The caller can sleep until then, or until an interrupt signals a task.
+ */
+uint64_t scheduler_run();
+
+/**
+ * Changes how often a task runs. The new period takes effect from the task's next run. A period
+ * of zero makes the task run only when signalled.
+ */
+void scheduler_set_period(int task, uint32_t period_us);
+
+/**
+ * Makes a task run on the next call to scheduler_run(), as well as on its normal period. Safe to
+ * call from interrupt handlers and from the other core.
+ */
+void scheduler_signal(int task);
+
+#endif /* SCHEDULER_H */
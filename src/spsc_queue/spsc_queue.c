@@ -0,0 +1,74 @@
+#include "spsc_queue.h"
+#include <string.h>
+
+// Only atomic loads and stores are used (no read-modify-write operations), so this stays
+// lock-free on the Cortex-M0+, which has no exclusive access instructions. Acquire and release
+// ordering makes sure an element's bytes are written before the other side can see the new index.
+
+static uint8_t *element_at(spsc_queue_t *queue, uint32_t index)
+{
+    return &queue->buffer[(index & (queue->capacity - 1)) * queue->element_size];
+}
+
+uint32_t spsc_queue_get_level(spsc_queue_t *queue)
+{
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    return head - tail;
+}
+
+void spsc_queue_init(spsc_queue_t *queue, void *buffer, size_t element_size, uint32_t capacity)
+{
+    queue->buffer = buffer;
+    queue->element_size = element_size;
+    queue->capacity = capacity;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+bool spsc_queue_try_add(spsc_queue_t *queue, const void *element)
+{
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head - tail == queue->capacity)
+    {
+        return false;
+    }
+
+    memcpy(element_at(queue, head), element, queue->element_size);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool spsc_queue_try_peek(spsc_queue_t *queue, void *element)
+{
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (head == tail)
+    {
+        return false;
+    }
+
+    memcpy(element, element_at(queue, tail), queue->element_size);
+    return true;
+}
+
+bool spsc_queue_try_remove(spsc_queue_t *queue, void *element)
+{
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (head == tail)
+    {
+        return false;
+    }
+
+    if (element)
+    {
+        memcpy(element, element_at(queue, tail), queue->element_size);
+    }
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
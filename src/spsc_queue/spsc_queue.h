@@ -0,0 +1,61 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * A lock-free queue for passing fixed-size elements from exactly one producer to exactly one
+ * consumer, such as from one core to the other or from an interrupt to the main program. Unlike
+ * queue_t from pico/util/queue.h, it never takes a spin lock, so neither side can be held up by
+ * the other.
+ *
+ * If more than one context can add to (or remove from) the same queue, the caller must make sure
+ * they can't interrupt each other.
+ */
+typedef struct
+{
+    uint8_t *buffer;
+    size_t element_size;
+    uint32_t capacity;
+
+    // Both indices count up forever and are wrapped when accessing the buffer. The producer
+    // only writes 'head' and the consumer only writes 'tail':
+    atomic_uint_least32_t head;
+    atomic_uint_least32_t tail;
+} spsc_queue_t;
+
+/**
+ * Returns the number of elements in the queue. The real number may have changed by the time this
+ * returns: it can only have grown if called by the consumer, or only shrunk if called by the
+ * producer.
+ */
+uint32_t spsc_queue_get_level(spsc_queue_t *queue);
+
+/**
+ * Initialises a queue which stores its elements in 'buffer'. The buffer must have space for
+ * 'capacity' elements of 'element_size' bytes each. 'capacity' must be a power of 2.
+ */
+void spsc_queue_init(spsc_queue_t *queue, void *buffer, size_t element_size, uint32_t capacity);
+
+/**
+ * Copies an element onto the back of the queue. Returns false, without waiting, if the queue is
+ * full. Only call from the producer.
+ */
+bool spsc_queue_try_add(spsc_queue_t *queue, const void *element);
+
+/**
+ * Copies the element at the front of the queue into 'element' without removing it. Returns false
+ * if the queue is empty. Only call from the consumer.
+ */
+bool spsc_queue_try_peek(spsc_queue_t *queue, void *element);
+
+/**
+ * Removes the element at the front of the queue and copies it into 'element' (unless it is NULL).
+ * Returns false if the queue is empty. Only call from the consumer.
+ */
+bool spsc_queue_try_remove(spsc_queue_t *queue, void *element);
+
+#endif /* SPSC_QUEUE_H */
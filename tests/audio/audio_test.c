@@ -3,6 +3,22 @@
 #include "pico/stdio_usb.h"
 #include "pico/time.h"
 
+// Waits while keeping the sounds that are playing fed from the SD card:
+static void play_for_ms(uint32_t ms)
+{
+    absolute_time_t end_time = make_timeout_time_ms(ms);
+    while (absolute_time_diff_us(get_absolute_time(), end_time) > 0)
+    {
+        audio_update();
+        sleep_ms(4);
+    }
+    audio_clip_cache_stats_t stats;
+    audio_get_clip_cache_stats(&stats);
+    printf("Underruns so far: %u, clip cache: %u hits, %u misses, %u evictions, %u/%u buffers used\n",
+        audio_get_underrun_count(), stats.hits, stats.misses, stats.evictions, stats.buffers_used,
+        AUDIO_CLIP_CACHE_BUFFER_COUNT);
+}
+
 int main()
 {
     stdio_usb_init();
@@ -16,8 +32,14 @@ int main()
     while (1)
     {
         audio_play_sound(0);
-        sleep_ms(5000);
+        play_for_ms(5000);
         audio_play_sound(1);
-        sleep_ms(5000);
+        play_for_ms(5000);
+
+        // Both at once, with the second one quieter:
+        audio_play_sound(0);
+        play_for_ms(200);
+        audio_play_sound_with_gain(1, AUDIO_GAIN_UNITY / 2);
+        play_for_ms(5000);
     }
 }
\ No newline at end of file
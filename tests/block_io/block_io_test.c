@@ -7,7 +7,7 @@ unsigned int count = 0;
 
 void dump_block_structure()
 {
-    printf("Scan number %u", count++);
+    printf("Scan number %u (%u us at %u Hz)", count++, block_io_get_scan_time_us(), block_io_get_spi_baud_rate());
 
     if (block_io_is_corrupted())
     {
@@ -15,9 +15,14 @@ void dump_block_structure()
     }
     printf("\n");
 
-    for (size_t grid_tile = 0; grid_tile < BLOCK_IO_TILE_COUNT; grid_tile++)
+    for (size_t grid_tile = 0; grid_tile < block_io_get_tile_count(); grid_tile++)
     {
-        printf("Tile %2u: ", grid_tile + 1);
+        printf("Tile %2u (%u errors): ", grid_tile + 1, block_io_get_tile_error_count(grid_tile));
+
+        if (block_io_is_tile_corrupted(grid_tile))
+        {
+            printf("(last good) ");
+        }
 
         size_t stack_height = block_io_get_stack_height(grid_tile);
 
@@ -41,6 +46,28 @@ void dump_block_structure()
     }
 }
 
+void dump_change_events()
+{
+    if (block_io_has_lost_change_events())
+    {
+        printf("Some change events were lost\n");
+    }
+
+    block_io_event_t event;
+    while (block_io_get_change_event(&event))
+    {
+        switch (event.type)
+        {
+            case BLOCK_IO_EVENT_BLOCK_CHANGED:
+                printf("Tile %2u height %2u: %02x -> %02x\n", event.grid_tile + 1, event.height, event.old_block, event.new_block);
+                break;
+            case BLOCK_IO_EVENT_COMPLETION_CHANGED:
+                printf("Structure is now %s\n", event.is_complete ? "complete" : "incomplete");
+                break;
+        }
+    }
+}
+
 int main()
 {
     stdio_usb_init();
@@ -50,10 +77,17 @@ int main()
 
     block_io_init();
 
+    printf("Calibrating SPI clock...\n");
+    printf("Using %u Hz\n", block_io_calibrate_spi());
+
     // Set an arbitrary target structure:
     block_io_clear_target_structure();
     block_io_set_target_block(0, 0, 13);
     block_io_set_target_block(1, 0, 5);
+    block_io_commit_target_structure();
+
+    // Only report changes from here on:
+    block_io_enable_change_events();
 
     printf("Ready\n");
 
@@ -61,6 +95,7 @@ int main()
     {
         block_io_update();
         dump_block_structure();
+        dump_change_events();
         sleep_ms(100);
     }
 }
\ No newline at end of file
@@ -30,6 +30,6 @@ int main()
             }
         }
 
-        printf("\nDevice disconnected\n");
+        printf("\nDevice disconnected (%u bytes lost to overflow)\n", bt_serial_get_overflow_count());
     }
 }
\ No newline at end of file
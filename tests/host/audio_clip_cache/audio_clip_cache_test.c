@@ -0,0 +1,151 @@
+#include "audio_clip_cache.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Fills the clip cache with clips of known samples, and checks that they come back intact, that
+// the least recently used clips are evicted first, and that pinned and playing clips never are.
+
+#define CLIP_BUFFERS 8 // so that the cache holds 6 of them
+#define CLIP_SAMPLES (CLIP_BUFFERS * AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER - 100)
+
+static audio_clip_cache_t cache;
+static const audio_clip_t *playing_clip = NULL;
+static unsigned int failures = 0;
+
+static bool is_playing(void *context, const audio_clip_t *clip)
+{
+    (void)context;
+    return clip == playing_clip;
+}
+
+static void check(bool is_correct, const char *message)
+{
+    if (!is_correct)
+    {
+        printf("FAIL: %s\n", message);
+        failures++;
+    }
+}
+
+static int16_t get_sample(size_t sound, size_t index)
+{
+    return (int16_t)(sound * 1000 + index);
+}
+
+// Adds a clip for 'sound' and fills it in, like audio.c does while streaming it:
+static audio_clip_t *add_clip(size_t sound)
+{
+    audio_clip_t *clip = audio_clip_cache_add(&cache, sound, CLIP_SAMPLES);
+    if (clip == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < clip->buffer_count; i++)
+    {
+        int16_t *samples = audio_clip_cache_get_samples(&cache, clip, i);
+        for (size_t j = 0; j < audio_clip_cache_get_sample_count(clip, i); j++)
+        {
+            samples[j] = get_sample(sound, i * AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER + j);
+        }
+    }
+    audio_clip_cache_complete(&cache, clip);
+    return clip;
+}
+
+static bool is_clip_intact(size_t sound)
+{
+    audio_clip_t *clip = audio_clip_cache_get(&cache, sound);
+    if (clip == NULL || !clip->is_complete || clip->sample_count != CLIP_SAMPLES)
+    {
+        return false;
+    }
+
+    size_t sample_index = 0;
+    for (size_t i = 0; i < clip->buffer_count; i++)
+    {
+        const int16_t *samples = audio_clip_cache_get_samples(&cache, clip, i);
+        for (size_t j = 0; j < audio_clip_cache_get_sample_count(clip, i); j++)
+        {
+            if (samples[j] != get_sample(sound, sample_index++))
+            {
+                return false;
+            }
+        }
+    }
+    return sample_index == CLIP_SAMPLES;
+}
+
+static bool is_cached(size_t sound)
+{
+    return audio_clip_cache_get(&cache, sound) != NULL;
+}
+
+int main()
+{
+    audio_clip_cache_init(&cache, is_playing, NULL);
+    audio_clip_cache_stats_t stats;
+
+    // An empty cache misses, and clips that are too long or empty aren't cached:
+    check(audio_clip_cache_find(&cache, 1) == NULL, "found a clip in an empty cache");
+    check(audio_clip_cache_add(&cache, 1, AUDIO_CLIP_CACHE_MAX_CLIP_BUFFERS * AUDIO_CLIP_CACHE_SAMPLES_PER_BUFFER + 1) == NULL,
+        "cached a clip that's too long");
+    check(audio_clip_cache_add(&cache, 1, 0) == NULL, "cached an empty clip");
+
+    // A clip can't be found until it's complete, and there can only be one per sound:
+    audio_clip_t *partial = audio_clip_cache_add(&cache, 1, CLIP_SAMPLES);
+    check(partial != NULL && audio_clip_cache_find(&cache, 1) == NULL, "found a clip before it was complete");
+    check(audio_clip_cache_add(&cache, 1, CLIP_SAMPLES) == NULL, "cached two clips for one sound");
+    audio_clip_cache_remove(&cache, partial);
+
+    // Fill the cache:
+    size_t capacity = AUDIO_CLIP_CACHE_BUFFER_COUNT / CLIP_BUFFERS;
+    for (size_t sound = 0; sound < capacity; sound++)
+    {
+        check(add_clip(sound) != NULL, "couldn't cache a clip in an empty cache");
+    }
+    for (size_t sound = 0; sound < capacity; sound++)
+    {
+        check(audio_clip_cache_find(&cache, sound) != NULL && is_clip_intact(sound), "a cached clip was changed");
+    }
+    audio_clip_cache_get_stats(&cache, &stats);
+    check(stats.hits == capacity && stats.misses == 2 && stats.evictions == 0, "wrong hit and miss counts");
+    check(stats.buffers_used == capacity * CLIP_BUFFERS && stats.clip_count == capacity, "wrong buffer count");
+
+    // Use sound 0 again, pin sound 1 and play sound 2. Sound 3 is then the least recently used one
+    // that can go, followed by 4:
+    audio_clip_cache_find(&cache, 0);
+    audio_clip_cache_get(&cache, 1)->is_pinned = true;
+    playing_clip = audio_clip_cache_get(&cache, 2);
+
+    check(add_clip(100) != NULL && !is_cached(3) && is_cached(4), "didn't evict the least recently used clip");
+    check(add_clip(101) != NULL && !is_cached(4), "didn't evict the next least recently used clip");
+    check(add_clip(102) != NULL && !is_cached(5), "didn't evict the next least recently used clip");
+    check(add_clip(103) != NULL && !is_cached(0), "didn't evict the clip used again");
+    check(is_clip_intact(1) && is_clip_intact(2), "evicted a pinned or playing clip");
+    check(is_clip_intact(100) && is_clip_intact(103), "a clip in evicted buffers was changed");
+
+    // Once the new clips are playing or pinned too, nothing can be evicted:
+    for (size_t sound = 100; sound < 104; sound++)
+    {
+        audio_clip_cache_get(&cache, sound)->is_pinned = true;
+    }
+    check(add_clip(200) == NULL, "evicted a pinned or playing clip to make room");
+
+    // Once the clip finishes playing, it can go:
+    playing_clip = NULL;
+    check(add_clip(200) != NULL && !is_cached(2) && is_clip_intact(200), "didn't evict a clip that finished playing");
+
+    audio_clip_cache_get_stats(&cache, &stats);
+    check(stats.evictions == 5 && stats.buffers_used == capacity * CLIP_BUFFERS, "wrong eviction count");
+    printf("%u hits, %u misses, %u evictions, %zu clips in %zu/%d buffers\n", stats.hits, stats.misses,
+        stats.evictions, stats.clip_count, stats.buffers_used, AUDIO_CLIP_CACHE_BUFFER_COUNT);
+
+    if (failures > 0)
+    {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "audio_mixer.h"
+#include <stdio.h>
+#include <time.h>
+
+// Benchmark of mixing one buffer of audio, as fill_write_buffer_irh() does, for 1 to
+// AUDIO_VOICE_COUNT voices. Prints the time and cycles per buffer on this machine, next to the time
+// there is to fill a buffer before it's played. Reading the samples from the SD card isn't
+// included. Only compare results between runs on the same machine.
+
+// These match audio.c and audio.h:
+#define SAMPLES_IN_BUFFER 512
+#define SAMPLE_RATE 30518
+#define AUDIO_VOICE_COUNT 4
+
+#define BUFFER_COUNT 20000
+
+static int32_t mix[SAMPLES_IN_BUFFER];
+static int16_t voice_samples[AUDIO_VOICE_COUNT][SAMPLES_IN_BUFFER];
+static int16_t output[SAMPLES_IN_BUFFER];
+
+static unsigned int random_state = 3;
+
+static unsigned int next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) & 0x7FFF;
+}
+
+static double get_host_time_s()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Returns the processor's cycle counter where there's one to read, or 0:
+static unsigned long long get_host_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+int main()
+{
+    // Loud random samples, so that plenty of them saturate:
+    for (size_t voice = 0; voice < AUDIO_VOICE_COUNT; voice++)
+    {
+        for (size_t i = 0; i < SAMPLES_IN_BUFFER; i++)
+        {
+            voice_samples[voice][i] = (int16_t)(next_random() * 2 - 0x8000);
+        }
+    }
+
+    double deadline_us = 1e6 * SAMPLES_IN_BUFFER / SAMPLE_RATE;
+    printf("Mixing %d samples per buffer, which must be ready within %.0f us:\n", SAMPLES_IN_BUFFER, deadline_us);
+
+    for (size_t voice_count = 1; voice_count <= AUDIO_VOICE_COUNT; voice_count++)
+    {
+        // The first voice is at unity gain and the rest aren't, to cover both paths:
+        double start_s = get_host_time_s();
+        unsigned long long start_cycles = get_host_cycles();
+        for (size_t buffer = 0; buffer < BUFFER_COUNT; buffer++)
+        {
+            audio_mixer_clear(mix, SAMPLES_IN_BUFFER);
+            for (size_t voice = 0; voice < voice_count; voice++)
+            {
+                uint16_t gain = (voice == 0) ? AUDIO_MIXER_GAIN_UNITY : AUDIO_MIXER_GAIN_UNITY * 3 / 4;
+                audio_mixer_add_voice(mix, voice_samples[voice], SAMPLES_IN_BUFFER, gain);
+            }
+            audio_mixer_output(mix, output, SAMPLES_IN_BUFFER);
+
+            // Use the output, so that the mixing isn't optimised away:
+            voice_samples[0][buffer % SAMPLES_IN_BUFFER] ^= output[buffer % SAMPLES_IN_BUFFER] & 1;
+        }
+        unsigned long long cycles = get_host_cycles() - start_cycles;
+        double time_s = get_host_time_s() - start_s;
+
+        double buffer_us = time_s * 1e6 / BUFFER_COUNT;
+        printf("  %zu voice%s: %.2f us (%llu cycles) per buffer, %.3f%% of the deadline\n", voice_count,
+            (voice_count == 1) ? " " : "s", buffer_us, cycles / BUFFER_COUNT, 100 * buffer_us / deadline_us);
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "audio_mixer.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Mixes short voices with known samples and checks the gain, the sum of the voices, and that loud
+// mixes saturate rather than wrapping around.
+
+#define SAMPLE_COUNT 8
+
+static unsigned int failures = 0;
+
+static void check_output(const int32_t *mix, const int16_t *expected, const char *message)
+{
+    int16_t output[SAMPLE_COUNT];
+    audio_mixer_output(mix, output, SAMPLE_COUNT);
+    for (size_t i = 0; i < SAMPLE_COUNT; i++)
+    {
+        if (output[i] != expected[i])
+        {
+            printf("FAIL: %s (sample %zu is %d, expected %d)\n", message, i, output[i], expected[i]);
+            failures++;
+            return;
+        }
+    }
+}
+
+int main()
+{
+    int32_t mix[SAMPLE_COUNT];
+    const int16_t voice_a[SAMPLE_COUNT] = { 0, 100, -100, 1000, -1000, 20000, -20000, 32767 };
+    const int16_t voice_b[SAMPLE_COUNT] = { 5, 5, 5, 5, 5, 20000, -20000, -32768 };
+
+    // Nothing mixed in is silence:
+    const int16_t silence[SAMPLE_COUNT] = { 0 };
+    audio_mixer_clear(mix, SAMPLE_COUNT);
+    check_output(mix, silence, "a cleared mix isn't silent");
+
+    // One voice at unity gain comes out unchanged:
+    audio_mixer_add_voice(mix, voice_a, SAMPLE_COUNT, AUDIO_MIXER_GAIN_UNITY);
+    check_output(mix, voice_a, "a single voice at unity gain was changed");
+
+    // Half gain, rounding towards minus infinity:
+    const int16_t half_a[SAMPLE_COUNT] = { 0, 50, -50, 500, -500, 10000, -10000, 16383 };
+    audio_mixer_clear(mix, SAMPLE_COUNT);
+    audio_mixer_add_voice(mix, voice_a, SAMPLE_COUNT, AUDIO_MIXER_GAIN_UNITY / 2);
+    check_output(mix, half_a, "half gain");
+
+    // Two voices add up, saturating where they're too loud together:
+    const int16_t sum[SAMPLE_COUNT] = { 5, 105, -95, 1005, -995, 32767, -32768, -1 };
+    audio_mixer_clear(mix, SAMPLE_COUNT);
+    audio_mixer_add_voice(mix, voice_a, SAMPLE_COUNT, AUDIO_MIXER_GAIN_UNITY);
+    audio_mixer_add_voice(mix, voice_b, SAMPLE_COUNT, AUDIO_MIXER_GAIN_UNITY);
+    check_output(mix, sum, "two voices");
+
+    // An inverted voice can bring a loud one back into range, since only the mix is clipped:
+    const int16_t loud[SAMPLE_COUNT] = { 0, 400, -400, 4000, -4000, 32767, -32768, 32767 };
+    int16_t inverse_a[SAMPLE_COUNT];
+    for (size_t i = 0; i < SAMPLE_COUNT; i++)
+    {
+        inverse_a[i] = -voice_a[i];
+    }
+    audio_mixer_clear(mix, SAMPLE_COUNT);
+    audio_mixer_add_voice(mix, voice_a, SAMPLE_COUNT, AUDIO_MIXER_MAX_GAIN);
+    check_output(mix, loud, "maximum gain");
+    audio_mixer_add_voice(mix, inverse_a, SAMPLE_COUNT, 3 * AUDIO_MIXER_GAIN_UNITY);
+    check_output(mix, voice_a, "a loud voice was clipped before the mix was finished");
+
+    // The loudest possible mix of many voices must not overflow:
+    int16_t extreme[SAMPLE_COUNT];
+    int16_t extreme_result[SAMPLE_COUNT];
+    for (size_t i = 0; i < SAMPLE_COUNT; i++)
+    {
+        extreme[i] = (i % 2) ? INT16_MIN : INT16_MAX;
+        extreme_result[i] = extreme[i];
+    }
+    audio_mixer_clear(mix, SAMPLE_COUNT);
+    for (size_t voice = 0; voice < 64; voice++)
+    {
+        audio_mixer_add_voice(mix, extreme, SAMPLE_COUNT, AUDIO_MIXER_MAX_GAIN);
+    }
+    check_output(mix, extreme_result, "64 voices at maximum gain overflowed");
+
+    if (failures > 0)
+    {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include "block_io.h"
+#include "block_io_port.h"
+#include "block_io_sim.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+// Benchmark of the scan path, for measuring changes to block_io.c without the hardware. Prints:
+//  - the scan latency on the Pico, as estimated by the simulator, for grids of chained boards on
+//    one or more buses,
+//  - the cost of corruption, with bit errors injected on the bus,
+//  - the decode throughput of block_io_update() on this machine. This includes the simulated bus,
+//    so only compare it between runs on the same machine.
+
+typedef struct
+{
+    size_t board_count;
+    size_t height_limit;
+} grid_size_t;
+
+static const grid_size_t grid_sizes[] = {
+    { 1, 16 },
+    { 4, 16 },
+    { 16, 8 },
+    { 28, 8 },
+};
+#define GRID_SIZE_COUNT (sizeof(grid_sizes) / sizeof(grid_sizes[0]))
+
+#define NOISY_SCAN_COUNT 100
+#define NOISY_BYTES_PER_ERROR 2000
+#define THROUGHPUT_SCAN_COUNT 500
+
+static unsigned int random_state = 7;
+
+static unsigned int next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) & 0x7FFF;
+}
+
+// Fills every tile to the height limit with randomly rotated blocks, which is the slowest grid to
+// scan:
+static size_t build_full_grid(const grid_size_t *size)
+{
+    size_t tile_count = size->board_count * BLOCK_IO_TILES_PER_BOARD;
+    block_io_set_grid_size(tile_count, size->height_limit);
+    block_io_sim_clear();
+
+    for (size_t grid_tile = 0; grid_tile < tile_count; grid_tile++)
+    {
+        uint8_t raw_blocks[BLOCK_IO_MAX_HEIGHT_LIMIT];
+        for (size_t y = 0; y < size->height_limit; y++)
+        {
+            raw_blocks[y] = ((1 + next_random() % 63) << 2) | (next_random() % 4);
+        }
+        block_io_sim_set_grid_stack(grid_tile, raw_blocks, size->height_limit);
+    }
+
+    return tile_count * size->height_limit;
+}
+
+static void scan_async()
+{
+    block_io_update_async(NULL);
+    while (block_io_is_scanning())
+    {
+        block_io_port_wait_for_event();
+    }
+}
+
+static double get_host_time_s()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void measure_latency()
+{
+    printf("Scan latency at %u Hz (simulated):\n", block_io_get_spi_baud_rate());
+    printf("%6s %6s %6s %12s %12s\n", "boards", "height", "buses", "blocking", "DMA");
+
+    for (size_t i = 0; i < GRID_SIZE_COUNT; i++)
+    {
+        for (size_t bus_count = 1; bus_count <= BLOCK_IO_MAX_BUS_COUNT; bus_count++)
+        {
+            block_io_set_bus_count(bus_count);
+            build_full_grid(&grid_sizes[i]);
+
+            block_io_update();
+            uint32_t blocking_time_us = block_io_get_scan_time_us();
+            scan_async();
+            uint32_t dma_time_us = block_io_get_scan_time_us();
+
+            printf("%6zu %6zu %6zu %9u us %9u us\n", grid_sizes[i].board_count, grid_sizes[i].height_limit,
+                bus_count, blocking_time_us, dma_time_us);
+        }
+    }
+}
+
+static void measure_corruption()
+{
+    const grid_size_t *size = &grid_sizes[GRID_SIZE_COUNT - 1];
+    block_io_set_bus_count(1);
+    build_full_grid(size);
+    scan_async();
+    uint32_t clean_time_us = block_io_get_scan_time_us();
+
+    // Most bit errors land in block data and can't be detected. Those that hide a zero byte are
+    // retried, and make the SPI clock back off, which both show up in the scan time:
+    uint32_t baud_rate = block_io_get_spi_baud_rate();
+    block_io_sim_set_bit_error_rate(NOISY_BYTES_PER_ERROR);
+
+    uint64_t total_time_us = 0;
+    size_t corrupted_scans = 0;
+    for (size_t i = 0; i < NOISY_SCAN_COUNT; i++)
+    {
+        scan_async();
+        total_time_us += block_io_get_scan_time_us();
+        corrupted_scans += block_io_is_corrupted();
+    }
+    block_io_sim_set_bit_error_rate(0);
+
+    uint32_t error_count = 0;
+    for (size_t grid_tile = 0; grid_tile < block_io_get_tile_count(); grid_tile++)
+    {
+        error_count += block_io_get_tile_error_count(grid_tile);
+    }
+
+    printf("\nWith a bit error every %u bytes, on %zu boards (simulated, from %u Hz):\n",
+        NOISY_BYTES_PER_ERROR, size->board_count, baud_rate);
+    printf("  DMA scan: %u us clean, %llu us on average with errors, ending at %u Hz\n", clean_time_us,
+        (unsigned long long)(total_time_us / NOISY_SCAN_COUNT), block_io_get_spi_baud_rate());
+    printf("  %u bad reads in %u scans, %zu scans left with a corrupted stack\n", error_count,
+        NOISY_SCAN_COUNT, corrupted_scans);
+}
+
+static void measure_throughput()
+{
+    const grid_size_t *size = &grid_sizes[GRID_SIZE_COUNT - 1];
+    block_io_set_bus_count(1);
+    size_t block_count = build_full_grid(size);
+
+    double start_s = get_host_time_s();
+    for (size_t i = 0; i < THROUGHPUT_SCAN_COUNT; i++)
+    {
+        block_io_update();
+    }
+    double time_s = get_host_time_s() - start_s;
+
+    double blocks_per_s = block_count * THROUGHPUT_SCAN_COUNT / time_s;
+    printf("\nDecode throughput of block_io_update() on this machine, %zu blocks per scan:\n", block_count);
+    printf("  %.1f us per scan, %.1f M blocks/s, %.1f ns per block\n", time_s * 1e6 / THROUGHPUT_SCAN_COUNT,
+        blocks_per_s * 1e-6, 1e9 / blocks_per_s);
+}
+
+int main()
+{
+    block_io_init();
+    build_full_grid(&grid_sizes[0]); // calibration needs tall stacks to go by
+    block_io_calibrate_spi();
+
+    measure_latency();
+    measure_corruption();
+    measure_throughput();
+    return 0;
+}
@@ -0,0 +1,296 @@
+#include "block_io.h"
+#include "block_io_port.h"
+#include "block_io_sim.h"
+#include <stdbool.h>
+#include <string.h>
+
+// Rough costs of each step on the real board, in nanoseconds. Sending a byte also takes 8 SPI
+// clock periods:
+#define SHIFT_SELECT_NS 1200 // two PIO steps
+#define TRANSFER_OVERHEAD_NS 2000 // starting a blocking transfer and decoding the byte
+#define INTERRUPT_OVERHEAD_NS 3000 // taking the DMA interrupt and decoding the stack
+
+typedef struct
+{
+    // Each stack acts as a shift register of bytes. While its tile is selected, every byte sent in
+    // at the bottom pushes the byte from the bottom block out, and the rest move down one place:
+    uint8_t stacks[BLOCK_IO_MAX_TILE_COUNT][BLOCK_IO_MAX_HEIGHT_LIMIT + 1];
+    size_t stack_heights[BLOCK_IO_MAX_TILE_COUNT];
+    uint8_t shift_register[BLOCK_IO_MAX_HEIGHT_LIMIT + 1];
+
+    // Each block shows the byte it's holding as its LED data once its tile is deselected:
+    uint8_t leds[BLOCK_IO_MAX_TILE_COUNT][BLOCK_IO_MAX_HEIGHT_LIMIT + 1];
+
+    // The slave select shift register. block_io shifts in a zero and then a one before reading the
+    // first tile, so tile i is selected while stage i + 1 holds the zero:
+    bool select_stages[BLOCK_IO_MAX_TILE_COUNT + 1];
+    int selected_tile;
+
+    // Number of times each tile will fail to answer when it's next selected, and whether the
+    // selected tile is failing now:
+    size_t corrupt_read_counts[BLOCK_IO_MAX_TILE_COUNT];
+    bool is_selected_tile_corrupt;
+
+    uint32_t baud_rate;
+
+    // A transfer started by block_io_port_start_transfer(). It runs alongside everything else, and
+    // is finished by the wait for an event after 'end_ns':
+    const uint8_t *pending_write_buffer;
+    uint8_t *pending_read_buffer;
+    size_t pending_length;
+    uint64_t pending_end_ns;
+    void (*pending_on_complete)(size_t bus);
+} bus_t;
+
+static bus_t buses[BLOCK_IO_MAX_BUS_COUNT];
+
+static uint64_t now_ns = 0;
+
+// Everything runs on core 0, since the scanner is never launched on core 1 (see
+// block_io_port_launch_scanner()), but which core has the transfer interrupt is kept track of:
+static int transfer_irq_core = -1;
+
+static uint32_t bytes_per_bit_error = 0;
+static uint32_t random_state = 1;
+
+static uint32_t next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) & 0x7FFF;
+}
+
+static uint64_t get_byte_time_ns(size_t bus)
+{
+    return 8ull * 1000000000 / buses[bus].baud_rate;
+}
+
+static uint8_t shift_byte(bus_t *bus, uint8_t data)
+{
+    if (bus->selected_tile < 0)
+    {
+        return 0xFF; // nothing is driving the line
+    }
+
+    if (bus->is_selected_tile_corrupt)
+    {
+        return 0xFF;
+    }
+
+    uint8_t read_data = data; // the base tile passes the byte straight back
+    size_t height = bus->stack_heights[bus->selected_tile];
+    if (height > 0)
+    {
+        read_data = bus->shift_register[0];
+        memmove(&bus->shift_register[0], &bus->shift_register[1], height - 1);
+        bus->shift_register[height - 1] = data;
+    }
+
+    if (bytes_per_bit_error > 0 && next_random() % bytes_per_bit_error == 0)
+    {
+        read_data ^= 1 << (next_random() % 8);
+    }
+    return read_data;
+}
+
+void block_io_sim_clear()
+{
+    for (size_t bus = 0; bus < BLOCK_IO_MAX_BUS_COUNT; bus++)
+    {
+        memset(buses[bus].stack_heights, 0, sizeof(buses[bus].stack_heights));
+        memset(buses[bus].corrupt_read_counts, 0, sizeof(buses[bus].corrupt_read_counts));
+    }
+}
+
+void block_io_sim_set_stack(size_t bus, size_t bus_tile, const uint8_t *raw_blocks, size_t height)
+{
+    memcpy(buses[bus].stacks[bus_tile], raw_blocks, height);
+    buses[bus].stack_heights[bus_tile] = height;
+}
+
+// Finds the bus of a tile numbered across the whole grid, and its tile on that bus:
+static size_t get_grid_tile_bus(size_t *grid_tile)
+{
+    size_t bus = 0;
+    while (*grid_tile >= block_io_get_bus_tile_count(bus))
+    {
+        *grid_tile -= block_io_get_bus_tile_count(bus);
+        bus++;
+    }
+    return bus;
+}
+
+void block_io_sim_set_grid_stack(size_t grid_tile, const uint8_t *raw_blocks, size_t height)
+{
+    size_t bus = get_grid_tile_bus(&grid_tile);
+    block_io_sim_set_stack(bus, grid_tile, raw_blocks, height);
+}
+
+uint8_t block_io_sim_get_led(size_t grid_tile, size_t height)
+{
+    size_t bus = get_grid_tile_bus(&grid_tile);
+    if (buses[bus].selected_tile == (int)grid_tile)
+    {
+        return buses[bus].shift_register[height];
+    }
+    return buses[bus].leds[grid_tile][height];
+}
+
+void block_io_sim_corrupt_reads(size_t bus, size_t bus_tile, size_t read_count)
+{
+    buses[bus].corrupt_read_counts[bus_tile] = read_count;
+}
+
+void block_io_sim_set_bit_error_rate(uint32_t bytes_per_error)
+{
+    bytes_per_bit_error = bytes_per_error;
+}
+
+uint32_t block_io_port_init_bus(size_t bus, uint32_t baud_rate)
+{
+    if (buses[bus].baud_rate == 0)
+    {
+        for (size_t i = 0; i < BLOCK_IO_MAX_TILE_COUNT + 1; i++)
+        {
+            buses[bus].select_stages[i] = true;
+        }
+        buses[bus].selected_tile = -1;
+    }
+    buses[bus].baud_rate = baud_rate;
+    return baud_rate;
+}
+
+uint32_t block_io_port_set_baud_rate(size_t bus, uint32_t baud_rate)
+{
+    buses[bus].baud_rate = baud_rate;
+    return baud_rate;
+}
+
+void block_io_port_shift_select(size_t bus_number, bool bit)
+{
+    bus_t *bus = &buses[bus_number];
+    now_ns += SHIFT_SELECT_NS;
+
+    memmove(&bus->select_stages[1], &bus->select_stages[0], BLOCK_IO_MAX_TILE_COUNT);
+    bus->select_stages[0] = bit;
+
+    if (bus->selected_tile >= 0)
+    {
+        memcpy(bus->leds[bus->selected_tile], bus->shift_register, bus->stack_heights[bus->selected_tile]);
+    }
+
+    // When a tile is selected, its blocks load their own data into the shift register:
+    bus->selected_tile = -1;
+    bus->is_selected_tile_corrupt = false;
+    for (size_t bus_tile = 0; bus_tile < BLOCK_IO_MAX_TILE_COUNT; bus_tile++)
+    {
+        if (!bus->select_stages[bus_tile + 1])
+        {
+            bus->selected_tile = bus_tile;
+            memcpy(bus->shift_register, bus->stacks[bus_tile], bus->stack_heights[bus_tile]);
+
+            if (bus->corrupt_read_counts[bus_tile] > 0)
+            {
+                bus->corrupt_read_counts[bus_tile]--;
+                bus->is_selected_tile_corrupt = true;
+            }
+            break;
+        }
+    }
+}
+
+uint8_t block_io_port_transfer(size_t bus, uint8_t data)
+{
+    now_ns += TRANSFER_OVERHEAD_NS + get_byte_time_ns(bus);
+    return shift_byte(&buses[bus], data);
+}
+
+void block_io_port_start_transfer(size_t bus, const uint8_t *write_buffer, uint8_t *read_buffer, size_t length, void (*on_complete)(size_t bus))
+{
+    buses[bus].pending_write_buffer = write_buffer;
+    buses[bus].pending_read_buffer = read_buffer;
+    buses[bus].pending_length = length;
+    buses[bus].pending_end_ns = now_ns + length * get_byte_time_ns(bus);
+    buses[bus].pending_on_complete = on_complete;
+}
+
+void block_io_port_claim_transfer_irq()
+{
+    transfer_irq_core = 0;
+}
+
+void block_io_port_release_transfer_irq()
+{
+    if (transfer_irq_core == 0)
+    {
+        transfer_irq_core = -1;
+    }
+}
+
+int block_io_sim_get_transfer_irq_core()
+{
+    return transfer_irq_core;
+}
+
+uint64_t block_io_port_get_time_us()
+{
+    return now_ns / 1000;
+}
+
+void block_io_port_sleep_until(uint64_t time_us)
+{
+    if (time_us * 1000 > now_ns)
+    {
+        now_ns = time_us * 1000;
+    }
+}
+
+void block_io_port_wait_for_event()
+{
+    // Finish whichever transfer ends first:
+    bus_t *bus = NULL;
+    size_t bus_number = 0;
+    for (size_t i = 0; i < BLOCK_IO_MAX_BUS_COUNT; i++)
+    {
+        if (buses[i].pending_on_complete && (bus == NULL || buses[i].pending_end_ns < bus->pending_end_ns))
+        {
+            bus = &buses[i];
+            bus_number = i;
+        }
+    }
+
+    if (bus == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < bus->pending_length; i++)
+    {
+        bus->pending_read_buffer[i] = shift_byte(bus, bus->pending_write_buffer[i]);
+    }
+    if (bus->pending_end_ns > now_ns)
+    {
+        now_ns = bus->pending_end_ns;
+    }
+    now_ns += INTERRUPT_OVERHEAD_NS;
+
+    // The callback may start the next transfer:
+    void (*on_complete)(size_t bus) = bus->pending_on_complete;
+    bus->pending_on_complete = NULL;
+    on_complete(bus_number);
+}
+
+uint32_t block_io_port_disable_interrupts()
+{
+    return 0;
+}
+
+void block_io_port_restore_interrupts(uint32_t status)
+{
+    (void)status;
+}
+
+void block_io_port_launch_scanner(void (*entry)())
+{
+    // There's no second core to run the scanner on. Tests scan by calling block_io_update().
+    (void)entry;
+}
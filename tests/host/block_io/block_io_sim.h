@@ -0,0 +1,54 @@
+#ifndef BLOCK_IO_SIM_H
+#define BLOCK_IO_SIM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Simulated block buses, implementing block_io_port.h on a PC. Time only moves when a bus is used,
+// using rough estimates of how long each step takes on the real board. DMA transfers on different
+// buses run at the same time.
+
+/**
+ * Removes every block from every tile.
+ */
+void block_io_sim_clear();
+
+/**
+ * Puts a stack of blocks on a tile. 'bus_tile' counts from the first tile on 'bus'. 'raw_blocks'
+ * are the bytes the blocks send, bottom first, with each block's rotation relative to the one
+ * below. The stack can be up to BLOCK_IO_MAX_HEIGHT_LIMIT + 1 blocks high, so that it can be
+ * taller than the height limit in use.
+ */
+void block_io_sim_set_stack(size_t bus, size_t bus_tile, const uint8_t *raw_blocks, size_t height);
+
+/**
+ * Puts a stack of blocks on a tile numbered across the whole grid, finding its bus in the same
+ * way as block_io does. The grid size and bus count must already be set.
+ */
+void block_io_sim_set_grid_stack(size_t grid_tile, const uint8_t *raw_blocks, size_t height);
+
+/**
+ * Makes the next 'read_count' reads of a tile fail, as if its stack had come loose. Every byte read
+ * from it is 0xFF, so the zero byte at the top of the stack never comes back.
+ */
+void block_io_sim_corrupt_reads(size_t bus, size_t bus_tile, size_t read_count);
+
+/**
+ * Flips a random bit in roughly one out of every 'bytes_per_error' bytes read from the stacks, as
+ * if the bus were noisy. 0 turns this off. A flipped zero byte looks like a missing terminator.
+ */
+void block_io_sim_set_bit_error_rate(uint32_t bytes_per_error);
+
+/**
+ * Returns the LED data that a block was last sent: whatever byte it was left holding when its tile
+ * was deselected, or is holding now if the tile is still selected.
+ */
+uint8_t block_io_sim_get_led(size_t grid_tile, size_t height);
+
+/**
+ * Returns the core with the transfer interrupt set up (see block_io_port_claim_transfer_irq()),
+ * or -1 if neither has.
+ */
+int block_io_sim_get_transfer_irq_core();
+
+#endif /* BLOCK_IO_SIM_H */
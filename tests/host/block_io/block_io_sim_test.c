@@ -0,0 +1,605 @@
+#include "block_io.h"
+#include "block_io_port.h"
+#include "block_io_sim.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Scans grids of more and more chained boards on the simulated buses, checking that every block is
+// read correctly and measuring the scan time and memory used. The grids are then spread across
+// several buses, which should keep the DMA scan time from growing with the number of boards.
+
+typedef struct
+{
+    size_t tile_count;
+    size_t height_limit;
+} grid_size_t;
+
+static const grid_size_t grid_sizes[] = {
+    { 1 * BLOCK_IO_TILES_PER_BOARD, 16 },
+    { 2 * BLOCK_IO_TILES_PER_BOARD, 16 },
+    { 4 * BLOCK_IO_TILES_PER_BOARD, 16 },
+    { 8 * BLOCK_IO_TILES_PER_BOARD, 16 },
+    { 16 * BLOCK_IO_TILES_PER_BOARD, 8 },
+    { 28 * BLOCK_IO_TILES_PER_BOARD, 8 },
+};
+#define GRID_SIZE_COUNT (sizeof(grid_sizes) / sizeof(grid_sizes[0]))
+
+static uint8_t expected_blocks[BLOCK_IO_MAX_TILE_COUNT][BLOCK_IO_MAX_HEIGHT_LIMIT];
+static size_t expected_heights[BLOCK_IO_MAX_TILE_COUNT];
+static unsigned int failures = 0;
+
+static unsigned int random_state = 2024;
+
+static unsigned int next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) & 0x7FFF;
+}
+
+// Puts random stacks on every tile, including some that reach the height limit:
+static void build_grid(const grid_size_t *size)
+{
+    block_io_sim_clear();
+
+    for (size_t grid_tile = 0; grid_tile < size->tile_count; grid_tile++)
+    {
+        // Each block sends its rotation relative to the one below, and block_io should work out
+        // the absolute rotation:
+        uint8_t raw_blocks[BLOCK_IO_MAX_HEIGHT_LIMIT];
+        uint8_t rotation = 0;
+        size_t height = next_random() % (size->height_limit + 1);
+        for (size_t y = 0; y < height; y++)
+        {
+            uint8_t block_id = (1 + next_random() % 63) << 2;
+            uint8_t relative_rotation = next_random() % 4;
+            rotation = (rotation + relative_rotation) & 0x03;
+            raw_blocks[y] = block_id | relative_rotation;
+            expected_blocks[grid_tile][y] = block_id | rotation;
+        }
+        expected_heights[grid_tile] = height;
+        block_io_sim_set_grid_stack(grid_tile, raw_blocks, height);
+    }
+}
+
+static bool is_stack_expected(size_t grid_tile)
+{
+    bool is_correct = block_io_get_stack_height(grid_tile) == expected_heights[grid_tile];
+    for (size_t y = 0; y < expected_heights[grid_tile] && is_correct; y++)
+    {
+        is_correct = block_io_get_block(grid_tile, y) == expected_blocks[grid_tile][y];
+    }
+    return is_correct;
+}
+
+static void check_grid(const grid_size_t *size, const char *scan_type)
+{
+    if (block_io_is_corrupted())
+    {
+        printf("  FAIL: %s scan of %zu tiles was corrupted\n", scan_type, size->tile_count);
+        failures++;
+        return;
+    }
+
+    for (size_t grid_tile = 0; grid_tile < size->tile_count; grid_tile++)
+    {
+        if (!is_stack_expected(grid_tile))
+        {
+            printf("  FAIL: %s scan of %zu tiles read tile %zu wrong\n", scan_type, size->tile_count, grid_tile);
+            failures++;
+            return;
+        }
+    }
+}
+
+static void scan_async()
+{
+    block_io_update_async(NULL);
+    while (block_io_is_scanning())
+    {
+        block_io_port_wait_for_event();
+    }
+}
+
+// Returns the DMA scan time of the biggest grid.
+static uint32_t measure_grids()
+{
+    uint32_t dma_time_us = 0;
+    printf("%6s %6s %6s %8s %12s %12s\n", "boards", "tiles", "height", "memory", "blocking", "DMA");
+
+    for (size_t i = 0; i < GRID_SIZE_COUNT; i++)
+    {
+        const grid_size_t *size = &grid_sizes[i];
+        if (!block_io_set_grid_size(size->tile_count, size->height_limit))
+        {
+            printf("  FAIL: couldn't set the grid size to %zu x %zu\n", size->tile_count, size->height_limit);
+            failures++;
+            continue;
+        }
+        build_grid(size);
+
+        block_io_update();
+        check_grid(size, "blocking");
+        uint32_t blocking_time_us = block_io_get_scan_time_us();
+
+        scan_async();
+        check_grid(size, "DMA");
+        dma_time_us = block_io_get_scan_time_us();
+
+        printf("%6zu %6zu %6zu %8zu %9u us %9u us\n",
+            size->tile_count / BLOCK_IO_TILES_PER_BOARD, size->tile_count, size->height_limit,
+            block_io_get_memory_used(), blocking_time_us, dma_time_us);
+    }
+
+    return dma_time_us;
+}
+
+static void scan(bool is_async)
+{
+    if (is_async)
+    {
+        scan_async();
+    }
+    else
+    {
+        block_io_update();
+    }
+}
+
+// A stack that fails to answer should be read again straight away. If it keeps failing, it should
+// keep its last good data while the rest of the grid is read as normal.
+static void test_retries(bool is_async)
+{
+    const grid_size_t size = { 2 * BLOCK_IO_TILES_PER_BOARD, 16 };
+    const char *scan_type = is_async ? "DMA" : "blocking";
+    const size_t bad_tile = 5;
+
+    block_io_set_bus_count(1);
+    block_io_set_grid_size(size.tile_count, size.height_limit);
+    build_grid(&size);
+    scan(is_async);
+
+    // A single bad read is put right within the same scan:
+    uint32_t error_count = block_io_get_tile_error_count(bad_tile);
+    block_io_sim_corrupt_reads(0, bad_tile, 1);
+    scan(is_async);
+    check_grid(&size, scan_type);
+    if (block_io_get_tile_error_count(bad_tile) != error_count + 1)
+    {
+        printf("  FAIL: %s scan didn't count the retried read\n", scan_type);
+        failures++;
+    }
+
+    // Change the stack while it keeps failing. The old stack should still be reported:
+    uint8_t new_blocks[] = { 0x04, 0x08 };
+    block_io_sim_set_stack(0, bad_tile, new_blocks, sizeof(new_blocks));
+    block_io_sim_corrupt_reads(0, bad_tile, 100);
+    scan(is_async);
+
+    bool is_rest_correct = true;
+    for (size_t grid_tile = 0; grid_tile < size.tile_count; grid_tile++)
+    {
+        is_rest_correct &= is_stack_expected(grid_tile) && block_io_is_tile_corrupted(grid_tile) == (grid_tile == bad_tile);
+    }
+    if (!block_io_is_corrupted() || !is_rest_correct)
+    {
+        printf("  FAIL: %s scan didn't keep the last good data of a corrupted stack\n", scan_type);
+        failures++;
+    }
+
+    // Once it answers again, the new stack should be read:
+    block_io_sim_corrupt_reads(0, bad_tile, 0);
+    scan(is_async);
+    expected_heights[bad_tile] = sizeof(new_blocks);
+    memcpy(expected_blocks[bad_tile], new_blocks, sizeof(new_blocks));
+    check_grid(&size, scan_type);
+}
+
+// The scan period should speed up while blocks are changing, and slow down once they've been left
+// alone, more so with no device connected.
+static void test_scan_policy()
+{
+    const block_io_scan_policy_t policy = {
+        .active_period_us = 10000,
+        .active_hold_us = 1000000,
+        .connected_period_us = 50000,
+        .idle_period_us = 200000
+    };
+    const grid_size_t size = { BLOCK_IO_TILES_PER_BOARD, 16 };
+    block_io_set_scan_policy(&policy);
+    block_io_set_grid_size(size.tile_count, size.height_limit);
+    build_grid(&size);
+
+    // A new grid is full of changes:
+    block_io_update();
+    uint32_t first_period_us = block_io_get_scan_period_us();
+
+    // Still active just before the hold time runs out:
+    block_io_port_sleep_until(block_io_port_get_time_us() + policy.active_hold_us / 2);
+    block_io_update();
+    uint32_t held_period_us = block_io_get_scan_period_us();
+
+    block_io_port_sleep_until(block_io_port_get_time_us() + policy.active_hold_us);
+    block_io_update();
+    uint32_t idle_period_us = block_io_get_scan_period_us();
+
+    block_io_set_host_connected(true);
+    block_io_update();
+    uint32_t connected_period_us = block_io_get_scan_period_us();
+
+    uint8_t new_block = 0x04;
+    block_io_sim_set_stack(0, 0, &new_block, 1);
+    block_io_update();
+    uint32_t changed_period_us = block_io_get_scan_period_us();
+
+    if (first_period_us != policy.active_period_us || held_period_us != policy.active_period_us
+        || idle_period_us != policy.idle_period_us || connected_period_us != policy.connected_period_us
+        || changed_period_us != policy.active_period_us)
+    {
+        printf("FAIL: scan periods were %u, %u, %u, %u and %u us\n", first_period_us, held_period_us,
+            idle_period_us, connected_period_us, changed_period_us);
+        failures++;
+    }
+}
+
+// A stack taller than the height limit never sends back its zero byte, so it should be treated as
+// corrupted. Random bit errors should be counted without upsetting anything once they stop.
+static void test_bad_data()
+{
+    const grid_size_t size = { BLOCK_IO_TILES_PER_BOARD, 8 };
+    const size_t tall_tile = 3;
+
+    block_io_set_grid_size(size.tile_count, size.height_limit);
+    build_grid(&size);
+    block_io_update();
+
+    uint8_t tall_stack[9] = { 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 };
+    block_io_sim_set_stack(0, tall_tile, tall_stack, sizeof(tall_stack));
+    block_io_update();
+    if (!block_io_is_tile_corrupted(tall_tile) || !is_stack_expected(tall_tile))
+    {
+        printf("FAIL: a stack taller than the height limit wasn't treated as corrupted\n");
+        failures++;
+    }
+    block_io_sim_set_stack(0, tall_tile, tall_stack, expected_heights[tall_tile]);
+    memset(expected_blocks[tall_tile], 0x04, expected_heights[tall_tile]);
+    block_io_update();
+
+    // No block has an ID of zero, so one must be a bit error. Turned by the block below, it would
+    // otherwise be stored as 0x00, which looks like no block at all:
+    uint8_t zero_id_stack[3] = { 0x05, 0x03, 0x04 };
+    block_io_sim_set_stack(0, tall_tile, zero_id_stack, sizeof(zero_id_stack));
+    block_io_update();
+    if (!block_io_is_tile_corrupted(tall_tile) || !is_stack_expected(tall_tile))
+    {
+        printf("FAIL: a block with an ID of zero wasn't treated as corrupted\n");
+        failures++;
+    }
+    block_io_sim_set_stack(0, tall_tile, tall_stack, expected_heights[tall_tile]);
+
+    uint32_t error_count = 0;
+    block_io_sim_set_bit_error_rate(50);
+    for (size_t i = 0; i < 20; i++)
+    {
+        block_io_update();
+        scan_async();
+    }
+    block_io_sim_set_bit_error_rate(0);
+
+    for (size_t grid_tile = 0; grid_tile < size.tile_count; grid_tile++)
+    {
+        error_count += block_io_get_tile_error_count(grid_tile);
+    }
+    if (error_count == 0)
+    {
+        printf("FAIL: no errors were counted on a noisy bus\n");
+        failures++;
+    }
+
+    block_io_update();
+    check_grid(&size, "blocking");
+}
+
+// Completion is checked against the target a stack at a time, once it has been committed, and the
+// structure hash should only change when the structure does.
+static void test_completion()
+{
+    const grid_size_t size = { BLOCK_IO_TILES_PER_BOARD, 16 };
+    block_io_set_grid_size(size.tile_count, size.height_limit);
+    build_grid(&size);
+
+    block_io_clear_target_structure();
+    for (size_t grid_tile = 0; grid_tile < size.tile_count; grid_tile++)
+    {
+        for (size_t y = 0; y < expected_heights[grid_tile]; y++)
+        {
+            // Blocks whose lower ID bits are zero look the same whichever way they're turned:
+            uint8_t block = expected_blocks[grid_tile][y];
+            if ((block & 0x0C) == 0x00)
+            {
+                block ^= 0x02;
+            }
+            block_io_set_target_block(grid_tile, y, block);
+        }
+    }
+
+    // Nothing changes until the staged target is committed:
+    block_io_update();
+    bool is_staged_ignored = !block_io_is_complete();
+    block_io_commit_target_structure();
+
+    block_io_update();
+    bool is_complete = block_io_is_complete();
+    uint32_t hash = block_io_get_structure_hash();
+    block_io_update();
+    bool is_hash_steady = block_io_get_structure_hash() == hash;
+
+    uint8_t new_block = 0x04;
+    block_io_sim_set_grid_stack(0, &new_block, 1);
+    block_io_update();
+
+    if (!is_staged_ignored || !is_complete || !is_hash_steady || block_io_is_complete() || block_io_get_structure_hash() == hash)
+    {
+        printf("FAIL: completion or the structure hash was wrong\n");
+        failures++;
+    }
+}
+
+// No change events should be produced until they're enabled, and then only for what changed.
+static void test_change_events()
+{
+    const grid_size_t size = { BLOCK_IO_TILES_PER_BOARD, 16 };
+    block_io_set_grid_size(size.tile_count, size.height_limit);
+    build_grid(&size);
+    block_io_update();
+
+    block_io_event_t event;
+    if (block_io_get_change_event(&event) || block_io_has_lost_change_events())
+    {
+        printf("FAIL: change events were produced before they were enabled\n");
+        failures++;
+    }
+
+    block_io_enable_change_events();
+    uint8_t new_blocks[] = { 0x04, 0x08 };
+    block_io_sim_set_grid_stack(2, new_blocks, sizeof(new_blocks));
+    block_io_update();
+
+    size_t event_count = 0;
+    bool is_correct = true;
+    while (block_io_get_change_event(&event))
+    {
+        if (event.type == BLOCK_IO_EVENT_BLOCK_CHANGED)
+        {
+            size_t y = event.height;
+            uint8_t old_block = y < expected_heights[2] ? expected_blocks[2][y] : 0x00;
+            uint8_t new_block = y < sizeof(new_blocks) ? new_blocks[y] : 0x00;
+            is_correct &= event.grid_tile == 2 && event.old_block == old_block && event.new_block == new_block
+                && old_block != new_block;
+            event_count++;
+        }
+    }
+    if (event_count == 0 || !is_correct)
+    {
+        printf("FAIL: change events didn't describe the changed stack\n");
+        failures++;
+    }
+    expected_heights[2] = sizeof(new_blocks);
+    memcpy(expected_blocks[2], new_blocks, sizeof(new_blocks));
+}
+
+// Checks that every block on the grid shows 'colour', apart from 'special_tile' which shows
+// 'special_colour' on its bottom block:
+static bool are_leds(uint8_t colour, size_t special_tile, uint8_t special_colour)
+{
+    bool is_correct = true;
+    for (size_t grid_tile = 0; grid_tile < block_io_get_tile_count(); grid_tile++)
+    {
+        for (size_t y = 0; y < expected_heights[grid_tile]; y++)
+        {
+            uint8_t expected = grid_tile == special_tile && y == 0 ? special_colour : colour;
+            is_correct &= block_io_sim_get_led(grid_tile, y) == expected;
+        }
+    }
+    return is_correct;
+}
+
+// The LEDs should be refreshed from the frame buffer and animations without reading the grid, with
+// a block's own LED taking over from the LED mode and a grid animation taking over from both.
+static void test_leds()
+{
+    const grid_size_t size = { 2 * BLOCK_IO_TILES_PER_BOARD, 16 };
+    block_io_set_grid_size(size.tile_count, size.height_limit);
+    build_grid(&size);
+
+    size_t special_tile = 0;
+    while (expected_heights[special_tile] == 0)
+    {
+        special_tile++;
+    }
+
+    // Nothing matches the empty target:
+    block_io_update();
+    if (!are_leds(LED_COLOUR_RED, special_tile, LED_COLOUR_RED))
+    {
+        printf("FAIL: a scan didn't send the LED mode\n");
+        failures++;
+    }
+
+    scan_async();
+    block_io_set_led_mode(GREEN);
+    block_io_set_block_led(special_tile, 0, LED_COLOUR_RED, LED_ANIMATION_NONE);
+    uint64_t start_us = block_io_port_get_time_us();
+    block_io_refresh_leds();
+    uint32_t refresh_time_us = block_io_port_get_time_us() - start_us;
+    printf("\nLED refresh of %zu tiles: %u us, against %u us for a DMA scan\n", size.tile_count,
+        refresh_time_us, block_io_get_scan_time_us());
+    if (!are_leds(LED_COLOUR_GREEN, special_tile, LED_COLOUR_RED))
+    {
+        printf("FAIL: an LED refresh didn't send the LED mode and block LEDs\n");
+        failures++;
+    }
+
+    // Flashes red for the first half of each period, and then goes back to normal:
+    block_io_set_led_animation(RED, LED_ANIMATION_FLASH, 400, 1000);
+    block_io_refresh_leds();
+    bool is_lit = are_leds(LED_COLOUR_RED, special_tile, LED_COLOUR_RED);
+    block_io_port_sleep_until(block_io_port_get_time_us() + 250000);
+    block_io_refresh_leds();
+    bool is_unlit = are_leds(LED_COLOUR_OFF, special_tile, LED_COLOUR_OFF);
+    block_io_port_sleep_until(block_io_port_get_time_us() + 1000000);
+    block_io_refresh_leds();
+    if (!is_lit || !is_unlit || !are_leds(LED_COLOUR_GREEN, special_tile, LED_COLOUR_RED))
+    {
+        printf("FAIL: the grid animation was wrong\n");
+        failures++;
+    }
+
+    // A pulsing block should be lit for some of the refreshes over its period, but not all:
+    block_io_set_block_led(special_tile, 0, LED_COLOUR_RED, LED_ANIMATION_PULSE);
+    size_t refresh_count = BLOCK_IO_BLOCK_LED_PERIOD_MS / 20;
+    size_t lit_count = 0;
+    for (size_t i = 0; i < refresh_count; i++)
+    {
+        block_io_refresh_leds();
+        lit_count += block_io_sim_get_led(special_tile, 0) == LED_COLOUR_RED;
+        block_io_port_sleep_until(block_io_port_get_time_us() + 20000);
+    }
+    if (lit_count == 0 || lit_count == refresh_count)
+    {
+        printf("FAIL: a pulsing block was lit for %zu of %zu refreshes\n", lit_count, refresh_count);
+        failures++;
+    }
+
+    block_io_clear_block_leds();
+    block_io_set_led_mode(TARGET);
+    block_io_update();
+    if (!are_leds(LED_COLOUR_RED, special_tile, LED_COLOUR_RED))
+    {
+        printf("FAIL: clearing the block LEDs didn't go back to the LED mode\n");
+        failures++;
+    }
+}
+
+// An empty grid reads the same at any rate, so calibration shouldn't trust it. Once there are tall
+// stacks to go by, a long run of clean scans should speed the bus up, and calibration should pick
+// the fastest rate straight away, since nothing is corrupted on the simulated bus.
+static uint32_t test_calibration()
+{
+    uint32_t slowest_rate = block_io_get_spi_baud_rate();
+    block_io_set_grid_size(BLOCK_IO_TILES_PER_BOARD, BLOCK_IO_DEFAULT_HEIGHT_LIMIT);
+    block_io_sim_clear();
+    if (block_io_calibrate_spi() != slowest_rate)
+    {
+        printf("FAIL: calibration on an empty grid didn't keep the slowest rate\n");
+        failures++;
+    }
+
+    uint8_t tall_stack[BLOCK_IO_DEFAULT_HEIGHT_LIMIT];
+    memset(tall_stack, 0x04, sizeof(tall_stack));
+    block_io_sim_set_grid_stack(4, tall_stack, sizeof(tall_stack));
+    size_t scan_count = 0;
+    while (block_io_get_spi_baud_rate() == slowest_rate && scan_count < 10000)
+    {
+        block_io_update();
+        scan_count++;
+    }
+    uint32_t stepped_up_rate = block_io_get_spi_baud_rate();
+    printf("Stepped up from %u Hz to %u Hz after %zu clean scans\n", slowest_rate, stepped_up_rate, scan_count);
+    if (stepped_up_rate == slowest_rate)
+    {
+        printf("FAIL: a long run of clean scans didn't speed up the bus\n");
+        failures++;
+    }
+
+    uint32_t calibrated_rate = block_io_calibrate_spi();
+    if (calibrated_rate <= stepped_up_rate)
+    {
+        printf("FAIL: calibration with a tall stack didn't pick a faster rate\n");
+        failures++;
+    }
+    return calibrated_rate;
+}
+
+// DMA scans and LED refreshes run before the scanner is started are finished by core 0's
+// interrupt. Starting the scanner must take it away from core 0, so that the scanning core can
+// have it, rather than both cores handling it. This leaves the scanner running, so do it last.
+static void test_scanner_handover()
+{
+    const grid_size_t size = { BLOCK_IO_TILES_PER_BOARD, 16 };
+    block_io_set_grid_size(size.tile_count, size.height_limit);
+    build_grid(&size);
+    scan_async();
+    block_io_refresh_leds();
+    int core_before = block_io_sim_get_transfer_irq_core();
+
+    block_io_start_scanner(NULL);
+    if (core_before != 0 || block_io_sim_get_transfer_irq_core() != -1)
+    {
+        printf("FAIL: the transfer interrupt was on core %d before the scanner started, and %d after\n",
+            core_before, block_io_sim_get_transfer_irq_core());
+        failures++;
+    }
+}
+
+int main()
+{
+    block_io_init();
+
+    printf("At %u Hz:\n", block_io_get_spi_baud_rate());
+    measure_grids();
+
+    printf("\n");
+    uint32_t calibrated_rate = test_calibration();
+    printf("\nAt %u Hz:\n", calibrated_rate);
+    uint32_t one_bus_time_us = measure_grids();
+
+    for (size_t bus_count = 2; bus_count <= BLOCK_IO_MAX_BUS_COUNT; bus_count++)
+    {
+        block_io_set_bus_count(bus_count);
+        printf("\nOn %zu buses:\n", bus_count);
+        uint32_t time_us = measure_grids();
+
+        // Each bus reads its share of the grid at the same time, so the biggest grid should take
+        // little more than its share of the time on one bus:
+        if (time_us > one_bus_time_us / bus_count + one_bus_time_us / 10)
+        {
+            printf("  FAIL: %u us on %zu buses, against %u us on one\n", time_us, bus_count, one_bus_time_us);
+            failures++;
+        }
+    }
+
+    if (block_io_set_bus_count(0) || block_io_set_bus_count(BLOCK_IO_MAX_BUS_COUNT + 1)
+        || block_io_get_bus_count() != BLOCK_IO_MAX_BUS_COUNT)
+    {
+        printf("FAIL: an invalid bus count was accepted\n");
+        failures++;
+    }
+
+    // Grids bigger than the limits must be refused, leaving the grid as it was:
+    if (block_io_set_grid_size(BLOCK_IO_MAX_TILE_COUNT + 1, 1)
+        || block_io_set_grid_size(1, BLOCK_IO_MAX_HEIGHT_LIMIT + 1)
+        || block_io_set_grid_size(BLOCK_IO_MAX_TILE_COUNT, BLOCK_IO_MAX_HEIGHT_LIMIT)
+        || block_io_get_tile_count() != grid_sizes[GRID_SIZE_COUNT - 1].tile_count)
+    {
+        printf("FAIL: a grid bigger than the limits was accepted\n");
+        failures++;
+    }
+
+    test_retries(false);
+    test_retries(true);
+    test_scan_policy();
+    test_bad_data();
+    test_completion();
+    test_change_events();
+    test_leds();
+    test_scanner_handover();
+
+    if (failures > 0)
+    {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include "bt_parser.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TARGET_BLOCK_COUNT 100
+#define WIDE_TARGET_BLOCK_COUNT 300
+#define RANDOM_SPLIT_RUNS 1000
+
+// Every handler call is written into the log as text, so that runs can be compared:
+static char log_buffer[16384];
+static size_t log_length;
+static size_t target_ends;
+
+static void log_event(const char *format, unsigned int a, unsigned int b, unsigned int c)
+{
+    log_length += snprintf(&log_buffer[log_length], sizeof(log_buffer) - log_length, format, a, b, c);
+}
+
+static void handle_set_leds(uint8_t led_mode) { log_event("leds %u\n", led_mode, 0, 0); }
+static void handle_play_audio(uint8_t audio_number) { log_event("audio %u\n", audio_number, 0, 0); }
+static void handle_signal_completion() { log_event("completion\n", 0, 0, 0); }
+static void handle_structure_ack(uint8_t sequence) { log_event("ack %u\n", sequence, 0, 0); }
+static void handle_get_grid_size() { log_event("grid size\n", 0, 0, 0); }
+static void handle_load_puzzle(uint16_t puzzle_id) { log_event("puzzle %u\n", puzzle_id, 0, 0); }
+static void handle_set_features(uint8_t features) { log_event("features %u\n", features, 0, 0); }
+static void handle_target_begin(size_t block_count) { log_event("target %u\n", block_count, 0, 0); }
+static void handle_target_block(uint8_t grid_tile, uint8_t height, uint8_t block_data) { log_event("block %u %u %02x\n", grid_tile, height, block_data); }
+static void handle_target_end(bool is_valid) { log_event("end %u\n", is_valid, 0, 0); target_ends++; }
+
+static const bt_parser_handlers_t handlers = {
+    .set_leds = handle_set_leds,
+    .play_audio = handle_play_audio,
+    .signal_completion = handle_signal_completion,
+    .structure_ack = handle_structure_ack,
+    .get_grid_size = handle_get_grid_size,
+    .load_puzzle = handle_load_puzzle,
+    .set_features = handle_set_features,
+    .target_begin = handle_target_begin,
+    .target_block = handle_target_block,
+    .target_end = handle_target_end,
+};
+
+static uint8_t stream[2048];
+static size_t stream_length;
+
+static void add_byte(uint8_t byte)
+{
+    stream[stream_length++] = byte;
+}
+
+// Adds a small target structure followed by its checksum. If 'is_corrupted', a block byte is
+// changed after working out the checksum, as if it had been garbled on the way:
+static void add_checksummed_target(bool is_corrupted)
+{
+    size_t start = stream_length;
+    add_byte(BT_COMMAND_TARGET_STRUCTURE | BT_COMMAND_CHECKSUM);
+    add_byte(3);
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        add_byte(i);
+        add_byte(0x10 + 0x04 * i);
+    }
+
+    unsigned int sum1 = 0;
+    unsigned int sum2 = 0;
+    for (size_t i = start; i < stream_length; i++)
+    {
+        sum1 = (sum1 + stream[i]) % 255;
+        sum2 = (sum2 + sum1) % 255;
+    }
+    if (is_corrupted)
+    {
+        stream[stream_length - 1] ^= 0x04;
+    }
+    add_byte(sum2);
+    add_byte(sum1);
+}
+
+static void build_stream()
+{
+    add_byte(BT_COMMAND_SET_LEDS | 2);
+    add_byte(BT_COMMAND_PLAY_AUDIO | 5);
+    add_byte(BT_COMMAND_STRUCTURE_ACK);
+    add_byte(7);
+    add_byte(0xF0); // unrecognised command, should be skipped
+
+    // A large target structure:
+    add_byte(BT_COMMAND_TARGET_STRUCTURE);
+    add_byte(TARGET_BLOCK_COUNT);
+    for (unsigned int i = 0; i < TARGET_BLOCK_COUNT; i++)
+    {
+        add_byte(((i % 9) << 4) | (i / 9));
+        add_byte(0x04 * (i + 1));
+    }
+
+    // An empty target structure:
+    add_byte(BT_COMMAND_TARGET_STRUCTURE);
+    add_byte(0);
+
+    // A target structure for a grid of several boards, with two byte positions and count:
+    add_byte(BT_COMMAND_GET_GRID_SIZE);
+    add_byte(BT_COMMAND_TARGET_STRUCTURE | BT_COMMAND_WIDE);
+    add_byte(WIDE_TARGET_BLOCK_COUNT >> 8);
+    add_byte(WIDE_TARGET_BLOCK_COUNT & 0xFF);
+    for (unsigned int i = 0; i < WIDE_TARGET_BLOCK_COUNT; i++)
+    {
+        add_byte(i % 100);
+        add_byte(i / 100);
+        add_byte(0x04 * (i % 63 + 1));
+    }
+
+    add_checksummed_target(false);
+    add_checksummed_target(true);
+
+    add_byte(BT_COMMAND_LOAD_PUZZLE);
+    add_byte(0x01);
+    add_byte(0x2C);
+    add_byte(BT_COMMAND_SET_FEATURES | BT_FEATURE_COMPACT_STRUCTURE);
+
+    add_byte(BT_COMMAND_USER_SIGNAL_COMPLETION);
+    add_byte(BT_COMMAND_SET_LEDS | 3);
+}
+
+static unsigned int random_state = 12345;
+
+static unsigned int next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) & 0x7FFF;
+}
+
+// Feeds the whole stream through a new parser in chunks. A 'chunk_size' of zero uses random sizes.
+static void run(size_t chunk_size)
+{
+    bt_parser_t parser;
+    bt_parser_init(&parser, &handlers);
+    log_length = 0;
+    target_ends = 0;
+
+    size_t offset = 0;
+    while (offset < stream_length)
+    {
+        size_t length = (chunk_size > 0) ? chunk_size : 1 + next_random() % 16;
+        if (length > stream_length - offset)
+        {
+            length = stream_length - offset;
+        }
+        bt_parser_feed(&parser, &stream[offset], length);
+        offset += length;
+    }
+}
+
+int main()
+{
+    unsigned int failures = 0;
+
+    build_stream();
+
+    // Feeding the whole stream at once gives the reference log. It must apply the whole target
+    // structure in one call:
+    run(stream_length);
+    static char reference_log[sizeof(log_buffer)];
+    memcpy(reference_log, log_buffer, log_length + 1);
+
+    const char *expected_start = "leds 2\naudio 5\nack 7\ntarget 100\nblock 0 0 04\n";
+    const char *expected_wide = "grid size\ntarget 300\nblock 0 0 04\nblock 1 0 08\n";
+    const char *expected_wide_end = "block 99 2 c0\nend 1\n";
+    const char *expected_checksums = "block 0 2 18\nend 1\ntarget 3\nblock 0 0 10\nblock 0 1 14\nblock 0 2 1c\nend 0\npuzzle 300\nfeatures 1\ncompletion\n";
+    if (strncmp(reference_log, expected_start, strlen(expected_start)) != 0 || target_ends != 5
+        || strstr(reference_log, expected_wide) == NULL || strstr(reference_log, expected_wide_end) == NULL
+        || strstr(reference_log, expected_checksums) == NULL)
+    {
+        printf("FAIL: unexpected events when feeding the whole stream:\n%s", reference_log);
+        failures++;
+    }
+    printf("%zu bytes containing %u and %u block target structures parsed in a single call\n", stream_length, TARGET_BLOCK_COUNT, WIDE_TARGET_BLOCK_COUNT);
+
+    // Fixed chunk sizes:
+    size_t chunk_sizes[] = { 1, 2, 3, 7, 64 };
+    for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++)
+    {
+        run(chunk_sizes[i]);
+        if (strcmp(log_buffer, reference_log) != 0)
+        {
+            printf("FAIL: events differ when fed in chunks of %zu bytes\n", chunk_sizes[i]);
+            failures++;
+        }
+    }
+
+    // Random chunk sizes:
+    for (int i = 0; i < RANDOM_SPLIT_RUNS; i++)
+    {
+        run(0);
+        if (strcmp(log_buffer, reference_log) != 0)
+        {
+            printf("FAIL: events differ when fed in random chunks (run %d)\n", i);
+            failures++;
+            break;
+        }
+    }
+    printf("%d runs with random split points\n", RANDOM_SPLIT_RUNS);
+
+    if (failures > 0)
+    {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include "packed_stack.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Checks that comparing packed stacks a word at a time gives the same answers as comparing them a
+// block at a time, like block_io used to, and measures how long each takes for a big grid.
+
+#define TILE_COUNT 252
+#define HEIGHT_LIMIT 8
+#define STACK_WORD_COUNT PACKED_STACK_WORD_COUNT(HEIGHT_LIMIT)
+#define CASE_COUNT 100000
+#define TIMING_ROUNDS 2000
+
+typedef struct
+{
+    uint32_t words[STACK_WORD_COUNT];
+} stack_t;
+
+static stack_t stacks[TILE_COUNT];
+static stack_t targets[TILE_COUNT];
+static size_t heights[TILE_COUNT];
+static unsigned int failures = 0;
+
+static unsigned int random_state = 99;
+
+static unsigned int next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) & 0x7FFF;
+}
+
+static uint8_t *get_blocks(stack_t *stack)
+{
+    return (uint8_t *)stack->words;
+}
+
+// The block by block comparison that block_io used to do while scanning:
+static bool byte_stack_matches(const uint8_t *stack, size_t height, const uint8_t *target)
+{
+    for (size_t y = 0; y < height; y++)
+    {
+        uint8_t block_mask = 0xFC | ((stack[y] >> 2) & 0x03);
+        if ((stack[y] & block_mask) != (target[y] & block_mask))
+        {
+            return false;
+        }
+    }
+
+    return height == HEIGHT_LIMIT || target[height] == 0x00;
+}
+
+static uint8_t random_block()
+{
+    return ((1 + next_random() % 63) << 2) | (next_random() % 4);
+}
+
+// Makes a random stack and a target which is often the same, or differs from it slightly:
+static void build_case(size_t grid_tile)
+{
+    stack_t *stack = &stacks[grid_tile];
+    stack_t *target = &targets[grid_tile];
+    memset(stack, 0, sizeof(*stack));
+    memset(target, 0, sizeof(*target));
+
+    size_t height = next_random() % (HEIGHT_LIMIT + 1);
+    for (size_t y = 0; y < height; y++)
+    {
+        get_blocks(stack)[y] = random_block();
+    }
+    heights[grid_tile] = height;
+    memcpy(target, stack, sizeof(*target));
+
+    size_t y = next_random() % HEIGHT_LIMIT;
+    switch (next_random() % 5)
+    {
+        case 0: // a different rotation, which may or may not matter
+            if (height > 0)
+            {
+                get_blocks(target)[y % height] ^= 1 + next_random() % 3;
+            }
+            break;
+        case 1: // a different block
+            get_blocks(target)[y] = random_block();
+            break;
+        case 2: // a different height
+            if (height > 0 && next_random() % 2)
+            {
+                get_blocks(target)[height - 1] = 0x00;
+            }
+            else if (height < HEIGHT_LIMIT)
+            {
+                get_blocks(target)[height] = random_block();
+            }
+            break;
+        default: // the same
+            break;
+    }
+
+    // Keep the target a proper stack, with nothing above an empty position:
+    for (size_t i = 1; i < HEIGHT_LIMIT; i++)
+    {
+        if (get_blocks(target)[i - 1] == 0x00)
+        {
+            get_blocks(target)[i] = 0x00;
+        }
+    }
+}
+
+static void test_matches()
+{
+    size_t match_count = 0;
+    for (size_t i = 0; i < CASE_COUNT; i++)
+    {
+        build_case(0);
+        bool expected = byte_stack_matches(get_blocks(&stacks[0]), heights[0], get_blocks(&targets[0]));
+        bool actual = packed_stack_matches(stacks[0].words, targets[0].words, STACK_WORD_COUNT);
+        match_count += expected;
+
+        if (actual != expected)
+        {
+            printf("FAIL: case %zu gave %d instead of %d\n", i, actual, expected);
+            failures++;
+            return;
+        }
+    }
+    printf("%zu of %u random stacks matched their target\n", match_count, CASE_COUNT);
+}
+
+// The hash of a structure can be updated a stack at a time, and should change with any block:
+static void test_hash()
+{
+    uint32_t hash = 0;
+    for (size_t grid_tile = 0; grid_tile < TILE_COUNT; grid_tile++)
+    {
+        build_case(grid_tile);
+        hash ^= packed_stack_hash(grid_tile, stacks[grid_tile].words, STACK_WORD_COUNT);
+    }
+
+    size_t unchanged_count = 0;
+    for (size_t i = 0; i < CASE_COUNT; i++)
+    {
+        size_t grid_tile = next_random() % TILE_COUNT;
+        uint32_t old_stack_hash = packed_stack_hash(grid_tile, stacks[grid_tile].words, STACK_WORD_COUNT);
+        get_blocks(&stacks[grid_tile])[next_random() % HEIGHT_LIMIT] = random_block();
+        uint32_t new_stack_hash = packed_stack_hash(grid_tile, stacks[grid_tile].words, STACK_WORD_COUNT);
+
+        uint32_t new_hash = hash ^ old_stack_hash ^ new_stack_hash;
+        unchanged_count += new_hash == hash && old_stack_hash != new_stack_hash;
+        hash = new_hash;
+    }
+
+    uint32_t full_hash = 0;
+    for (size_t grid_tile = 0; grid_tile < TILE_COUNT; grid_tile++)
+    {
+        full_hash ^= packed_stack_hash(grid_tile, stacks[grid_tile].words, STACK_WORD_COUNT);
+    }
+
+    if (full_hash != hash || unchanged_count > 0)
+    {
+        printf("FAIL: the structure hash didn't follow the changes\n");
+        failures++;
+    }
+}
+
+static double get_host_time_s()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Checks the completion of a whole grid of stacks both ways:
+static void measure()
+{
+    for (size_t grid_tile = 0; grid_tile < TILE_COUNT; grid_tile++)
+    {
+        build_case(grid_tile);
+        memcpy(&targets[grid_tile], &stacks[grid_tile], sizeof(stack_t));
+    }
+
+    volatile size_t match_count = 0;
+
+    double start_s = get_host_time_s();
+    for (size_t round = 0; round < TIMING_ROUNDS; round++)
+    {
+        for (size_t grid_tile = 0; grid_tile < TILE_COUNT; grid_tile++)
+        {
+            match_count += byte_stack_matches(get_blocks(&stacks[grid_tile]), heights[grid_tile], get_blocks(&targets[grid_tile]));
+        }
+    }
+    double byte_time_s = get_host_time_s() - start_s;
+
+    start_s = get_host_time_s();
+    for (size_t round = 0; round < TIMING_ROUNDS; round++)
+    {
+        for (size_t grid_tile = 0; grid_tile < TILE_COUNT; grid_tile++)
+        {
+            match_count += packed_stack_matches(stacks[grid_tile].words, targets[grid_tile].words, STACK_WORD_COUNT);
+        }
+    }
+    double packed_time_s = get_host_time_s() - start_s;
+
+    printf("Per grid of %u tiles x %u blocks:\n", TILE_COUNT, HEIGHT_LIMIT);
+    printf("  completion: %.2f us block by block, %.2f us a word at a time\n",
+        byte_time_s * 1e6 / TIMING_ROUNDS, packed_time_s * 1e6 / TIMING_ROUNDS);
+}
+
+int main()
+{
+    test_matches();
+    test_hash();
+    measure();
+
+    if (failures > 0)
+    {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}
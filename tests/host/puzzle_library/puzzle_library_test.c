@@ -0,0 +1,194 @@
+#include "block_io.h"
+#include "block_io_sim.h"
+#include "puzzle_library.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Builds a puzzle library in memory, loads puzzles from it as the target structure and checks them
+// against matching grids on the simulated block bus. Broken libraries and puzzles that don't fit
+// the grid must leave the target alone.
+
+#define PUZZLE_COUNT 3
+#define BT_BAUD_RATE 9600
+
+typedef struct
+{
+    uint8_t data[4096];
+    size_t size;
+    size_t fail_after_reads; // 0 never fails
+    size_t read_count;
+} library_t;
+
+typedef struct
+{
+    size_t tile_count;
+    uint8_t heights[BLOCK_IO_MAX_TILE_COUNT];
+    uint8_t blocks[BLOCK_IO_MAX_TILE_COUNT][BLOCK_IO_MAX_HEIGHT_LIMIT];
+} puzzle_t;
+
+static library_t library;
+static puzzle_t puzzles[PUZZLE_COUNT];
+static unsigned int failures = 0;
+
+static unsigned int random_state = 99;
+
+static unsigned int next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) & 0x7FFF;
+}
+
+static bool read_library(void *context, uint32_t offset, void *buffer, size_t length)
+{
+    library_t *library = context;
+    library->read_count++;
+    if ((library->fail_after_reads > 0 && library->read_count > library->fail_after_reads)
+        || offset + length > library->size)
+    {
+        return false;
+    }
+    memcpy(buffer, &library->data[offset], length);
+    return true;
+}
+
+static void add_uint16(uint8_t *data, uint16_t value)
+{
+    data[0] = value & 0xFF;
+    data[1] = value >> 8;
+}
+
+static void add_uint32(uint8_t *data, uint32_t value)
+{
+    add_uint16(&data[0], value & 0xFFFF);
+    add_uint16(&data[2], value >> 16);
+}
+
+// Makes a puzzle with random stacks, with every block facing forwards so that the simulated blocks
+// send exactly the target data:
+static void make_puzzle(puzzle_t *puzzle, size_t tile_count, size_t height_limit)
+{
+    puzzle->tile_count = tile_count;
+    for (size_t grid_tile = 0; grid_tile < tile_count; grid_tile++)
+    {
+        puzzle->heights[grid_tile] = next_random() % (height_limit + 1);
+        for (size_t y = 0; y < puzzle->heights[grid_tile]; y++)
+        {
+            puzzle->blocks[grid_tile][y] = (1 + next_random() % 63) << 2;
+        }
+    }
+}
+
+// Writes the puzzles into the library, in the format described in puzzle_library.h. Returns the
+// number of bytes used by each puzzle in 'sizes':
+static void write_library(size_t sizes[PUZZLE_COUNT])
+{
+    memcpy(library.data, "BCPL", 4);
+    library.data[4] = PUZZLE_LIBRARY_VERSION;
+    library.data[5] = 0;
+    add_uint16(&library.data[6], PUZZLE_COUNT);
+
+    size_t offset = PUZZLE_LIBRARY_HEADER_SIZE + PUZZLE_COUNT * PUZZLE_LIBRARY_INDEX_ENTRY_SIZE;
+    for (size_t i = 0; i < PUZZLE_COUNT; i++)
+    {
+        const puzzle_t *puzzle = &puzzles[i];
+        size_t start = offset;
+
+        add_uint16(&library.data[offset], puzzle->tile_count);
+        offset += 2;
+        memcpy(&library.data[offset], puzzle->heights, puzzle->tile_count);
+        offset += puzzle->tile_count;
+        for (size_t grid_tile = 0; grid_tile < puzzle->tile_count; grid_tile++)
+        {
+            memcpy(&library.data[offset], puzzle->blocks[grid_tile], puzzle->heights[grid_tile]);
+            offset += puzzle->heights[grid_tile];
+        }
+
+        sizes[i] = offset - start;
+        uint8_t *index_entry = &library.data[PUZZLE_LIBRARY_HEADER_SIZE + i * PUZZLE_LIBRARY_INDEX_ENTRY_SIZE];
+        add_uint32(&index_entry[0], start);
+        add_uint32(&index_entry[4], sizes[i]);
+    }
+    library.size = offset;
+}
+
+// Puts a puzzle's stacks on the simulated grid, with the rest of the grid empty:
+static void build_grid(const puzzle_t *puzzle)
+{
+    block_io_sim_clear();
+    for (size_t grid_tile = 0; grid_tile < puzzle->tile_count; grid_tile++)
+    {
+        block_io_sim_set_grid_stack(grid_tile, puzzle->blocks[grid_tile], puzzle->heights[grid_tile]);
+    }
+}
+
+static bool load(uint16_t puzzle_id)
+{
+    library.read_count = 0;
+    return puzzle_library_load_from(read_library, &library, puzzle_id);
+}
+
+static void check(bool is_correct, const char *message)
+{
+    if (!is_correct)
+    {
+        printf("FAIL: %s\n", message);
+        failures++;
+    }
+}
+
+int main()
+{
+    block_io_init();
+    block_io_set_grid_size(4 * BLOCK_IO_TILES_PER_BOARD, 8);
+
+    make_puzzle(&puzzles[0], 4 * BLOCK_IO_TILES_PER_BOARD, 8);
+    make_puzzle(&puzzles[1], 2 * BLOCK_IO_TILES_PER_BOARD, 8);
+    make_puzzle(&puzzles[2], 8 * BLOCK_IO_TILES_PER_BOARD, 4); // too big for the grid
+    size_t sizes[PUZZLE_COUNT];
+    write_library(sizes);
+
+    // Each puzzle should be complete on its own grid, and not on the other's:
+    for (size_t i = 0; i < 2; i++)
+    {
+        check(load(i), "a puzzle that fits the grid wasn't loaded");
+        build_grid(&puzzles[i]);
+        block_io_update();
+        check(block_io_is_complete(), "a loaded puzzle didn't match its grid");
+        build_grid(&puzzles[1 - i]);
+        block_io_update();
+        check(!block_io_is_complete(), "a loaded puzzle matched the wrong grid");
+
+        size_t block_count = sizes[i] - 2 - puzzles[i].tile_count;
+        size_t bt_bytes = 3 + 3 * block_count; // a wide target structure command
+        printf("Puzzle %zu: %zu blocks in %zu bytes, instead of %zu bytes (%zu ms) over bluetooth\n", i,
+            block_count, sizes[i], bt_bytes, bt_bytes * 10 * 1000 / BT_BAUD_RATE);
+    }
+
+    // None of these should change the target, so puzzle 1 should still be complete:
+    build_grid(&puzzles[1]);
+    check(!load(2), "a puzzle bigger than the grid was loaded");
+    check(!load(PUZZLE_COUNT), "a puzzle past the end of the library was loaded");
+
+    // Fail part way through the blocks. Whatever was staged should be thrown away, even if the
+    // target is committed afterwards:
+    library.fail_after_reads = 5;
+    check(!load(0), "a puzzle was loaded despite a read error");
+    library.fail_after_reads = 0;
+    block_io_commit_target_structure();
+
+    library.data[0] = 'X';
+    check(!load(0), "a library with the wrong magic number was loaded");
+    library.data[0] = 'B';
+
+    block_io_update();
+    check(block_io_is_complete(), "a failed load changed the target structure");
+
+    if (failures > 0)
+    {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include "scheduler.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Simulated version of the main loop in blockcraft_base.c. Time only moves when a task "does
+// work" or when the loop sleeps until the next deadline or interrupt.
+
+#define RX_PERIOD_US 1000
+#define SCAN_PERIOD_US 50000
+#define FAST_SCAN_PERIOD_US 10000
+#define SCAN_DURATION_US 3000
+#define SEND_DURATION_US 500
+#define RUN_TIME_US 2000000
+#define COMMAND_COUNT 40
+#define IRQ_COUNT 40
+
+static uint64_t now_us = 0;
+
+static uint64_t get_time_us()
+{
+    return now_us;
+}
+
+static int send_task_id;
+static int irq_task_id;
+static int scan_task_id;
+
+// Commands "arrive" at these times, and are handled by the next run of the RX task:
+static uint64_t command_times[COMMAND_COUNT];
+static size_t commands_arrived = 0;
+static size_t commands_handled = 0;
+static uint64_t max_command_latency_us = 0;
+
+// An interrupt signals irq_task at these times:
+static uint64_t irq_times[IRQ_COUNT];
+static size_t irqs_raised = 0;
+static size_t irqs_handled = 0;
+static uint64_t max_irq_latency_us = 0;
+
+static uint64_t scan_times[200];
+static size_t scan_count = 0;
+static size_t send_count = 0;
+
+static void rx_task()
+{
+    while (commands_handled < commands_arrived)
+    {
+        uint64_t latency = now_us - command_times[commands_handled];
+        if (latency > max_command_latency_us)
+        {
+            max_command_latency_us = latency;
+        }
+        commands_handled++;
+    }
+}
+
+static void scan_task()
+{
+    scan_times[scan_count++] = now_us;
+    now_us += SCAN_DURATION_US;
+    scheduler_signal(send_task_id);
+}
+
+static void send_task()
+{
+    send_count++;
+    now_us += SEND_DURATION_US;
+}
+
+static void irq_task()
+{
+    while (irqs_handled < irqs_raised)
+    {
+        uint64_t latency = now_us - irq_times[irqs_handled];
+        if (latency > max_irq_latency_us)
+        {
+            max_irq_latency_us = latency;
+        }
+        irqs_handled++;
+    }
+}
+
+static unsigned int random_state = 4321;
+
+static unsigned int next_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 8) & 0xFFFFFF;
+}
+
+// Delivers any commands and interrupts that should have happened by now:
+static void deliver_events()
+{
+    while (commands_arrived < COMMAND_COUNT && command_times[commands_arrived] <= now_us)
+    {
+        commands_arrived++;
+    }
+    while (irqs_raised < IRQ_COUNT && irq_times[irqs_raised] <= now_us)
+    {
+        irqs_raised++;
+        scheduler_signal(irq_task_id);
+    }
+}
+
+static uint64_t next_event_time()
+{
+    uint64_t next = SCHEDULER_NO_DEADLINE;
+    if (commands_arrived < COMMAND_COUNT)
+    {
+        next = command_times[commands_arrived];
+    }
+    if (irqs_raised < IRQ_COUNT && irq_times[irqs_raised] < next)
+    {
+        next = irq_times[irqs_raised];
+    }
+    return next;
+}
+
+static void run_until(uint64_t end_us)
+{
+    while (now_us < end_us)
+    {
+        deliver_events();
+        uint64_t next_deadline = scheduler_run();
+        deliver_events();
+
+        // Sleep until the next deadline, unless an interrupt happens first:
+        uint64_t wake = next_deadline;
+        uint64_t next_event = next_event_time();
+        if (next_event < wake)
+        {
+            wake = next_event;
+        }
+        if (wake > now_us)
+        {
+            now_us = wake;
+        }
+    }
+}
+
+int main()
+{
+    unsigned int failures = 0;
+
+    // Spread the commands and interrupts randomly over the run, in order:
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+    {
+        command_times[i] = (i * RUN_TIME_US + next_random() % RUN_TIME_US) / COMMAND_COUNT;
+    }
+    for (size_t i = 0; i < IRQ_COUNT; i++)
+    {
+        irq_times[i] = (i * RUN_TIME_US + next_random() % RUN_TIME_US) / IRQ_COUNT;
+    }
+
+    scheduler_init(get_time_us);
+    scheduler_add_task(rx_task, RX_PERIOD_US);
+    irq_task_id = scheduler_add_task(irq_task, 0);
+    scan_task_id = scheduler_add_task(scan_task, SCAN_PERIOD_US);
+    send_task_id = scheduler_add_task(send_task, 0);
+
+    // First half at the normal scan period:
+    run_until(RUN_TIME_US / 2);
+    size_t slow_scans = scan_count;
+
+    // Second half scanning faster:
+    scheduler_set_period(scan_task_id, FAST_SCAN_PERIOD_US);
+    run_until(RUN_TIME_US);
+
+    printf("%zu scans (%zu at %u us, %zu at %u us), %zu structure sends\n",
+        scan_count, slow_scans, SCAN_PERIOD_US, scan_count - slow_scans, FAST_SCAN_PERIOD_US, send_count);
+    printf("%zu commands, worst latency %llu us\n", commands_handled, (unsigned long long)max_command_latency_us);
+    printf("%zu interrupts, worst latency %llu us\n", irqs_handled, (unsigned long long)max_irq_latency_us);
+
+    // Scans should keep to their period without drifting, even though each one takes time:
+    for (size_t i = 1; i < slow_scans; i++)
+    {
+        if (scan_times[i] != i * SCAN_PERIOD_US)
+        {
+            printf("FAIL: scan %zu started at %llu us\n", i, (unsigned long long)scan_times[i]);
+            failures++;
+            break;
+        }
+    }
+    for (size_t i = slow_scans + 1; i < scan_count; i++)
+    {
+        if (scan_times[i] - scan_times[i - 1] != FAST_SCAN_PERIOD_US)
+        {
+            printf("FAIL: scan %zu started %llu us after the previous one\n", i, (unsigned long long)(scan_times[i] - scan_times[i - 1]));
+            failures++;
+            break;
+        }
+    }
+    if (send_count != scan_count)
+    {
+        printf("FAIL: structure should be sent once after every scan\n");
+        failures++;
+    }
+
+    // A command waits at most one RX period, unless a scan and send are running when it arrives:
+    if (commands_handled != COMMAND_COUNT || max_command_latency_us > RX_PERIOD_US + SCAN_DURATION_US + SEND_DURATION_US)
+    {
+        printf("FAIL: commands handled too late\n");
+        failures++;
+    }
+
+    // An interrupt's task runs as soon as the current task finishes:
+    if (irqs_handled != IRQ_COUNT || max_irq_latency_us > SCAN_DURATION_US + SEND_DURATION_US)
+    {
+        printf("FAIL: interrupts handled too late\n");
+        failures++;
+    }
+
+    if (failures > 0)
+    {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}
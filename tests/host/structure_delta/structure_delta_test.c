@@ -0,0 +1,426 @@
+#include "structure_delta.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SCAN_PERIOD_MS 50
+#define BT_BAUD_RATE 9600
+
+// The app's copy of the structure, built up only from the messages it received:
+static structure_snapshot_t app_structure;
+static structure_delta_t delta;
+static structure_snapshot_t structure;
+static uint8_t message[STRUCTURE_DELTA_MAX_MESSAGE_SIZE];
+static uint32_t now_ms = 0;
+static unsigned int scan_count = 0;
+static unsigned int failures = 0;
+static size_t total_delta_bytes = 0;
+static size_t total_full_bytes = 0;
+static size_t total_compact_bytes = 0;
+
+static void app_set_block(size_t grid_tile, size_t height, uint8_t block_data)
+{
+    uint8_t *stack = &app_structure.blocks[grid_tile * app_structure.height_limit];
+    stack[height] = block_data;
+
+    // Work out the new stack height from the blocks, since removed blocks are sent as zero:
+    size_t stack_height = 0;
+    while (stack_height < app_structure.height_limit && stack[stack_height] != 0x00)
+    {
+        stack_height++;
+    }
+    app_structure.stack_height[grid_tile] = stack_height;
+}
+
+// Applies a compact snapshot like the app would:
+static void app_receive_compact(const uint8_t *data, size_t length)
+{
+    bool is_wide = data[0] & STRUCTURE_COMMAND_WIDE;
+    bool is_run_length = data[0] & STRUCTURE_COMMAND_RUN_LENGTH;
+    size_t index = 2;
+    size_t tile_count = is_wide ? (data[index++] << 8) : 0;
+    tile_count |= data[index++];
+
+    structure_delta_clear_snapshot(&app_structure, tile_count, structure.height_limit);
+    const uint8_t *heights = &data[index];
+    index += tile_count;
+
+    size_t run_length = 0;
+    uint8_t run_block = 0;
+    for (size_t grid_tile = 0; grid_tile < tile_count; grid_tile++)
+    {
+        for (size_t height = 0; height < heights[grid_tile]; height++)
+        {
+            if (run_length == 0)
+            {
+                if (is_run_length && data[index] == STRUCTURE_RUN_MARKER)
+                {
+                    run_length = data[index + 1];
+                    run_block = data[index + 2];
+                    index += 3;
+                }
+                else
+                {
+                    run_length = 1;
+                    run_block = data[index++];
+                }
+            }
+            app_set_block(grid_tile, height, run_block);
+            run_length--;
+        }
+    }
+
+    if (index != length || run_length != 0)
+    {
+        printf("  FAIL: compact snapshot length %zu doesn't match its blocks (%zu bytes)\n", length, index);
+        failures++;
+    }
+}
+
+// Applies a message like the app would, returning the sequence number to acknowledge:
+static uint8_t app_receive(const uint8_t *data, size_t length)
+{
+    if ((data[0] & 0xF0) == STRUCTURE_COMMAND_COMPACT)
+    {
+        app_receive_compact(data, length);
+        return data[1];
+    }
+
+    bool is_wide = data[0] & STRUCTURE_COMMAND_WIDE;
+    uint8_t command = data[0] & ~STRUCTURE_COMMAND_WIDE;
+
+    if (command == STRUCTURE_COMMAND_KEYFRAME)
+    {
+        // The app learns the grid size some other way. Here it's just copied:
+        structure_delta_clear_snapshot(&app_structure, structure.tile_count, structure.height_limit);
+    }
+
+    size_t header_length = is_wide ? 4 : 3;
+    size_t entry_length = is_wide ? 3 : 2;
+    size_t entry_count = is_wide ? (data[2] << 8) | data[3] : data[2];
+    if (header_length + entry_length * entry_count != length)
+    {
+        printf("  FAIL: message length %zu doesn't match %zu entries\n", length, entry_count);
+        failures++;
+    }
+
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        const uint8_t *entry = &data[header_length + entry_length * i];
+        if (is_wide)
+        {
+            app_set_block(entry[0], entry[1], entry[2]);
+        }
+        else
+        {
+            app_set_block(entry[0] >> 4, entry[0] & 0x0F, entry[1]);
+        }
+    }
+
+    return data[1];
+}
+
+static void set_stack(size_t grid_tile, const uint8_t *blocks, size_t stack_height)
+{
+    uint8_t *stack = &structure.blocks[grid_tile * structure.height_limit];
+    memset(stack, 0, structure.height_limit);
+    memcpy(stack, blocks, stack_height);
+    structure.stack_height[grid_tile] = stack_height;
+}
+
+// Runs one scan through the encoder. If 'deliver_ack' is false the app's acknowledgement is lost.
+static size_t scan(const char *label, bool deliver_ack)
+{
+    uint8_t full_message[STRUCTURE_DELTA_MAX_MESSAGE_SIZE];
+    size_t full_length = structure_delta_encode_full(&structure, full_message);
+    size_t compact_length = structure_delta_encode_compact(&structure, 0, full_message);
+    size_t length = structure_delta_encode(&delta, &structure, now_ms, message);
+
+    const char *type = "-";
+    if (length > 0)
+    {
+        structure_delta_mark_sent(&delta, now_ms);
+
+        switch (message[0] & ~STRUCTURE_COMMAND_WIDE)
+        {
+            case STRUCTURE_COMMAND_KEYFRAME:
+                type = "keyframe";
+                break;
+            case STRUCTURE_COMMAND_DELTA:
+                type = "delta";
+                break;
+            default:
+                type = "compact";
+                break;
+        }
+        uint8_t sequence = app_receive(message, length);
+        if (deliver_ack)
+        {
+            structure_delta_acknowledge(&delta, sequence);
+        }
+    }
+
+    printf("scan %3u  %-22s %-8s %4zu bytes (full: %3zu bytes, compact: %3zu bytes)\n", scan_count, label, type,
+        length, full_length, compact_length);
+
+    total_delta_bytes += length;
+    total_full_bytes += full_length;
+    total_compact_bytes += compact_length;
+    scan_count++;
+    now_ms += SCAN_PERIOD_MS;
+
+    return length;
+}
+
+static void check_app_matches(const char *when)
+{
+    if (memcmp(&app_structure, &structure, sizeof(structure)) != 0)
+    {
+        printf("  FAIL: app structure doesn't match after %s\n", when);
+        failures++;
+    }
+}
+
+static void check_silent(size_t length, const char *when)
+{
+    if (length != 0)
+    {
+        printf("  FAIL: %zu bytes sent %s\n", length, when);
+        failures++;
+    }
+}
+
+// A keyframe for a big grid takes longer to send over bluetooth than the acknowledgement timeout.
+// The timeout should only start once the last byte has been sent, so that an acknowledgement
+// arriving soon after that is still accepted and the next change goes out as a delta.
+static void test_slow_link()
+{
+    size_t wall_height = BLOCK_IO_MAX_BLOCKS / BLOCK_IO_MAX_TILE_COUNT;
+    uint8_t wall[BLOCK_IO_MAX_HEIGHT_LIMIT];
+    memset(wall, 0x34, sizeof(wall));
+    structure_delta_clear_snapshot(&structure, BLOCK_IO_MAX_TILE_COUNT, wall_height);
+    for (size_t grid_tile = 0; grid_tile < structure.tile_count; grid_tile++)
+    {
+        set_stack(grid_tile, wall, wall_height);
+    }
+    delta.is_compact = false;
+    structure_delta_reset(&delta);
+
+    size_t length = structure_delta_encode(&delta, &structure, now_ms, message);
+    uint32_t transmit_ms = length * 10 * 1000 / BT_BAUD_RATE;
+    printf("slow link: %zu byte keyframe takes %u ms to send at %u baud\n", length, transmit_ms, BT_BAUD_RATE);
+    if (transmit_ms <= STRUCTURE_DELTA_ACK_TIMEOUT_MS)
+    {
+        printf("  FAIL: the keyframe should take longer to send than the acknowledgement timeout\n");
+        failures++;
+    }
+
+    // Nothing else should be sent while the keyframe is still going out, however long it takes:
+    uint32_t sent_ms = now_ms + transmit_ms;
+    for (now_ms += SCAN_PERIOD_MS; now_ms < sent_ms; now_ms += SCAN_PERIOD_MS)
+    {
+        check_silent(structure_delta_encode(&delta, &structure, now_ms, message), "while the keyframe was being sent");
+    }
+    structure_delta_mark_sent(&delta, sent_ms);
+    uint8_t sequence = app_receive(message, length);
+
+    // The acknowledgement takes a while to come back, but well within the timeout:
+    now_ms = sent_ms + STRUCTURE_DELTA_ACK_TIMEOUT_MS / 2;
+    structure_delta_acknowledge(&delta, sequence);
+
+    uint8_t single[1] = { 0x48 };
+    set_stack(10, single, 1);
+    length = structure_delta_encode(&delta, &structure, now_ms, message);
+    if (length == 0 || message[0] != (STRUCTURE_COMMAND_DELTA | STRUCTURE_COMMAND_WIDE))
+    {
+        printf("  FAIL: expected a delta once the late acknowledgement arrived\n");
+        failures++;
+    }
+    else
+    {
+        structure_delta_mark_sent(&delta, now_ms);
+        structure_delta_acknowledge(&delta, app_receive(message, length));
+    }
+    check_app_matches("a slow keyframe");
+}
+
+int main()
+{
+    structure_delta_reset(&delta);
+    structure_delta_clear_snapshot(&structure, BLOCK_IO_TILES_PER_BOARD, BLOCK_IO_DEFAULT_HEIGHT_LIMIT);
+
+    // Empty grid. Only the first scan should send anything:
+    scan("empty (keyframe)", true);
+    for (int i = 0; i < 5; i++)
+    {
+        check_silent(scan("empty", true), "while nothing changed");
+    }
+    check_app_matches("empty grid");
+
+    // Build a tower on the middle tile, one block at a time:
+    uint8_t tower[8] = { 0x14, 0x21, 0x36, 0x43, 0x54, 0x61, 0x72, 0x83 };
+    for (size_t height = 1; height <= 8; height++)
+    {
+        set_stack(4, tower, height);
+        scan("add block", true);
+        check_app_matches("adding a block");
+    }
+
+    // Leave it alone for a while:
+    for (int i = 0; i < 10; i++)
+    {
+        check_silent(scan("idle", true), "while nothing changed");
+    }
+
+    // Rotate the bottom block, which changes the absolute rotation of the whole stack:
+    for (size_t height = 0; height < 8; height++)
+    {
+        tower[height] = (tower[height] & 0xFC) | ((tower[height] + 1) & 0x03);
+    }
+    set_stack(4, tower, 8);
+    scan("rotate base", true);
+    check_app_matches("rotating");
+
+    // Knock the top half off:
+    set_stack(4, tower, 4);
+    scan("remove 4 blocks", true);
+    check_app_matches("removing blocks");
+
+    // Fill every tile with a few blocks at once:
+    for (size_t grid_tile = 0; grid_tile < structure.tile_count; grid_tile++)
+    {
+        uint8_t stack[3] = { 0x10 + grid_tile * 4, 0x50 + grid_tile * 4, 0x90 + grid_tile * 4 };
+        set_stack(grid_tile, stack, 3);
+    }
+    scan("fill grid", true);
+    check_app_matches("filling the grid");
+
+    // Lose the acknowledgement. Nothing should be sent until the timeout, then a keyframe:
+    uint8_t single[1] = { 0xA8 };
+    set_stack(0, single, 1);
+    scan("change (ack lost)", false);
+    size_t timeout_scans = STRUCTURE_DELTA_ACK_TIMEOUT_MS / SCAN_PERIOD_MS;
+    for (size_t i = 1; i < timeout_scans; i++)
+    {
+        check_silent(scan("waiting for ack", true), "while waiting for an acknowledgement");
+    }
+    size_t length = scan("ack timeout", true);
+    if (length == 0 || message[0] != STRUCTURE_COMMAND_KEYFRAME)
+    {
+        printf("  FAIL: expected a keyframe after the acknowledgement timed out\n");
+        failures++;
+    }
+    check_app_matches("recovering from a lost acknowledgement");
+
+    // Keep changing one block. Every so often a keyframe should be sent instead of a delta:
+    size_t keyframes = 0;
+    for (size_t i = 0; i < 2 * STRUCTURE_DELTA_KEYFRAME_INTERVAL + 2; i++)
+    {
+        single[0] = 0x04 * (i % 60 + 1);
+        set_stack(8, single, 1);
+        scan("toggle block", true);
+        keyframes += (message[0] == STRUCTURE_COMMAND_KEYFRAME);
+        check_app_matches("toggling a block");
+    }
+    if (keyframes != 2)
+    {
+        printf("  FAIL: expected 2 periodic keyframes, got %zu\n", keyframes);
+        failures++;
+    }
+
+    // A single board must keep using the original one byte positions:
+    if (structure_delta_is_wide(structure.tile_count, structure.height_limit))
+    {
+        printf("  FAIL: a single board shouldn't need wide positions\n");
+        failures++;
+    }
+
+    // Chain four boards together. Positions no longer fit in a byte, so the next message should
+    // be a wide keyframe, followed by wide deltas:
+    structure_delta_clear_snapshot(&structure, 4 * BLOCK_IO_TILES_PER_BOARD, BLOCK_IO_DEFAULT_HEIGHT_LIMIT);
+    for (size_t grid_tile = 0; grid_tile < structure.tile_count; grid_tile += 5)
+    {
+        set_stack(grid_tile, tower, 1 + grid_tile % 8);
+    }
+    length = scan("4 boards (keyframe)", true);
+    if (length == 0 || message[0] != (STRUCTURE_COMMAND_KEYFRAME | STRUCTURE_COMMAND_WIDE))
+    {
+        printf("  FAIL: expected a wide keyframe after the grid grew\n");
+        failures++;
+    }
+    check_app_matches("growing the grid");
+
+    set_stack(34, tower, 8);
+    length = scan("add stack (board 4)", true);
+    if (length != 4 + 3 * 8 || message[0] != (STRUCTURE_COMMAND_DELTA | STRUCTURE_COMMAND_WIDE))
+    {
+        printf("  FAIL: expected a wide delta with 8 entries\n");
+        failures++;
+    }
+    check_app_matches("adding a stack to the last board");
+
+    set_stack(34, tower, 0);
+    scan("remove stack (board 4)", true);
+    check_app_matches("removing a stack from the last board");
+
+    // Switch to compact keyframes. Resetting should keep them compact:
+    delta.is_compact = true;
+    structure_delta_reset(&delta);
+    for (size_t grid_tile = 0; grid_tile < structure.tile_count; grid_tile++)
+    {
+        set_stack(grid_tile, tower, grid_tile % 9);
+    }
+    size_t full_length = structure_delta_encode_full(&structure, message);
+    length = scan("4 boards (compact)", true);
+    if (length == 0 || message[0] != STRUCTURE_COMMAND_COMPACT || 2 * length > full_length)
+    {
+        printf("  FAIL: expected a compact keyframe at most half the size of a full structure\n");
+        failures++;
+    }
+    check_app_matches("a compact keyframe");
+
+    set_stack(7, tower, 2);
+    length = scan("remove blocks", true);
+    if (length == 0 || (message[0] & ~STRUCTURE_COMMAND_WIDE) != STRUCTURE_COMMAND_DELTA)
+    {
+        printf("  FAIL: expected a delta after a compact keyframe\n");
+        failures++;
+    }
+    check_app_matches("a delta after a compact keyframe");
+
+    // Walls of the same block should be run-length coded, including runs that carry on from one
+    // stack to the next and runs longer than the longest that fits in a message:
+    size_t wall_height = BLOCK_IO_MAX_BLOCKS / BLOCK_IO_MAX_TILE_COUNT;
+    structure_delta_clear_snapshot(&structure, BLOCK_IO_MAX_TILE_COUNT, wall_height);
+    uint8_t wall[BLOCK_IO_MAX_HEIGHT_LIMIT];
+    memset(wall, 0x24, sizeof(wall));
+    for (size_t grid_tile = 0; grid_tile < structure.tile_count; grid_tile++)
+    {
+        wall[grid_tile % 4] = 0x28; // breaks up the runs a little
+        set_stack(grid_tile, wall, (grid_tile < 100) ? wall_height : grid_tile % 5);
+        wall[grid_tile % 4] = 0x24;
+    }
+    structure_delta_reset(&delta);
+    full_length = structure_delta_encode_full(&structure, message);
+    length = scan("walls (compact)", true);
+    if (length == 0 || message[0] != (STRUCTURE_COMMAND_COMPACT | STRUCTURE_COMMAND_WIDE | STRUCTURE_COMMAND_RUN_LENGTH)
+        || 3 * length > full_length)
+    {
+        printf("  FAIL: expected a wide, run-length coded compact keyframe\n");
+        failures++;
+    }
+    check_app_matches("a run-length coded keyframe");
+
+    test_slow_link();
+
+    printf("\n%u scans: %zu bytes with deltas, %zu bytes with full structures, %zu bytes with compact structures\n",
+        scan_count, total_delta_bytes, total_full_bytes, total_compact_bytes);
+
+    if (failures > 0)
+    {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("Passed\n");
+    return 0;
+}